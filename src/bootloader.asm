@@ -170,64 +170,52 @@ search_kernel:
 
 
 ;===============================================
-; Loads the specific sector of a file.
+; Loads the run of consecutive clusters starting
+; at the current one with a single read; a run
+; ends where the chain jumps or the track ends.
 ;===============================================
 load_file_sector:
     mov     ax,word [kernel_cluster]
+    mov     di,ax                               ; Last cluster of the run
     add     ax,31                               ; This is FAT12 specific
     call    setLoadRegisters
+    mov     bx,1                                ; Sectors in the run
 
+.extend:
+    mov     ax,di
+    call    get_next_cluster
+    mov     word [kernel_cluster],ax            ; Store the logical id of the next cluster
+    inc     di
+    cmp     ax,di
+    jne     .read                               ; The chain jumps elsewhere
+    mov     al,cl
+    add     al,bl
+    cmp     al,byte [SectorsPerTrack]
+    ja      .read                               ; The next cluster is on another track
+    inc     bx
+    jmp     .extend
+
+.read:                                          ; The kernel stays below 64KB, clear of DMA boundaries
+    mov     di,bx
     mov     si,SEG_KERNEL
     mov     es,si
     mov     bx,word [kernel_pointer]            ; Current offset in the kernel segment to write to
 
+    mov     ax,di
     mov     ah,2
-    mov     al,1
 
     stc
     int     13h
     mov     word [dbg_error],6
     jc      reboot
-    cmp     al,1
+    cmp     ax,di
     mov     word [dbg_error],7
-    jne     reboot
-    jmp     load_next_cluster
-
-
-;===============================================
-; Tries to load the next cluster of the kernel.
-;===============================================
-load_next_cluster:
-    mov     ax,word [kernel_cluster]            ; Take the logical id of the cluster that has been read
-    mov     dx,0
-    mov     bx,3
-    mul     bx                                  ; dx:ax = ax * bx
-    mov     bx,2                                ; dx = (ax % bx)
-    div     bx                                  ; ax = (ax / bx)
-
-    mov     si,SEG_FAT_TABLE                    ; The next cluster info resides in the FAT table
-    mov     es,si
-    mov     si,ax                               ; The offset has been calculated
-    mov     ax,word [es:si]                     ; Take the next cluster information
-
-    test    dx,dx
-    je      .even
-
-.odd:
-    shr     ax,4
-    jmp     .continue
-
-.even:
-    and     ax,0FFFh
-
-.continue:
-    mov     word [kernel_cluster],ax            ; Store the logical id of the next cluster
-
-    cmp     ax,0FF8h                            ; 0FF8h and higher indicate end-of-file
-    jae     .boot_kernel
+    jne     reboot                              ; Not enough sectors were read
 
-    add     word [kernel_pointer],512           ; Sectors are 512 bytes in size, so read
-    jmp     load_file_sector                    ;  the next one behind the current one
+    shl     di,9                                ; Sectors are 512 bytes in size, so read
+    add     word [kernel_pointer],di            ;  the next run behind the current one
+    cmp     word [kernel_cluster],0FF8h         ; 0FF8h and higher indicate end-of-file
+    jb      load_file_sector
 
 
 .boot_kernel:                                   ; Jumps to the kernel code
@@ -242,6 +230,28 @@ load_next_cluster:
 
 
 
+;===============================================
+; Gets the next cluster from the FAT table.
+;   In: ax
+;   Out: ax
+;===============================================
+get_next_cluster:
+    mov     si,ax
+    shr     si,1
+    add     si,ax                               ; The offset is 1.5 bytes per cluster
+    test    al,1
+    mov     ax,word [si+(SEG_FAT_TABLE-SEG_BOOTLOADER)*16]
+    je      .even
+
+.odd:
+    shr     ax,4
+
+.even:
+    and     ax,0FFFh
+    ret
+
+
+
 ;===============================================
 ; Prints a random string to the screen.
 ;===============================================
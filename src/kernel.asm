@@ -7,8 +7,12 @@ jmp near kernel
 msg_success db "Kernel has been loaded...", 0Dh, 0Ah, 0
 cmd_bin     db 'CMD     BIN', 0
 cmd_error   db 'Could not load CMD.bin', 0Dh, 0Ah, 0
+cache_error db 'Could not cache the FAT', 0Dh, 0Ah, 0
+ram_success db 'The floppy has been copied into extended memory', 0Dh, 0Ah, 0
+ram_error   db 'Could not copy the floppy into extended memory', 0Dh, 0Ah, 0
 
 kernel_var  dw 512
+iKernel_Calls   times INT_SERVICES dd 0         ; Calls per int 70h service
 
 test_err    db 'Test failed', 0Dh, 0Ah, 0
 test_var    times 32 db 0
@@ -33,6 +37,30 @@ kernel:
     mov     si,msg_success
     call    print
 
+    ; Set up the sector cache for file data
+    call    cache_init
+
+%ifdef RAMDISK
+    ; Run from a copy of the floppy in extended memory
+    call    ram_init
+    mov     si,ram_success
+    test    ax,ax
+    je      .ramdisk
+    mov     si,ram_error
+
+.ramdisk:
+    call    print
+%endif
+
+    ; Keep the FAT and root directory resident
+    call    fat_cacheInit
+    test    ax,ax
+    je      .cached
+    mov     si,cache_error
+    call    print
+    jmp     $
+
+.cached:
 %ifndef TESTING
 
 ; Regular operations
@@ -141,51 +169,64 @@ kernel_interrupts:
     mov     gs,bx
     pop     bx
 
-    cmp     ax,INT_LOAD_FILE
-    je      .loadFile
-    cmp     ax,INT_READ_FILE
-    je      .readFile
-    cmp     ax,INT_WRITE_FILE
-    je      .writeFile
-    cmp     ax,INT_EXEC_PROGRAM
-    je      .execProgram
-    cmp     ax,INT_GPU_GRAPHICS
-    je      .gpuGraphics
-    cmp     ax,INT_GPU_TEXT
-    je      .gpuText
-
-    cmp     ax,INT_KEYPRESS
-    je      .getChar
-    cmp     ax,INT_GET_CURSOR_POS
-    je      .getCursorPos
-    cmp     ax,INT_SET_CURSOR_POS
-    je      .setCursorPos
-
-    cmp     ax,INT_DRAW_PIXEL
-    je      .drawPixel
-    cmp     ax,INT_DRAW_BUFFER
-    je      .drawBuffer
-
-    cmp     ax,INT_CLEAR_SCREEN
-    je      .clearScreen
-    cmp     ax,INT_PRINT_STRING
-    je      .printString
-    cmp     ax,INT_PRINT_HEX
-    je      .printHex
-    cmp     ax,INT_PRINT_CHAR
-    je      .printChar
-    cmp     ax,INT_PRINT_NEWLINE
-    je      .printNewLine
-    cmp     ax,INT_PRINTN_STRING
-    je      .printNString
-    cmp     ax,INT_PRINT_COLORED
-    je      .printColored
+    cmp     ax,INT_SERVICES                     ; Unknown services do nothing
+    jae     .return
+
+    push    bx                                  ; Becomes the address of the service
+    push    bx
+    mov     bx,ax
+    shl     bx,2
+    add     dword [gs:iKernel_Calls+bx],1
+    shr     bx,1
+    mov     bx,word [gs:.services+bx]
+    push    bp
+    mov     bp,sp
+    mov     word [bp+4],bx
+    pop     bp
+    pop     bx
+    ret                                         ; Jumps to the service
 
 .return:
     pop     gs
     iret
 
 
+; The services, indexed by their number; append new ones in the
+; same order as const.inc
+.services:
+    dw      .return                             ; INT_RESERVED
+    dw      .loadFile                           ; INT_LOAD_FILE
+    dw      .execProgram                        ; INT_EXEC_PROGRAM
+    dw      .gpuGraphics                        ; INT_GPU_GRAPHICS
+    dw      .gpuText                            ; INT_GPU_TEXT
+    dw      .writeFile                          ; INT_WRITE_FILE
+    dw      .readFile                           ; INT_READ_FILE
+    dw      .sync                               ; INT_SYNC
+    dw      .getChar                            ; INT_KEYPRESS
+    dw      .getCursorPos                       ; INT_GET_CURSOR_POS
+    dw      .setCursorPos                       ; INT_SET_CURSOR_POS
+    dw      .cacheStats                         ; INT_CACHE_STATS
+    dw      .flush                              ; INT_FLUSH
+    dw      .drawPixel                          ; INT_DRAW_PIXEL
+    dw      .drawBuffer                         ; INT_DRAW_BUFFER
+    dw      .serviceCalls                       ; INT_SERVICE_CALLS
+    dw      .clearScreen                        ; INT_CLEAR_SCREEN
+    dw      .printString                        ; INT_PRINT_STRING
+    dw      .printHex                           ; INT_PRINT_HEX
+    dw      .printChar                          ; INT_PRINT_CHAR
+    dw      .printNewLine                       ; INT_PRINT_NEWLINE
+    dw      .printNString                       ; INT_PRINTN_STRING
+    dw      .printColored                       ; INT_PRINT_COLORED
+    dw      .fileOpen                           ; INT_FILE_OPEN
+    dw      .fileRead                           ; INT_FILE_READ
+    dw      .fileWrite                          ; INT_FILE_WRITE
+    dw      .fileSeek                           ; INT_FILE_SEEK
+    dw      .fileClose                          ; INT_FILE_CLOSE
+%if ($-.services) != INT_SERVICES*2
+%error "The service table does not match INT_SERVICES"
+%endif
+
+
 ; short ax loadFile( void * es:di , char * ds:si )
 ; short ax loadFile( void * dest, char * error )
 .loadFile:
@@ -263,6 +304,15 @@ kernel_interrupts:
     call    fat_writeFile2
     add     sp,10
 
+    push    ax          ; the cached FAT and root are
+    call    fat_sync    ; written back, even on failure
+    mov     cx,ax
+    pop     ax
+    test    ax,ax
+    jne     .wo_restore
+    mov     ax,cx
+
+.wo_restore:
     pop     cx          ; restore
     pop     di
     pop     si
@@ -271,6 +321,103 @@ kernel_interrupts:
 
     jmp     .return
 
+; Writes the changed FAT and root sectors back
+;   Out:
+;     ax - Zero if successful
+.sync:
+    call    fat_sync
+    jmp     .return
+
+; Writes everything back to the floppy, including
+; the RAM disk when the kernel runs from one
+;   Out:
+;     ax - Zero if successful
+.flush:
+    call    fat_sync
+    test    ax,ax
+    jne     .return
+    call    ram_flush
+    jmp     .return
+
+; Counters of the sector cache
+;   Out:
+;     ax - Sectors served from the cache
+;     dx - Sectors read from the medium
+;     cx - Number of slots
+.cacheStats:
+    mov     ax,word [gs:iCache_Hits]
+    mov     dx,word [gs:iCache_Misses]
+    mov     cx,word [gs:iCache_Slots]
+    jmp     .return
+
+; Opens a file; it is created when it does not exist
+;   In:
+;     [ds:si] - File_name
+;   Out:
+;     ax - Handle (-1 if error)
+.fileOpen:
+    call    fat_handleOpen
+    jmp     .return
+
+; Reads from the position of an open file
+;   In:
+;     bx - Handle
+;     [es:di] - Destination
+;     cx - Number of bytes
+;   Out:
+;     ax - Bytes read (-1 if error)
+.fileRead:
+    call    fat_handleRead
+    jmp     .return
+
+; Writes at the position of an open file
+;   In:
+;     bx - Handle
+;     [ds:si] - Data
+;     cx - Number of bytes
+;   Out:
+;     ax - Bytes written (-1 if error)
+.fileWrite:
+    call    fat_handleWrite
+    jmp     .return
+
+; Moves the position of an open file
+;   In:
+;     bx - Handle
+;     dx:cx - Position
+;   Out:
+;     ax - Zero if successful
+.fileSeek:
+    call    fat_handleSeek
+    jmp     .return
+
+; Closes a file and writes everything back
+;   In:
+;     bx - Handle
+;   Out:
+;     ax - Zero if successful
+.fileClose:
+    call    fat_handleClose
+    jmp     .return
+
+; How often a service has been called since boot
+;   In:
+;     cx - Service
+;   Out:
+;     dx:ax - Number of calls (-1 if the service does not exist)
+.serviceCalls:
+    mov     ax,0FFFFh
+    mov     dx,ax
+    cmp     cx,INT_SERVICES
+    jae     .return
+    push    bx
+    mov     bx,cx
+    shl     bx,2
+    mov     ax,word [gs:iKernel_Calls+bx]
+    mov     dx,word [gs:iKernel_Calls+bx+2]
+    pop     bx
+    jmp     .return
+
 ; void ax execProgram( char * ds:si )
 .execProgram:
     ; NOTE:
@@ -436,6 +583,8 @@ kernel_interrupts:
 ;===========
 %include "src/kernel/std.inc"
 %include "src/kernel/fat12.inc"
+%include "src/kernel/cache.inc"
+%include "src/kernel/ramdisk.inc"
 %include "src/kernel/tests.inc"
 
 
@@ -0,0 +1,31 @@
+[BITS 16]
+; [ORG 0x15E00]
+jmp main
+
+%include "src\const.inc"
+
+msg_done    db 'The floppy is up to date', 0Dh, 0Ah, 0
+msg_error   db 'Could not write back to the floppy', 0Dh, 0Ah, 0
+
+;===============================================
+; Entry point
+;===============================================
+main:
+    push    ax
+    push    si
+
+    mov     ax,INT_FLUSH
+    int     70h
+
+    mov     si,msg_done
+    test    ax,ax
+    je      .print
+    mov     si,msg_error
+
+.print:
+    mov     ax,INT_PRINT_STRING
+    int     70h
+
+    pop     si
+    pop     ax
+    retf
@@ -0,0 +1,2031 @@
+/**
+ * BOOTSIM
+ *   Runs the bootloader, kernel and programs of a floppy image on an emulated
+ *   16-bit real-mode CPU, without a virtual machine. The BIOS services the
+ *   system relies on are provided by the host:
+ *     int 10h  Video; a text screen of 80x25 characters and a transcript.
+ *     int 12h  Conventional memory size.
+ *     int 13h  Floppy disk, backed by the image and timed by a drive model.
+ *     int 15h  Extended memory size (88h) and block moves (87h).
+ *     int 16h  Keyboard, fed from a script of keystrokes.
+ *   Every other interrupt goes through the interrupt vector table, so the
+ *   services the kernel registers itself, like int 70h, run as emulated code.
+ *
+ * COST MODEL
+ *   The drive is a 3.5" 1.44MB floppy spinning at 300 RPM. A request first
+ *   steps the head to the cylinder, then waits for the first sector to come
+ *   around and transfers the sectors in a single pass. The rotation continues
+ *   while the CPU runs, so reading sectors in an order that fits the rotation
+ *   pays off, just like on a real drive. The time of the instructions is
+ *   estimated from a fixed instruction rate.
+ *
+ * REMARKS
+ *   Like most floppy controllers, a request may not cross the end of a track
+ *   or a 64KB DMA boundary; such a request fails the way the BIOS would.
+ *   A run ends when the system hangs ('jmp $' or 'hlt' with interrupts off),
+ *   waits for a key after the script is exhausted, reboots, or executes an
+ *   instruction the CPU does not know. Everything is deterministic, so the
+ *   counters of a run can be compared against those of an earlier one.
+ *
+ *   The harness only uses the C++ standard library and builds anywhere, e.g.
+ *     g++ -std=c++14 -O2 -o bootsim src/tools/bootsim/bootsim.cpp
+ */
+#ifdef _MSC_VER
+#define _CRT_SECURE_NO_WARNINGS 1
+#endif
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const bool VERBOSE = false;
+
+#define CINFO(fmt, ...)     fprintf(g_console, fmt "\n", ##__VA_ARGS__)
+#define CWARN(fmt, ...)     fprintf(g_console, "WARNING: " fmt "\n", ##__VA_ARGS__)
+#define CERROR(fmt, ...)    fprintf(stderr, "ERROR: " fmt "\n", ##__VA_ARGS__)
+#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(g_console, "[VERBOSE] " fmt "\n", ##__VA_ARGS__); }
+
+#ifndef MAX_PATH
+#define MAX_PATH    260 /* Windows default is 260 */
+#endif
+
+
+/**
+ * SETTINGS
+ *   The machine and the drive that are emulated.
+ */
+#define MEMORY_SIZE             0x100000    // 1MB; the A20 line is off
+#define CONVENTIONAL_KB         640
+#define EXTENDED_KB             2048        // Above 1MB; only reachable through int 15h
+#define BOOT_SEGMENT            0x0000
+#define BOOT_OFFSET             0x7C00
+#define KERNEL_SEGMENT          0x0AE0      // SEG_KERNEL of const.inc
+#define TEXT_SEGMENT            0xB800
+#define SCREEN_COLUMNS          80
+#define SCREEN_ROWS             25
+
+#define BYTES_PER_SECTOR        512
+#define SECTORS_PER_TRACK       18
+#define NUMBER_OF_HEADS         2
+#define NUMBER_OF_CYLINDERS     80
+#define DEVICE_SIZE             (BYTES_PER_SECTOR * SECTORS_PER_TRACK * NUMBER_OF_HEADS * NUMBER_OF_CYLINDERS)
+
+#define DRIVE_RPM               300
+#define DRIVE_REVOLUTION_US     (60000000 / DRIVE_RPM)
+#define DRIVE_SECTOR_US         (DRIVE_REVOLUTION_US / SECTORS_PER_TRACK)
+#define DRIVE_STEP_US           3000        // Per cylinder stepped
+#define DRIVE_SETTLE_US         15000       // After the last step
+#define DRIVE_SPINUP_US         500000      // Before the first request
+#define BIOS_CALL_US            20          // Overhead of entering the BIOS
+#define BIOS_MOVE_US_PER_KB     50          // Block moves through protected mode
+
+#define DEFAULT_MIPS            10          // Instructions per microsecond
+#define DEFAULT_LIMIT           200000000   // Instructions before a run is cut off
+
+
+/**
+ * FLAGS
+ */
+#define F_CF    0x0001
+#define F_PF    0x0004
+#define F_AF    0x0010
+#define F_ZF    0x0040
+#define F_SF    0x0080
+#define F_TF    0x0100
+#define F_IF    0x0200
+#define F_DF    0x0400
+#define F_OF    0x0800
+
+enum { AX, CX, DX, BX, SP, BP, SI, DI };
+enum { ES, CS, SS, DS, FS, GS };
+
+enum Stop_t
+{
+    STOP_NONE = 0,
+    STOP_HANG,                              /* jmp $, or hlt without interrupts */
+    STOP_KEYS,                              /* Waits for a key the script lacks */
+    STOP_REBOOT,                            /* int 19h */
+    STOP_LIMIT,                             /* Ran into the instruction limit */
+    STOP_INVALID,                           /* Unknown instruction */
+    STOP_VECTOR                             /* Interrupt without a handler */
+};
+
+const char *g_stopNames[] = { "running", "hang", "keys exhausted", "reboot",
+    "instruction limit", "invalid instruction", "unhandled interrupt" };
+
+
+/**
+ * The counters of a run.
+ */
+typedef struct
+{
+    uint64_t    instructions;               /* Instructions executed */
+    uint64_t    biosCalls;                  /* Interrupts serviced by the host */
+    uint64_t    videoCalls;                 /* int 10h */
+    uint64_t    diskCalls;                  /* int 13h */
+    uint64_t    keyCalls;                   /* int 16h */
+    uint64_t    otherCalls;                 /* Other host services */
+    uint64_t    softCalls;                  /* Interrupts through the vector table */
+    uint64_t    sectorsRead;
+    uint64_t    sectorsWritten;
+    uint64_t    diskErrors;                 /* Requests the controller refused */
+    uint64_t    seeks;                      /* Cylinder changes */
+    uint64_t    cylinders;                  /* Cylinders stepped over */
+    uint64_t    trackChanges;               /* Cylinder or head changes */
+    uint64_t    diskUs;                     /* Time spent in the drive */
+    uint64_t    biosUs;                     /* Overhead of the host services */
+} Counters_t;
+
+
+/**
+ * MACHINE
+ */
+uint8_t     g_memory[MEMORY_SIZE];
+uint8_t     g_extended[EXTENDED_KB * 1024]; /* Memory above 1MB */
+uint32_t    g_regs[8];                      /* General registers; 32 bits wide */
+uint16_t    g_sregs[6];                     /* Segment registers */
+uint16_t    g_ip;
+uint32_t    g_flags;
+Stop_t      g_stop;
+
+std::vector<uint8_t> g_image;               /* The floppy image */
+std::string g_keys;                         /* The keystrokes still to come */
+std::string g_transcript;                   /* Everything printed by teletype */
+Counters_t  g_counters;
+
+int         g_cursorRow, g_cursorColumn;
+int         g_cylinder;                     /* The cylinder the head is on */
+int         g_head;                         /* The head last used */
+bool        g_spinning;                     /* Whether the motor is up to speed */
+bool        g_echo;                         /* Prints the transcript while running */
+bool        g_imageChanged;
+
+uint64_t    g_mips;
+uint64_t    g_limit;
+
+char        g_pathImage[MAX_PATH];
+char        g_pathBoot[MAX_PATH];
+char        g_pathKernel[MAX_PATH];
+char        g_pathReport[MAX_PATH];
+char        g_pathSave[MAX_PATH];
+std::vector<std::string> g_expected;        /* Text the transcript must contain */
+FILE       *g_console = stdout;
+
+
+/**
+ * Sets the default values for the dynamic settings.
+ */
+void setDefaults(void)
+{
+    memset(g_pathImage, 0, MAX_PATH);
+    memset(g_pathBoot, 0, MAX_PATH);
+    memset(g_pathKernel, 0, MAX_PATH);
+    memset(g_pathReport, 0, MAX_PATH);
+    memset(g_pathSave, 0, MAX_PATH);
+    g_mips = DEFAULT_MIPS;
+    g_limit = DEFAULT_LIMIT;
+    g_echo = true;
+}
+
+
+
+/**
+ * MEMORY
+ *   Addresses wrap at 1MB, like they do with the A20 line disabled.
+ */
+inline uint32_t MEM_linear(uint16_t seg, uint32_t offset)
+{
+    return ((static_cast<uint32_t>(seg) << 4) + offset) & (MEMORY_SIZE - 1);
+}
+
+inline uint8_t MEM_read8(uint32_t addr)
+{
+    return g_memory[addr & (MEMORY_SIZE - 1)];
+}
+
+inline uint16_t MEM_read16(uint32_t addr)
+{
+    return MEM_read8(addr) | (MEM_read8(addr + 1) << 8);
+}
+
+inline uint32_t MEM_read32(uint32_t addr)
+{
+    return MEM_read16(addr) | (static_cast<uint32_t>(MEM_read16(addr + 2)) << 16);
+}
+
+inline void MEM_write8(uint32_t addr, uint8_t value)
+{
+    g_memory[addr & (MEMORY_SIZE - 1)] = value;
+}
+
+inline void MEM_write16(uint32_t addr, uint16_t value)
+{
+    MEM_write8(addr, value & 0xFF);
+    MEM_write8(addr + 1, value >> 8);
+}
+
+inline void MEM_write32(uint32_t addr, uint32_t value)
+{
+    MEM_write16(addr, value & 0xFFFF);
+    MEM_write16(addr + 2, value >> 16);
+}
+
+inline uint32_t MEM_read(uint32_t addr, int size)
+{
+    return (size == 1) ? MEM_read8(addr) : (size == 2) ? MEM_read16(addr) : MEM_read32(addr);
+}
+
+inline void MEM_write(uint32_t addr, uint32_t value, int size)
+{
+    if (size == 1)          MEM_write8(addr, static_cast<uint8_t>(value));
+    else if (size == 2)     MEM_write16(addr, static_cast<uint16_t>(value));
+    else                    MEM_write32(addr, value);
+}
+
+
+
+/**
+ * REGISTERS
+ *   Byte registers 0-3 are the low halves of AX-BX, 4-7 the high halves.
+ */
+inline uint32_t REG_get(int reg, int size)
+{
+    if (size == 1)  return (reg < 4) ? (g_regs[reg] & 0xFF) : ((g_regs[reg - 4] >> 8) & 0xFF);
+    if (size == 2)  return g_regs[reg] & 0xFFFF;
+    return g_regs[reg];
+}
+
+inline void REG_set(int reg, uint32_t value, int size)
+{
+    if (size == 1)
+    {
+        if (reg < 4)    g_regs[reg] = (g_regs[reg] & 0xFFFFFF00) | (value & 0xFF);
+        else            g_regs[reg - 4] = (g_regs[reg - 4] & 0xFFFF00FF) | ((value & 0xFF) << 8);
+    }
+    else if (size == 2)
+    {
+        g_regs[reg] = (g_regs[reg] & 0xFFFF0000) | (value & 0xFFFF);
+    }
+    else
+    {
+        g_regs[reg] = value;
+    }
+}
+
+inline uint32_t MASK(int size)
+{
+    return (size == 4) ? 0xFFFFFFFF : ((1u << (size * 8)) - 1);
+}
+
+inline uint32_t SIGN(int size)
+{
+    return 1u << ((size * 8) - 1);
+}
+
+inline uint32_t signExtend(uint32_t value, int size)
+{
+    if (size == 1)  return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int8_t>(value)));
+    if (size == 2)  return static_cast<uint32_t>(static_cast<int32_t>(static_cast<int16_t>(value)));
+    return value;
+}
+
+inline void setFlag(uint32_t flag, bool on)
+{
+    g_flags = on ? (g_flags | flag) : (g_flags & ~flag);
+}
+
+inline bool getFlag(uint32_t flag)
+{
+    return (g_flags & flag) != 0;
+}
+
+inline bool parity(uint32_t value)
+{
+    value &= 0xFF;
+    value ^= value >> 4;
+    value ^= value >> 2;
+    value ^= value >> 1;
+    return !(value & 1);
+}
+
+/**
+ * Sets ZF, SF and PF from a result.
+ */
+inline void setResultFlags(uint32_t result, int size)
+{
+    result &= MASK(size);
+    setFlag(F_ZF, result == 0);
+    setFlag(F_SF, (result & SIGN(size)) != 0);
+    setFlag(F_PF, parity(result));
+}
+
+
+
+/**
+ * STACK
+ */
+inline void CPU_push(uint32_t value, int size)
+{
+    uint16_t sp = static_cast<uint16_t>(REG_get(SP, 2) - size);
+    REG_set(SP, sp, 2);
+    MEM_write(MEM_linear(g_sregs[SS], sp), value, size);
+}
+
+inline uint32_t CPU_pop(int size)
+{
+    uint16_t sp = static_cast<uint16_t>(REG_get(SP, 2));
+    uint32_t value = MEM_read(MEM_linear(g_sregs[SS], sp), size);
+    REG_set(SP, static_cast<uint16_t>(sp + size), 2);
+    return value;
+}
+
+
+
+/**
+ * DECODING
+ *   The state of the instruction being decoded.
+ */
+typedef struct
+{
+    int         segment;                    /* Segment override, or -1 */
+    int         operandSize;                /* 2, or 4 with 66h */
+    int         addressSize;                /* 2, or 4 with 67h */
+    int         rep;                        /* 0, 0xF2 or 0xF3 */
+    int         mod, reg, rm;
+    uint32_t    address;                    /* Linear address of a memory operand */
+    uint32_t    offset;                     /* Effective address, for lea */
+} Decode_t;
+
+Decode_t d;
+
+
+inline uint8_t CPU_fetch8(void)
+{
+    uint8_t value = MEM_read8(MEM_linear(g_sregs[CS], g_ip));
+    g_ip++;
+    return value;
+}
+
+inline uint16_t CPU_fetch16(void)
+{
+    uint16_t value = MEM_read16(MEM_linear(g_sregs[CS], g_ip));
+    g_ip += 2;
+    return value;
+}
+
+inline uint32_t CPU_fetch(int size)
+{
+    if (size == 1)  return CPU_fetch8();
+    if (size == 2)  return CPU_fetch16();
+    uint32_t low = CPU_fetch16();
+    return low | (static_cast<uint32_t>(CPU_fetch16()) << 16);
+}
+
+
+/**
+ * Decodes the ModR/M byte, and SIB byte with 32-bit addressing, and
+ * computes the address of a memory operand.
+ */
+void CPU_modrm(void)
+{
+    uint8_t modrm = CPU_fetch8();
+    uint32_t offset = 0;
+    int segment = DS;
+
+    d.mod = modrm >> 6;
+    d.reg = (modrm >> 3) & 7;
+    d.rm = modrm & 7;
+
+    if (d.mod == 3)
+    {
+        return;
+    }
+
+    if (d.addressSize == 2)
+    {
+        switch (d.rm)
+        {
+        case 0: offset = REG_get(BX, 2) + REG_get(SI, 2); break;
+        case 1: offset = REG_get(BX, 2) + REG_get(DI, 2); break;
+        case 2: offset = REG_get(BP, 2) + REG_get(SI, 2); segment = SS; break;
+        case 3: offset = REG_get(BP, 2) + REG_get(DI, 2); segment = SS; break;
+        case 4: offset = REG_get(SI, 2); break;
+        case 5: offset = REG_get(DI, 2); break;
+        case 6: offset = REG_get(BP, 2); segment = SS; break;
+        case 7: offset = REG_get(BX, 2); break;
+        }
+
+        if (d.mod == 0 && d.rm == 6)
+        {
+            offset = CPU_fetch16();
+            segment = DS;
+        }
+        else if (d.mod == 1)
+        {
+            offset += signExtend(CPU_fetch8(), 1);
+        }
+        else if (d.mod == 2)
+        {
+            offset += CPU_fetch16();
+        }
+
+        offset &= 0xFFFF;
+    }
+    else
+    {
+        int base = d.rm;
+
+        if (d.rm == 4)
+        {
+            uint8_t sib = CPU_fetch8();
+            int index = (sib >> 3) & 7;
+
+            base = sib & 7;
+            offset = (index == 4) ? 0 : (g_regs[index] << (sib >> 6));
+        }
+
+        if (base == 5 && d.mod == 0)
+        {
+            offset += CPU_fetch(4);
+        }
+        else
+        {
+            offset += g_regs[base];
+            segment = (base == SP || base == BP) ? SS : DS;
+        }
+
+        if (d.mod == 1)         offset += signExtend(CPU_fetch8(), 1);
+        else if (d.mod == 2)    offset += CPU_fetch(4);
+    }
+
+    if (d.segment >= 0)
+    {
+        segment = d.segment;
+    }
+
+    d.offset = offset;
+    d.address = MEM_linear(g_sregs[segment], offset);
+}
+
+inline uint32_t CPU_getRM(int size)
+{
+    return (d.mod == 3) ? REG_get(d.rm, size) : MEM_read(d.address, size);
+}
+
+inline void CPU_setRM(uint32_t value, int size)
+{
+    if (d.mod == 3)     REG_set(d.rm, value, size);
+    else                MEM_write(d.address, value, size);
+}
+
+
+
+/**
+ * ARITHMETIC
+ *   The eight operations of the 00h-3Fh block; the result is returned,
+ *   and flags are set like the CPU does.
+ */
+uint32_t ALU_op(int op, uint32_t a, uint32_t b, int size)
+{
+    uint32_t mask = MASK(size), sign = SIGN(size);
+    uint32_t carry = getFlag(F_CF) ? 1 : 0;
+    uint64_t wide;
+    uint32_t result;
+
+    a &= mask;
+    b &= mask;
+
+    switch (op)
+    {
+    case 0: // ADD
+    case 2: // ADC
+        carry = (op == 2) ? carry : 0;
+        wide = static_cast<uint64_t>(a) + b + carry;
+        result = static_cast<uint32_t>(wide) & mask;
+        setFlag(F_CF, wide > mask);
+        setFlag(F_OF, ((a ^ result) & (b ^ result) & sign) != 0);
+        setFlag(F_AF, ((a ^ b ^ result) & 0x10) != 0);
+        break;
+
+    case 3: // SBB
+    case 5: // SUB
+    case 7: // CMP
+        carry = (op == 3) ? carry : 0;
+        wide = static_cast<uint64_t>(a) - b - carry;
+        result = static_cast<uint32_t>(wide) & mask;
+        setFlag(F_CF, static_cast<uint64_t>(b) + carry > a);
+        setFlag(F_OF, ((a ^ b) & (a ^ result) & sign) != 0);
+        setFlag(F_AF, ((a ^ b ^ result) & 0x10) != 0);
+        break;
+
+    case 1: result = a | b; setFlag(F_CF, false); setFlag(F_OF, false); break;
+    case 4: result = a & b; setFlag(F_CF, false); setFlag(F_OF, false); break;
+    default: result = a ^ b; setFlag(F_CF, false); setFlag(F_OF, false); break;
+    }
+
+    setResultFlags(result, size);
+    return result;
+}
+
+
+/**
+ * INC and DEC leave the carry flag alone.
+ */
+uint32_t ALU_incdec(uint32_t value, bool dec, int size)
+{
+    bool carry = getFlag(F_CF);
+    uint32_t result = ALU_op(dec ? 5 : 0, value, 1, size);
+
+    setFlag(F_CF, carry);
+    return result;
+}
+
+
+/**
+ * The rotate and shift group; op is the reg field of the instruction.
+ */
+uint32_t ALU_shift(int op, uint32_t value, int count, int size)
+{
+    uint32_t mask = MASK(size), sign = SIGN(size);
+    uint32_t original = value & mask;
+
+    count &= 0x1F;
+    value &= mask;
+
+    if (count == 0)
+    {
+        return value;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        bool out;
+
+        switch (op)
+        {
+        case 0: // ROL
+            out = (value & sign) != 0;
+            value = ((value << 1) | (out ? 1 : 0)) & mask;
+            setFlag(F_CF, out);
+            break;
+        case 1: // ROR
+            out = (value & 1) != 0;
+            value = (value >> 1) | (out ? sign : 0);
+            setFlag(F_CF, out);
+            break;
+        case 2: // RCL
+            out = (value & sign) != 0;
+            value = ((value << 1) | (getFlag(F_CF) ? 1 : 0)) & mask;
+            setFlag(F_CF, out);
+            break;
+        case 3: // RCR
+            out = (value & 1) != 0;
+            value = (value >> 1) | (getFlag(F_CF) ? sign : 0);
+            setFlag(F_CF, out);
+            break;
+        case 4: // SHL
+        case 6:
+            setFlag(F_CF, (value & sign) != 0);
+            value = (value << 1) & mask;
+            break;
+        case 5: // SHR
+            setFlag(F_CF, (value & 1) != 0);
+            value >>= 1;
+            break;
+        case 7: // SAR
+            setFlag(F_CF, (value & 1) != 0);
+            value = (value >> 1) | (value & sign);
+            break;
+        }
+    }
+
+    if (op >= 4)
+    {
+        setResultFlags(value, size);
+    }
+
+    // Only defined for single shifts, but every CPU sets it the same way
+    if (op == 0 || op == 2 || op == 4 || op == 6)   setFlag(F_OF, ((value & sign) != 0) != getFlag(F_CF));
+    else if (op == 1 || op == 3)                    setFlag(F_OF, ((value ^ (value << 1)) & sign) != 0);
+    else if (op == 5)                               setFlag(F_OF, (original & sign) != 0);
+    else                                            setFlag(F_OF, false);
+
+    return value;
+}
+
+
+/**
+ * Evaluates the condition of a conditional jump, set or loop.
+ */
+bool CPU_condition(int cc)
+{
+    bool result;
+
+    switch (cc >> 1)
+    {
+    case 0: result = getFlag(F_OF); break;
+    case 1: result = getFlag(F_CF); break;
+    case 2: result = getFlag(F_ZF); break;
+    case 3: result = getFlag(F_CF) || getFlag(F_ZF); break;
+    case 4: result = getFlag(F_SF); break;
+    case 5: result = getFlag(F_PF); break;
+    case 6: result = getFlag(F_SF) != getFlag(F_OF); break;
+    default: result = getFlag(F_ZF) || (getFlag(F_SF) != getFlag(F_OF)); break;
+    }
+
+    return (cc & 1) ? !result : result;
+}
+
+
+/**
+ * The unsigned and signed multiplications and divisions of group 3. A
+ * division by zero, or one that overflows, raises interrupt 0.
+ * @return False if the division raised an exception.
+ */
+bool ALU_muldiv(int op, uint32_t operand, int size)
+{
+    uint32_t mask = MASK(size);
+    int bits = size * 8;
+
+    uint64_t low = REG_get(AX, size);
+    uint64_t high = (size == 1) ? ((REG_get(AX, 2) >> 8) & 0xFF) : REG_get(DX, size);
+    uint64_t dividend = (size == 1) ? REG_get(AX, 2) : ((high << bits) | low);
+
+    switch (op)
+    {
+    case 4: // MUL
+    {
+        uint64_t result = static_cast<uint64_t>(low) * operand;
+        bool over = (result >> bits) != 0;
+
+        if (size == 1)  REG_set(AX, static_cast<uint32_t>(result), 2);
+        else            { REG_set(AX, static_cast<uint32_t>(result), size); REG_set(DX, static_cast<uint32_t>(result >> bits), size); }
+
+        setFlag(F_CF, over);
+        setFlag(F_OF, over);
+        return true;
+    }
+
+    case 5: // IMUL
+    {
+        int64_t result = static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(low), size))) *
+            static_cast<int32_t>(signExtend(operand, size));
+        bool over = result != static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(result) & mask, size)));
+
+        if (size == 1)  REG_set(AX, static_cast<uint32_t>(result), 2);
+        else            { REG_set(AX, static_cast<uint32_t>(result), size); REG_set(DX, static_cast<uint32_t>(static_cast<uint64_t>(result) >> bits), size); }
+
+        setFlag(F_CF, over);
+        setFlag(F_OF, over);
+        return true;
+    }
+
+    case 6: // DIV
+    {
+        if (operand == 0)
+        {
+            return false;
+        }
+
+        uint64_t quotient = dividend / operand, remainder = dividend % operand;
+        if (quotient > mask)
+        {
+            return false;
+        }
+
+        if (size == 1)  REG_set(AX, static_cast<uint32_t>((remainder << 8) | quotient), 2);
+        else            { REG_set(AX, static_cast<uint32_t>(quotient), size); REG_set(DX, static_cast<uint32_t>(remainder), size); }
+        return true;
+    }
+
+    default: // IDIV
+    {
+        int64_t divisor = static_cast<int32_t>(signExtend(operand, size));
+        int64_t value = (size == 4) ? static_cast<int64_t>(dividend) :
+            static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(dividend), size * 2)));
+
+        if (divisor == 0)
+        {
+            return false;
+        }
+
+        int64_t quotient = value / divisor, remainder = value % divisor;
+        if (quotient != static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(quotient) & mask, size))))
+        {
+            return false;
+        }
+
+        if (size == 1)  REG_set(AX, static_cast<uint32_t>(((remainder & 0xFF) << 8) | (quotient & 0xFF)), 2);
+        else            { REG_set(AX, static_cast<uint32_t>(quotient), size); REG_set(DX, static_cast<uint32_t>(remainder), size); }
+        return true;
+    }
+    }
+}
+
+
+// Declared here; the BIOS is at the end of the file
+bool BIOS_service(int vector);
+
+
+/**
+ * Raises an interrupt; the BIOS services are answered by the host, all
+ * others are dispatched through the interrupt vector table.
+ */
+void CPU_interrupt(int vector)
+{
+    if (BIOS_service(vector))
+    {
+        return;
+    }
+
+    uint16_t offset = MEM_read16(vector * 4);
+    uint16_t segment = MEM_read16((vector * 4) + 2);
+
+    if (offset == 0 && segment == 0)
+    {
+        CERROR("Interrupt %02Xh has no handler; at %04X:%04X.", vector, g_sregs[CS], g_ip);
+        g_stop = STOP_VECTOR;
+        return;
+    }
+
+    g_counters.softCalls++;
+
+    CPU_push(g_flags & 0xFFFF, 2);
+    CPU_push(g_sregs[CS], 2);
+    CPU_push(g_ip, 2);
+    setFlag(F_IF, false);
+    setFlag(F_TF, false);
+
+    g_sregs[CS] = segment;
+    g_ip = offset;
+}
+
+
+/**
+ * Gets the segment of a string source; it can be overridden.
+ */
+inline uint16_t CPU_sourceSegment(void)
+{
+    return g_sregs[(d.segment >= 0) ? d.segment : DS];
+}
+
+
+/**
+ * Executes one string instruction, or all its repetitions.
+ */
+void CPU_string(uint8_t opcode)
+{
+    int size = (opcode & 1) ? d.operandSize : 1;
+    int delta = getFlag(F_DF) ? -size : size;
+    int counter = d.addressSize;
+
+    while (true)
+    {
+        if (d.rep && REG_get(CX, counter) == 0)
+        {
+            break;
+        }
+
+        uint32_t si = REG_get(SI, d.addressSize), di = REG_get(DI, d.addressSize);
+        uint32_t src = MEM_linear(CPU_sourceSegment(), si);
+        uint32_t dst = MEM_linear(g_sregs[ES], di);
+        bool compare = false;
+
+        switch (opcode)
+        {
+        case 0xA4: case 0xA5:   // MOVS
+            MEM_write(dst, MEM_read(src, size), size);
+            REG_set(SI, si + delta, d.addressSize);
+            REG_set(DI, di + delta, d.addressSize);
+            break;
+        case 0xA6: case 0xA7:   // CMPS
+            ALU_op(7, MEM_read(src, size), MEM_read(dst, size), size);
+            REG_set(SI, si + delta, d.addressSize);
+            REG_set(DI, di + delta, d.addressSize);
+            compare = true;
+            break;
+        case 0xAA: case 0xAB:   // STOS
+            MEM_write(dst, REG_get(AX, size), size);
+            REG_set(DI, di + delta, d.addressSize);
+            break;
+        case 0xAC: case 0xAD:   // LODS
+            REG_set(AX, MEM_read(src, size), size);
+            REG_set(SI, si + delta, d.addressSize);
+            break;
+        default:                // SCAS
+            ALU_op(7, REG_get(AX, size), MEM_read(dst, size), size);
+            REG_set(DI, di + delta, d.addressSize);
+            compare = true;
+            break;
+        }
+
+        if (!d.rep)
+        {
+            break;
+        }
+
+        REG_set(CX, REG_get(CX, counter) - 1, counter);
+        g_counters.instructions++;
+
+        if (compare && ((d.rep == 0xF3) != getFlag(F_ZF)))
+        {
+            break;
+        }
+    }
+}
+
+
+/**
+ * Executes a single instruction, including its prefixes.
+ */
+void CPU_step(void)
+{
+    uint16_t start = g_ip;
+    uint8_t opcode;
+
+    d.segment = -1;
+    d.operandSize = 2;
+    d.addressSize = 2;
+    d.rep = 0;
+
+    // Prefixes
+    while (true)
+    {
+        opcode = CPU_fetch8();
+
+        if (opcode == 0x26)         d.segment = ES;
+        else if (opcode == 0x2E)    d.segment = CS;
+        else if (opcode == 0x36)    d.segment = SS;
+        else if (opcode == 0x3E)    d.segment = DS;
+        else if (opcode == 0x64)    d.segment = FS;
+        else if (opcode == 0x65)    d.segment = GS;
+        else if (opcode == 0x66)    d.operandSize = 4;
+        else if (opcode == 0x67)    d.addressSize = 4;
+        else if (opcode == 0xF2 || opcode == 0xF3)  d.rep = opcode;
+        else if (opcode != 0xF0)    break;
+    }
+
+    int size = d.operandSize;
+    g_counters.instructions++;
+
+    // The arithmetic block; every eighth row holds prefixes or special cases
+    if (opcode < 0x40 && (opcode & 7) < 6)
+    {
+        int op = opcode >> 3;
+        int width = (opcode & 1) ? size : 1;
+        uint32_t result;
+
+        switch (opcode & 7)
+        {
+        case 0: case 1:
+            CPU_modrm();
+            result = ALU_op(op, CPU_getRM(width), REG_get(d.reg, width), width);
+            if (op != 7) CPU_setRM(result, width);
+            break;
+        case 2: case 3:
+            CPU_modrm();
+            result = ALU_op(op, REG_get(d.reg, width), CPU_getRM(width), width);
+            if (op != 7) REG_set(d.reg, result, width);
+            break;
+        default:
+            result = ALU_op(op, REG_get(AX, width), CPU_fetch(width), width);
+            if (op != 7) REG_set(AX, result, width);
+            break;
+        }
+        return;
+    }
+
+    switch (opcode)
+    {
+    case 0x06: CPU_push(g_sregs[ES], size); break;
+    case 0x07: g_sregs[ES] = static_cast<uint16_t>(CPU_pop(size)); break;
+    case 0x0E: CPU_push(g_sregs[CS], size); break;
+    case 0x16: CPU_push(g_sregs[SS], size); break;
+    case 0x17: g_sregs[SS] = static_cast<uint16_t>(CPU_pop(size)); break;
+    case 0x1E: CPU_push(g_sregs[DS], size); break;
+    case 0x1F: g_sregs[DS] = static_cast<uint16_t>(CPU_pop(size)); break;
+
+    case 0x27: case 0x2F:   // DAA, DAS
+    {
+        uint8_t al = static_cast<uint8_t>(REG_get(AX, 1));
+        bool carry = getFlag(F_CF);
+        int sign = (opcode == 0x27) ? 1 : -1;
+
+        if ((al & 0x0F) > 9 || getFlag(F_AF))   { al = static_cast<uint8_t>(al + (6 * sign)); setFlag(F_AF, true); }
+        if (REG_get(AX, 1) > 0x99 || carry)     { al = static_cast<uint8_t>(al + (0x60 * sign)); setFlag(F_CF, true); }
+
+        REG_set(AX, al, 1);
+        setResultFlags(al, 1);
+        break;
+    }
+
+    case 0x37: case 0x3F:   // AAA, AAS
+    {
+        if ((REG_get(AX, 1) & 0x0F) > 9 || getFlag(F_AF))
+        {
+            int sign = (opcode == 0x37) ? 1 : -1;
+            REG_set(AX, REG_get(AX, 2) + (0x106 * sign), 2);
+            setFlag(F_AF, true);
+            setFlag(F_CF, true);
+        }
+        else
+        {
+            setFlag(F_AF, false);
+            setFlag(F_CF, false);
+        }
+        REG_set(AX, REG_get(AX, 1) & 0x0F, 1);
+        break;
+    }
+
+    case 0x40: case 0x41: case 0x42: case 0x43: case 0x44: case 0x45: case 0x46: case 0x47:
+        REG_set(opcode & 7, ALU_incdec(REG_get(opcode & 7, size), false, size), size);
+        break;
+    case 0x48: case 0x49: case 0x4A: case 0x4B: case 0x4C: case 0x4D: case 0x4E: case 0x4F:
+        REG_set(opcode & 7, ALU_incdec(REG_get(opcode & 7, size), true, size), size);
+        break;
+
+    case 0x50: case 0x51: case 0x52: case 0x53: case 0x54: case 0x55: case 0x56: case 0x57:
+        // The 8086 pushed the decremented SP; every later CPU the original
+        CPU_push(REG_get(opcode & 7, size), size);
+        break;
+    case 0x58: case 0x59: case 0x5A: case 0x5B: case 0x5C: case 0x5D: case 0x5E: case 0x5F:
+        REG_set(opcode & 7, CPU_pop(size), size);
+        break;
+
+    case 0x60:              // PUSHA
+    {
+        uint32_t sp = REG_get(SP, size);
+        for (int i = 0; i < 8; i++)
+        {
+            CPU_push((i == SP) ? sp : REG_get(i, size), size);
+        }
+        break;
+    }
+    case 0x61:              // POPA
+        for (int i = 7; i >= 0; i--)
+        {
+            uint32_t value = CPU_pop(size);
+            if (i != SP) REG_set(i, value, size);
+        }
+        break;
+
+    case 0x68: CPU_push(CPU_fetch(size), size); break;
+    case 0x6A: CPU_push(signExtend(CPU_fetch8(), 1), size); break;
+
+    case 0x69: case 0x6B:   // IMUL r, r/m, imm
+    {
+        CPU_modrm();
+        int64_t a = static_cast<int32_t>(signExtend(CPU_getRM(size), size));
+        int64_t b = static_cast<int32_t>((opcode == 0x6B) ? signExtend(CPU_fetch8(), 1) : signExtend(CPU_fetch(size), size));
+        int64_t result = a * b;
+        bool over = result != static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(result) & MASK(size), size)));
+
+        REG_set(d.reg, static_cast<uint32_t>(result), size);
+        setFlag(F_CF, over);
+        setFlag(F_OF, over);
+        break;
+    }
+
+    case 0x6C: case 0x6D: case 0x6E: case 0x6F:
+        // No devices are attached to the ports
+        break;
+
+    case 0x70: case 0x71: case 0x72: case 0x73: case 0x74: case 0x75: case 0x76: case 0x77:
+    case 0x78: case 0x79: case 0x7A: case 0x7B: case 0x7C: case 0x7D: case 0x7E: case 0x7F:
+    {
+        int8_t rel = static_cast<int8_t>(CPU_fetch8());
+        if (CPU_condition(opcode & 0x0F)) g_ip = static_cast<uint16_t>(g_ip + rel);
+        break;
+    }
+
+    case 0x80: case 0x81: case 0x82: case 0x83:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+        uint32_t operand = (opcode == 0x83) ? signExtend(CPU_fetch8(), 1) : CPU_fetch(width);
+        uint32_t result = ALU_op(d.reg, CPU_getRM(width), operand, width);
+        if (d.reg != 7) CPU_setRM(result, width);
+        break;
+    }
+
+    case 0x84: case 0x85:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+        ALU_op(4, CPU_getRM(width), REG_get(d.reg, width), width);
+        break;
+    }
+
+    case 0x86: case 0x87:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+        uint32_t value = CPU_getRM(width);
+        CPU_setRM(REG_get(d.reg, width), width);
+        REG_set(d.reg, value, width);
+        break;
+    }
+
+    case 0x88: CPU_modrm(); CPU_setRM(REG_get(d.reg, 1), 1); break;
+    case 0x89: CPU_modrm(); CPU_setRM(REG_get(d.reg, size), size); break;
+    case 0x8A: CPU_modrm(); REG_set(d.reg, CPU_getRM(1), 1); break;
+    case 0x8B: CPU_modrm(); REG_set(d.reg, CPU_getRM(size), size); break;
+    case 0x8C: CPU_modrm(); CPU_setRM(g_sregs[d.reg % 6], (d.mod == 3) ? size : 2); break;
+    case 0x8D: CPU_modrm(); REG_set(d.reg, d.offset, size); break;
+    case 0x8E: CPU_modrm(); g_sregs[d.reg % 6] = static_cast<uint16_t>(CPU_getRM(2)); break;
+    case 0x8F:
+    {
+        // The operand is addressed with the value of SP after the pop
+        uint32_t value = CPU_pop(size);
+        CPU_modrm();
+        CPU_setRM(value, size);
+        break;
+    }
+
+    case 0x90: break;
+    case 0x91: case 0x92: case 0x93: case 0x94: case 0x95: case 0x96: case 0x97:
+    {
+        uint32_t value = REG_get(AX, size);
+        REG_set(AX, REG_get(opcode & 7, size), size);
+        REG_set(opcode & 7, value, size);
+        break;
+    }
+
+    case 0x98:
+        if (size == 2)  REG_set(AX, signExtend(REG_get(AX, 1), 1), 2);
+        else            REG_set(AX, signExtend(REG_get(AX, 2), 2), 4);
+        break;
+    case 0x99:
+        REG_set(DX, (REG_get(AX, size) & SIGN(size)) ? MASK(size) : 0, size);
+        break;
+
+    case 0x9A:              // CALL far
+    {
+        uint16_t offset = CPU_fetch16();
+        uint16_t segment = CPU_fetch16();
+        CPU_push(g_sregs[CS], 2);
+        CPU_push(g_ip, 2);
+        g_sregs[CS] = segment;
+        g_ip = offset;
+        break;
+    }
+
+    case 0x9B: break;
+    case 0x9C: CPU_push((g_flags & 0x0FD5) | 0xF002, size); break;
+    case 0x9D: g_flags = (CPU_pop(size) & 0x0FD5) | 0x0002; break;
+    case 0x9E: g_flags = (g_flags & 0xFF00) | (REG_get(AX + 4, 1) & 0xD5) | 0x02; break;
+    case 0x9F: REG_set(AX + 4, g_flags & 0xFF, 1); break;
+
+    case 0xA0: case 0xA1: case 0xA2: case 0xA3:
+    {
+        int width = (opcode & 1) ? size : 1;
+        uint32_t offset = CPU_fetch(d.addressSize);
+        uint32_t address = MEM_linear(CPU_sourceSegment(), offset);
+
+        if (opcode < 0xA2)  REG_set(AX, MEM_read(address, width), width);
+        else                MEM_write(address, REG_get(AX, width), width);
+        break;
+    }
+
+    case 0xA4: case 0xA5: case 0xA6: case 0xA7:
+    case 0xAA: case 0xAB: case 0xAC: case 0xAD: case 0xAE: case 0xAF:
+        CPU_string(opcode);
+        break;
+
+    case 0xA8: ALU_op(4, REG_get(AX, 1), CPU_fetch8(), 1); break;
+    case 0xA9: ALU_op(4, REG_get(AX, size), CPU_fetch(size), size); break;
+
+    case 0xB0: case 0xB1: case 0xB2: case 0xB3: case 0xB4: case 0xB5: case 0xB6: case 0xB7:
+        REG_set(opcode & 7, CPU_fetch8(), 1);
+        break;
+    case 0xB8: case 0xB9: case 0xBA: case 0xBB: case 0xBC: case 0xBD: case 0xBE: case 0xBF:
+        REG_set(opcode & 7, CPU_fetch(size), size);
+        break;
+
+    case 0xC0: case 0xC1: case 0xD0: case 0xD1: case 0xD2: case 0xD3:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+        int count = (opcode < 0xD0) ? CPU_fetch8() : (opcode < 0xD2) ? 1 : REG_get(CX, 1);
+        CPU_setRM(ALU_shift(d.reg, CPU_getRM(width), count, width), width);
+        break;
+    }
+
+    case 0xC2: { uint16_t n = CPU_fetch16(); g_ip = static_cast<uint16_t>(CPU_pop(2)); REG_set(SP, REG_get(SP, 2) + n, 2); break; }
+    case 0xC3: g_ip = static_cast<uint16_t>(CPU_pop(2)); break;
+
+    case 0xC4: case 0xC5:   // LES, LDS
+        CPU_modrm();
+        REG_set(d.reg, MEM_read(d.address, size), size);
+        g_sregs[(opcode == 0xC4) ? ES : DS] = MEM_read16(d.address + size);
+        break;
+
+    case 0xC6: CPU_modrm(); CPU_setRM(CPU_fetch8(), 1); break;
+    case 0xC7: CPU_modrm(); CPU_setRM(CPU_fetch(size), size); break;
+
+    case 0xC8:              // ENTER
+    {
+        uint16_t bytes = CPU_fetch16();
+        uint8_t level = CPU_fetch8() & 0x1F;
+        CPU_push(REG_get(BP, 2), 2);
+        uint16_t frame = static_cast<uint16_t>(REG_get(SP, 2));
+        for (int i = 1; i < level; i++)
+        {
+            REG_set(BP, REG_get(BP, 2) - 2, 2);
+            CPU_push(MEM_read16(MEM_linear(g_sregs[SS], REG_get(BP, 2))), 2);
+        }
+        if (level > 0) CPU_push(frame, 2);
+        REG_set(BP, frame, 2);
+        REG_set(SP, REG_get(SP, 2) - bytes, 2);
+        break;
+    }
+    case 0xC9:              // LEAVE
+        REG_set(SP, REG_get(BP, 2), 2);
+        REG_set(BP, CPU_pop(size), size);
+        break;
+
+    case 0xCA: { uint16_t n = CPU_fetch16(); g_ip = static_cast<uint16_t>(CPU_pop(2)); g_sregs[CS] = static_cast<uint16_t>(CPU_pop(2)); REG_set(SP, REG_get(SP, 2) + n, 2); break; }
+    case 0xCB: g_ip = static_cast<uint16_t>(CPU_pop(2)); g_sregs[CS] = static_cast<uint16_t>(CPU_pop(2)); break;
+
+    case 0xCC: CPU_interrupt(3); break;
+    case 0xCD: CPU_interrupt(CPU_fetch8()); break;
+    case 0xCE: if (getFlag(F_OF)) CPU_interrupt(4); break;
+    case 0xCF:              // IRET
+        g_ip = static_cast<uint16_t>(CPU_pop(2));
+        g_sregs[CS] = static_cast<uint16_t>(CPU_pop(2));
+        g_flags = (CPU_pop(2) & 0x0FD5) | 0x0002;
+        break;
+
+    case 0xD4:              // AAM
+    {
+        uint8_t base = CPU_fetch8();
+        uint8_t al = static_cast<uint8_t>(REG_get(AX, 1));
+        if (base == 0) { CPU_interrupt(0); break; }
+        REG_set(AX, ((al / base) << 8) | (al % base), 2);
+        setResultFlags(al % base, 1);
+        break;
+    }
+    case 0xD5:              // AAD
+    {
+        uint8_t base = CPU_fetch8();
+        uint8_t al = static_cast<uint8_t>(REG_get(AX, 1) + (REG_get(AX + 4, 1) * base));
+        REG_set(AX, al, 2);
+        setResultFlags(al, 1);
+        break;
+    }
+    case 0xD6: REG_set(AX, getFlag(F_CF) ? 0xFF : 0x00, 1); break;
+    case 0xD7: REG_set(AX, MEM_read8(MEM_linear(CPU_sourceSegment(), (REG_get(BX, 2) + REG_get(AX, 1)) & 0xFFFF)), 1); break;
+
+    case 0xE0: case 0xE1: case 0xE2: case 0xE3:
+    {
+        int8_t displacement = static_cast<int8_t>(CPU_fetch8());
+        bool jump;
+
+        if (opcode == 0xE3)
+        {
+            jump = REG_get(CX, d.addressSize) == 0;
+        }
+        else
+        {
+            REG_set(CX, REG_get(CX, d.addressSize) - 1, d.addressSize);
+            jump = REG_get(CX, d.addressSize) != 0;
+            if (opcode == 0xE0) jump = jump && !getFlag(F_ZF);
+            if (opcode == 0xE1) jump = jump && getFlag(F_ZF);
+        }
+
+        if (jump) g_ip = static_cast<uint16_t>(g_ip + displacement);
+        break;
+    }
+
+    case 0xE4: case 0xE5: CPU_fetch8(); REG_set(AX, MASK((opcode & 1) ? size : 1), (opcode & 1) ? size : 1); break;
+    case 0xE6: case 0xE7: CPU_fetch8(); break;
+    case 0xEC: case 0xED: REG_set(AX, MASK((opcode & 1) ? size : 1), (opcode & 1) ? size : 1); break;
+    case 0xEE: case 0xEF: break;
+
+    case 0xE8: { int16_t rel = static_cast<int16_t>(CPU_fetch16()); CPU_push(g_ip, 2); g_ip = static_cast<uint16_t>(g_ip + rel); break; }
+    case 0xE9: { int16_t rel = static_cast<int16_t>(CPU_fetch16()); g_ip = static_cast<uint16_t>(g_ip + rel); break; }
+    case 0xEA: { uint16_t offset = CPU_fetch16(); g_sregs[CS] = CPU_fetch16(); g_ip = offset; break; }
+    case 0xEB:
+    {
+        int8_t rel = static_cast<int8_t>(CPU_fetch8());
+        g_ip = static_cast<uint16_t>(g_ip + rel);
+
+        // jmp $; nothing can interrupt it
+        if (rel == -2) g_stop = STOP_HANG;
+        break;
+    }
+
+    case 0xF4:              // HLT
+        g_stop = STOP_HANG;
+        break;
+
+    case 0xF5: setFlag(F_CF, !getFlag(F_CF)); break;
+
+    case 0xF6: case 0xF7:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+        uint32_t value = CPU_getRM(width);
+
+        switch (d.reg)
+        {
+        case 0: case 1: ALU_op(4, value, CPU_fetch(width), width); break;
+        case 2: CPU_setRM(~value, width); break;
+        case 3:
+        {
+            uint32_t result = ALU_op(5, 0, value, width);
+            CPU_setRM(result, width);
+            setFlag(F_CF, (value & MASK(width)) != 0);
+            break;
+        }
+        default:
+            if (!ALU_muldiv(d.reg, value, width))
+            {
+                // The 80286 and later return to the faulting instruction
+                g_ip = start;
+                CPU_interrupt(0);
+            }
+            break;
+        }
+        break;
+    }
+
+    case 0xF8: setFlag(F_CF, false); break;
+    case 0xF9: setFlag(F_CF, true); break;
+    case 0xFA: setFlag(F_IF, false); break;
+    case 0xFB: setFlag(F_IF, true); break;
+    case 0xFC: setFlag(F_DF, false); break;
+    case 0xFD: setFlag(F_DF, true); break;
+
+    case 0xFE: case 0xFF:
+    {
+        int width = (opcode & 1) ? size : 1;
+        CPU_modrm();
+
+        switch (d.reg)
+        {
+        case 0: CPU_setRM(ALU_incdec(CPU_getRM(width), false, width), width); break;
+        case 1: CPU_setRM(ALU_incdec(CPU_getRM(width), true, width), width); break;
+        case 2: { uint16_t target = static_cast<uint16_t>(CPU_getRM(2)); CPU_push(g_ip, 2); g_ip = target; break; }
+        case 3:
+        {
+            uint16_t offset = MEM_read16(d.address), segment = MEM_read16(d.address + 2);
+            CPU_push(g_sregs[CS], 2);
+            CPU_push(g_ip, 2);
+            g_sregs[CS] = segment;
+            g_ip = offset;
+            break;
+        }
+        case 4: g_ip = static_cast<uint16_t>(CPU_getRM(2)); break;
+        case 5: g_ip = MEM_read16(d.address); g_sregs[CS] = MEM_read16(d.address + 2); break;
+        case 6: CPU_push(CPU_getRM(size), size); break;
+        default: g_stop = STOP_INVALID; break;
+        }
+        break;
+    }
+
+    case 0x0F:
+    {
+        uint8_t second = CPU_fetch8();
+
+        if (second >= 0x80 && second <= 0x8F)
+        {
+            int32_t rel = static_cast<int32_t>(signExtend(CPU_fetch(size), size));
+            if (CPU_condition(second & 0x0F)) g_ip = static_cast<uint16_t>(g_ip + rel);
+        }
+        else if (second >= 0x90 && second <= 0x9F)
+        {
+            CPU_modrm();
+            CPU_setRM(CPU_condition(second & 0x0F) ? 1 : 0, 1);
+        }
+        else if (second == 0xB6 || second == 0xB7 || second == 0xBE || second == 0xBF)
+        {
+            int width = (second & 1) ? 2 : 1;
+            CPU_modrm();
+            uint32_t value = CPU_getRM(width);
+            REG_set(d.reg, (second >= 0xBE) ? signExtend(value, width) : value, size);
+        }
+        else if (second == 0xAF)
+        {
+            CPU_modrm();
+            int64_t result = static_cast<int64_t>(static_cast<int32_t>(signExtend(REG_get(d.reg, size), size))) *
+                static_cast<int32_t>(signExtend(CPU_getRM(size), size));
+            bool over = result != static_cast<int64_t>(static_cast<int32_t>(signExtend(static_cast<uint32_t>(result) & MASK(size), size)));
+            REG_set(d.reg, static_cast<uint32_t>(result), size);
+            setFlag(F_CF, over);
+            setFlag(F_OF, over);
+        }
+        else if (second == 0xA0 || second == 0xA8)  CPU_push(g_sregs[(second == 0xA0) ? FS : GS], size);
+        else if (second == 0xA1 || second == 0xA9)  g_sregs[(second == 0xA1) ? FS : GS] = static_cast<uint16_t>(CPU_pop(size));
+        else if (second == 0x01)
+        {
+            // The descriptor tables only matter in protected mode
+            CPU_modrm();
+        }
+        else
+        {
+            g_ip = start;
+            g_stop = STOP_INVALID;
+        }
+        break;
+    }
+
+    default:
+        g_ip = start;
+        g_stop = STOP_INVALID;
+        break;
+    }
+}
+
+
+
+/**
+ * VIDEO
+ *   A text screen in the memory at B800h; teletype output is also kept as a
+ *   transcript, and echoed when enabled.
+ */
+void VIDEO_clear(void)
+{
+    for (int i = 0; i < SCREEN_COLUMNS * SCREEN_ROWS; i++)
+    {
+        MEM_write16(MEM_linear(TEXT_SEGMENT, i * 2), 0x0720);
+    }
+
+    g_cursorRow = 0;
+    g_cursorColumn = 0;
+}
+
+void VIDEO_scroll(void)
+{
+    uint32_t base = MEM_linear(TEXT_SEGMENT, 0);
+
+    memmove(g_memory + base, g_memory + base + (SCREEN_COLUMNS * 2), SCREEN_COLUMNS * 2 * (SCREEN_ROWS - 1));
+    for (int i = 0; i < SCREEN_COLUMNS; i++)
+    {
+        MEM_write16(base + (((SCREEN_ROWS - 1) * SCREEN_COLUMNS) + i) * 2, 0x0720);
+    }
+}
+
+void VIDEO_put(uint8_t c, uint8_t attribute)
+{
+    MEM_write8(MEM_linear(TEXT_SEGMENT, ((g_cursorRow * SCREEN_COLUMNS) + g_cursorColumn) * 2), c);
+    MEM_write8(MEM_linear(TEXT_SEGMENT, (((g_cursorRow * SCREEN_COLUMNS) + g_cursorColumn) * 2) + 1), attribute);
+}
+
+void VIDEO_teletype(uint8_t c)
+{
+    g_transcript += static_cast<char>(c);
+
+    if (g_echo)
+    {
+        if (c != '\r') fputc(c, g_console);
+    }
+
+    switch (c)
+    {
+    case '\r': g_cursorColumn = 0; break;
+    case '\n': g_cursorRow++; break;
+    case 0x08: if (g_cursorColumn > 0) g_cursorColumn--; break;
+    case 0x07: break;
+    default:
+        VIDEO_put(c, 0x07);
+        g_cursorColumn++;
+        break;
+    }
+
+    if (g_cursorColumn >= SCREEN_COLUMNS)
+    {
+        g_cursorColumn = 0;
+        g_cursorRow++;
+    }
+
+    if (g_cursorRow >= SCREEN_ROWS)
+    {
+        VIDEO_scroll();
+        g_cursorRow = SCREEN_ROWS - 1;
+    }
+}
+
+
+/**
+ * int 10h
+ */
+void BIOS_video(void)
+{
+    uint8_t ah = static_cast<uint8_t>(REG_get(AX + 4, 1));
+
+    switch (ah)
+    {
+    case 0x00: VIDEO_clear(); break;
+    case 0x02:
+        g_cursorRow = REG_get(DX + 4, 1) % SCREEN_ROWS;
+        g_cursorColumn = REG_get(DX, 1) % SCREEN_COLUMNS;
+        break;
+    case 0x03:
+        REG_set(DX, (g_cursorRow << 8) | g_cursorColumn, 2);
+        REG_set(CX, 0x0607, 2);
+        break;
+    case 0x09:
+    case 0x0A:
+    {
+        // Writes without moving the cursor
+        int row = g_cursorRow, column = g_cursorColumn;
+        for (uint32_t i = 0; i < REG_get(CX, 2) && g_cursorRow < SCREEN_ROWS; i++)
+        {
+            VIDEO_put(static_cast<uint8_t>(REG_get(AX, 1)), (ah == 0x09) ? static_cast<uint8_t>(REG_get(BX, 1)) : 0x07);
+            if (++g_cursorColumn >= SCREEN_COLUMNS) { g_cursorColumn = 0; g_cursorRow++; }
+        }
+        g_cursorRow = row;
+        g_cursorColumn = column;
+        break;
+    }
+    case 0x0E: VIDEO_teletype(static_cast<uint8_t>(REG_get(AX, 1))); break;
+    case 0x0F: REG_set(AX, (SCREEN_COLUMNS << 8) | 0x03, 2); REG_set(BX + 4, 0, 1); break;
+    default:
+        // Graphics; drawing leaves no trace in the counters
+        break;
+    }
+}
+
+
+/**
+ * int 16h; the keys come from the script.
+ */
+void BIOS_keyboard(void)
+{
+    uint8_t ah = static_cast<uint8_t>(REG_get(AX + 4, 1));
+
+    if (ah == 0x00 || ah == 0x10)
+    {
+        if (g_keys.empty())
+        {
+            g_stop = STOP_KEYS;
+            return;
+        }
+
+        REG_set(AX, static_cast<uint8_t>(g_keys[0]), 2);
+        g_keys.erase(0, 1);
+    }
+    else if (ah == 0x01 || ah == 0x11)
+    {
+        setFlag(F_ZF, g_keys.empty());
+        if (!g_keys.empty()) REG_set(AX, static_cast<uint8_t>(g_keys[0]), 2);
+    }
+    else if (ah == 0x02)
+    {
+        REG_set(AX, 0, 1);
+    }
+}
+
+
+
+/**
+ * DISK
+ *   The drive model; returns the time a request takes, in microseconds.
+ */
+uint64_t DISK_elapsedUs(void)
+{
+    return (g_counters.instructions / g_mips) + g_counters.diskUs + g_counters.biosUs;
+}
+
+uint64_t DISK_access(int cylinder, int head, int sector, int count)
+{
+    uint64_t us = 0;
+
+    if (!g_spinning)
+    {
+        us += DRIVE_SPINUP_US;
+        g_spinning = true;
+    }
+
+    if (cylinder != g_cylinder)
+    {
+        int distance = (cylinder > g_cylinder) ? (cylinder - g_cylinder) : (g_cylinder - cylinder);
+
+        us += (static_cast<uint64_t>(distance) * DRIVE_STEP_US) + DRIVE_SETTLE_US;
+        g_counters.seeks++;
+        g_counters.cylinders += distance;
+    }
+
+    if (cylinder != g_cylinder || head != g_head)
+    {
+        g_counters.trackChanges++;
+    }
+
+    g_cylinder = cylinder;
+    g_head = head;
+
+    // Wait for the first sector to pass under the head, then read them all
+    uint64_t position = (DISK_elapsedUs() + us) % DRIVE_REVOLUTION_US;
+    uint64_t target = static_cast<uint64_t>(sector - 1) * DRIVE_SECTOR_US;
+
+    us += (target + DRIVE_REVOLUTION_US - position) % DRIVE_REVOLUTION_US;
+    us += static_cast<uint64_t>(count) * DRIVE_SECTOR_US;
+    return us;
+}
+
+
+/**
+ * int 13h
+ */
+void BIOS_disk(void)
+{
+    uint8_t ah = static_cast<uint8_t>(REG_get(AX + 4, 1));
+    int status = 0;
+
+    switch (ah)
+    {
+    case 0x00:              // Reset
+        g_cylinder = 0;
+        break;
+
+    case 0x02:              // Read
+    case 0x03:              // Write
+    {
+        int count = REG_get(AX, 1);
+        int cylinder = REG_get(CX + 4, 1) | ((REG_get(CX, 1) & 0xC0) << 2);
+        int sector = REG_get(CX, 1) & 0x3F;
+        int head = REG_get(DX + 4, 1);
+        uint32_t buffer = MEM_linear(g_sregs[ES], REG_get(BX, 2));
+
+        if (REG_get(DX, 1) != 0)                                            status = 0x80;  // No such drive
+        else if (count == 0 || sector == 0 || sector > SECTORS_PER_TRACK ||
+            head >= NUMBER_OF_HEADS || cylinder >= NUMBER_OF_CYLINDERS)     status = 0x04;  // Sector not found
+        else if (sector + count - 1 > SECTORS_PER_TRACK)                    status = 0x04;  // Crosses the track
+        else if ((buffer & 0xFFFF) + (count * BYTES_PER_SECTOR) > 0x10000)  status = 0x09;  // Crosses 64KB
+
+        if (status)
+        {
+            REG_set(AX, 0, 1);
+            g_counters.diskErrors++;
+            break;
+        }
+
+        size_t lba = (((static_cast<size_t>(cylinder) * NUMBER_OF_HEADS) + head) * SECTORS_PER_TRACK) + sector - 1;
+        uint8_t *data = g_image.data() + (lba * BYTES_PER_SECTOR);
+
+        if (ah == 0x02)
+        {
+            for (int i = 0; i < count * BYTES_PER_SECTOR; i++) MEM_write8(buffer + i, data[i]);
+            g_counters.sectorsRead += count;
+        }
+        else
+        {
+            for (int i = 0; i < count * BYTES_PER_SECTOR; i++) data[i] = MEM_read8(buffer + i);
+            g_counters.sectorsWritten += count;
+            g_imageChanged = true;
+        }
+
+        g_counters.diskUs += DISK_access(cylinder, head, sector, count);
+        break;
+    }
+
+    case 0x04:              // Verify
+        break;
+
+    case 0x08:              // Parameters
+        REG_set(BX, 0x04, 2);
+        REG_set(CX, ((NUMBER_OF_CYLINDERS - 1) << 8) | SECTORS_PER_TRACK, 2);
+        REG_set(DX, ((NUMBER_OF_HEADS - 1) << 8) | 1, 2);
+        break;
+
+    case 0x15:              // Type; a floppy without change detection
+        REG_set(AX + 4, 0x01, 1);
+        setFlag(F_CF, false);
+        return;
+
+    case 0x16:              // Media change
+        break;
+
+    default:
+        status = 0x01;
+        break;
+    }
+
+    REG_set(AX + 4, status, 1);
+    setFlag(F_CF, status != 0);
+}
+
+
+/**
+ * Answers int 15h. Block moves take the source and destination from the
+ * descriptor table at ES:SI; both may lie in either kind of memory.
+ */
+void BIOS_system(void)
+{
+    uint8_t ah = static_cast<uint8_t>(REG_get(AX + 4, 1));
+
+    switch (ah)
+    {
+    case 0x88:              // Extended memory size
+        REG_set(AX, EXTENDED_KB, 2);
+        setFlag(F_CF, false);
+        break;
+
+    case 0x87:              // Block move
+    {
+        uint32_t table = MEM_linear(g_sregs[ES], REG_get(SI, 2));
+        uint32_t from = MEM_read16(table + 0x12) | (MEM_read8(table + 0x14) << 16) | (MEM_read8(table + 0x17) << 24);
+        uint32_t to = MEM_read16(table + 0x1A) | (MEM_read8(table + 0x1C) << 16) | (MEM_read8(table + 0x1F) << 24);
+        uint32_t n = REG_get(CX, 2) * 2;
+        uint32_t limit = MEMORY_SIZE + sizeof(g_extended);
+
+        if (n > 0x10000 || from + n > limit || to + n > limit)
+        {
+            REG_set(AX + 4, 0x02, 1);   // Exception in protected mode
+            setFlag(F_CF, true);
+            break;
+        }
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint32_t source = from + i;
+            uint32_t target = to + i;
+            uint8_t value = (source < MEMORY_SIZE) ? g_memory[source] : g_extended[source - MEMORY_SIZE];
+
+            if (target < MEMORY_SIZE)   g_memory[target] = value;
+            else                        g_extended[target - MEMORY_SIZE] = value;
+        }
+
+        g_counters.biosUs += (n * BIOS_MOVE_US_PER_KB) / 1024;
+        REG_set(AX + 4, 0x00, 1);
+        setFlag(F_CF, false);
+        break;
+    }
+
+    default:                // No other extended services
+        REG_set(AX + 4, 0x86, 1);
+        setFlag(F_CF, true);
+        break;
+    }
+}
+
+
+/**
+ * Answers the interrupts the BIOS would.
+ * @return True if the host serviced the interrupt.
+ */
+bool BIOS_service(int vector)
+{
+    switch (vector)
+    {
+    case 0x10: BIOS_video(); g_counters.videoCalls++; break;
+    case 0x13: BIOS_disk(); g_counters.diskCalls++; break;
+    case 0x16: BIOS_keyboard(); g_counters.keyCalls++; break;
+    case 0x12: REG_set(AX, CONVENTIONAL_KB, 2); g_counters.otherCalls++; break;
+    case 0x19: g_stop = STOP_REBOOT; break;
+    case 0x1A:
+        // Ticks of 55ms since midnight; the run starts at midnight
+        REG_set(CX, static_cast<uint32_t>((DISK_elapsedUs() / 54925) >> 16), 2);
+        REG_set(DX, static_cast<uint32_t>(DISK_elapsedUs() / 54925), 2);
+        REG_set(AX, 0, 1);
+        g_counters.otherCalls++;
+        break;
+    case 0x15: BIOS_system(); g_counters.otherCalls++; break;
+    default:
+        return false;
+    }
+
+    g_counters.biosCalls++;
+    g_counters.biosUs += BIOS_CALL_US;
+    return true;
+}
+
+
+
+/**
+ * Reads a file into memory.
+ * @return The number of bytes read, or -1 on failure.
+ */
+long readFile(const char *path, uint8_t *dest, size_t n)
+{
+    FILE *file = fopen(path, "rb");
+
+    if (!file)
+    {
+        CERROR("Could not open file '%s' for reading.", path);
+        return -1;
+    }
+
+    size_t read = fread(dest, 1, n, file);
+    fclose(file);
+    return static_cast<long>(read);
+}
+
+
+/**
+ * Converts the escapes of a key script: \r, \n, \b, \t, \e, \\ and \xHH.
+ */
+std::string parseKeys(const char *script)
+{
+    std::string keys;
+
+    for (const char *p = script; *p; p++)
+    {
+        if (*p != '\\' || !p[1])
+        {
+            keys += *p;
+            continue;
+        }
+
+        switch (*++p)
+        {
+        case 'r': keys += '\r'; break;
+        case 'n': keys += '\n'; break;
+        case 'b': keys += '\b'; break;
+        case 't': keys += '\t'; break;
+        case 'e': keys += '\x1B'; break;
+        case 'x':
+            if (p[1] && p[2])
+            {
+                char hex[3] = { p[1], p[2], 0 };
+                keys += static_cast<char>(strtol(hex, NULL, 16));
+                p += 2;
+            }
+            break;
+        default: keys += *p; break;
+        }
+    }
+
+    return keys;
+}
+
+
+void printUsage(char *lpExeName)
+{
+/**
+ * OPTIONS
+ *   -i <path>  The floppy image to boot.
+ *   -b <path>  Boots this bootloader instead of the boot sector of the image.
+ *   -K <path>  Skips the bootloader; loads the kernel at SEG_KERNEL and starts it.
+ *   -k <keys>  The keystrokes to type; \r is enter.
+ *   -x <text>  Fails unless the output contains the text; can be repeated.
+ *   -r <path>  Appends the counters of the run to a CSV file.
+ *   -s <path>  Saves the image afterwards, with everything the run wrote.
+ *   -m <mips>  Instructions per microsecond; 10 by default.
+ *   -n <count> Stops after this many instructions.
+ *   -q         Does not echo the output.
+ */
+
+    printf("\nUSAGE: %s <options>\n", lpExeName);
+    printf("\nEXAMPLE: %s -i bootdevice.flp -k \"LS\\r\" -x \"KERNEL  BIN\" -r boot.csv\n", lpExeName);
+
+#define OPTION_EXT(arg0, arg1, text) \
+    printf("  %-2s %-8s %s\n", arg0, arg1, text)
+
+    // Options
+    printf("\nOPTIONS\n");
+    OPTION_EXT("-i", "<path>", "The 1.44MB floppy image to boot.");
+    OPTION_EXT("-b", "<path>", "Boots this bootloader instead of the boot sector of the image.");
+    OPTION_EXT("-K", "<path>", "Skips the bootloader; loads the kernel at SEG_KERNEL and starts it.");
+    OPTION_EXT("-k", "<keys>", "The keystrokes to type; \\r is enter, \\b backspace, \\xHH any key.");
+    OPTION_EXT("-x", "<text>", "Fails unless the output contains the text; can be repeated.");
+    OPTION_EXT("-r", "<path>", "Appends the counters of the run to a CSV file.");
+    OPTION_EXT("-s", "<path>", "Saves the image afterwards, including what the run wrote.");
+    OPTION_EXT("-m", "<mips>", "Instructions per microsecond, for the estimated time; 10 by default.");
+    OPTION_EXT("-n", "<count>", "Stops the run after this many instructions.");
+    OPTION_EXT("-q", "", "Does not echo the output of the system.");
+}
+
+
+/**
+ * Processes the arguments passed to the application.
+ * @return TRUE when successful; otherwise, FALSE.
+ */
+#define VALUE_CHECK(arg)      if (++i >= argc) { CWARN("Argument %s has no value specified.", arg); return false; }
+bool procArguments(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        const char *arg = argv[i];
+
+        if ((arg[0] != '-' && arg[0] != '/') || !arg[1] || arg[2])
+        {
+            CWARN("Uknown argument '%s'", arg);
+            return false;
+        }
+
+        switch (arg[1])
+        {
+        case 'i': VALUE_CHECK("-i"); strncpy(g_pathImage, argv[i], MAX_PATH - 1); break;
+        case 'b': VALUE_CHECK("-b"); strncpy(g_pathBoot, argv[i], MAX_PATH - 1); break;
+        case 'K': VALUE_CHECK("-K"); strncpy(g_pathKernel, argv[i], MAX_PATH - 1); break;
+        case 'r': VALUE_CHECK("-r"); strncpy(g_pathReport, argv[i], MAX_PATH - 1); break;
+        case 's': VALUE_CHECK("-s"); strncpy(g_pathSave, argv[i], MAX_PATH - 1); break;
+        case 'k': VALUE_CHECK("-k"); g_keys += parseKeys(argv[i]); break;
+        case 'x': VALUE_CHECK("-x"); g_expected.push_back(parseKeys(argv[i])); break;
+        case 'm': VALUE_CHECK("-m"); g_mips = strtoull(argv[i], NULL, 0); break;
+        case 'n': VALUE_CHECK("-n"); g_limit = strtoull(argv[i], NULL, 0); break;
+        case 'q': g_echo = false; break;
+        default:
+            CWARN("Uknown argument '%s'", arg);
+            return false;
+        }
+    }
+
+    g_mips = g_mips ? g_mips : DEFAULT_MIPS;
+    return true;
+}
+
+
+/**
+ * Initializes the machine: the image, the memory and the registers.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int initialize(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    setDefaults();
+
+    if (!procArguments(argc - 1, argv + 1))
+    {
+        return -2;
+    }
+
+    if (g_pathImage[0] == '\0')
+    {
+        CERROR("No image was given.");
+        return -3;
+    }
+
+    g_image.assign(DEVICE_SIZE, 0);
+    if (readFile(g_pathImage, g_image.data(), DEVICE_SIZE) < 0)
+    {
+        return -4;
+    }
+
+    memset(g_memory, 0, sizeof(g_memory));
+    memset(g_extended, 0, sizeof(g_extended));
+    memset(g_regs, 0, sizeof(g_regs));
+    memset(g_sregs, 0, sizeof(g_sregs));
+    memset(&g_counters, 0, sizeof(g_counters));
+    VIDEO_clear();
+
+    // The BIOS data area; 640KB of conventional memory
+    MEM_write16(0x413, CONVENTIONAL_KB);
+
+    g_flags = 0x0002 | F_IF;
+    g_cylinder = 0;
+    g_head = 0;
+    g_spinning = false;
+    g_stop = STOP_NONE;
+
+    if (g_pathKernel[0] != '\0')
+    {
+        // Started straight after the bootloader would have jumped to it
+        if (readFile(g_pathKernel, g_memory + MEM_linear(KERNEL_SEGMENT, 0), 0x4000) <= 0)
+        {
+            return -5;
+        }
+
+        g_sregs[CS] = KERNEL_SEGMENT;
+        g_ip = 0;
+    }
+    else
+    {
+        if (g_pathBoot[0] != '\0')
+        {
+            if (readFile(g_pathBoot, g_image.data(), BYTES_PER_SECTOR) != BYTES_PER_SECTOR)
+            {
+                CERROR("The bootloader has to be exactly 512 bytes.");
+                return -6;
+            }
+        }
+
+        // The BIOS reads the boot sector itself; it is not counted
+        memcpy(g_memory + MEM_linear(BOOT_SEGMENT, BOOT_OFFSET), g_image.data(), BYTES_PER_SECTOR);
+        g_sregs[CS] = BOOT_SEGMENT;
+        g_ip = BOOT_OFFSET;
+    }
+
+    g_regs[DX] = 0x00;                      // Booted from drive 0
+    g_sregs[SS] = 0x0000;
+    g_regs[SP] = 0x7C00;
+    return 0;
+}
+
+
+/**
+ * Prints the counters of the run and appends them to the report.
+ */
+int report(void)
+{
+    const Counters_t &c = g_counters;
+    uint64_t cpuUs = c.instructions / g_mips;
+    uint64_t totalUs = cpuUs + c.diskUs + c.biosUs;
+
+    CINFO("\nStopped: %s at %04X:%04X", g_stopNames[g_stop], g_sregs[CS], g_ip);
+    CINFO("  Instructions     %llu", static_cast<unsigned long long>(c.instructions));
+    CINFO("  BIOS calls       %llu (int 10h %llu, int 13h %llu, int 16h %llu, other %llu)",
+        static_cast<unsigned long long>(c.biosCalls), static_cast<unsigned long long>(c.videoCalls),
+        static_cast<unsigned long long>(c.diskCalls), static_cast<unsigned long long>(c.keyCalls),
+        static_cast<unsigned long long>(c.otherCalls));
+    CINFO("  Soft interrupts  %llu", static_cast<unsigned long long>(c.softCalls));
+    CINFO("  Sectors          %llu read, %llu written, %llu refused",
+        static_cast<unsigned long long>(c.sectorsRead), static_cast<unsigned long long>(c.sectorsWritten),
+        static_cast<unsigned long long>(c.diskErrors));
+    CINFO("  Track changes    %llu (%llu seeks over %llu cylinders)",
+        static_cast<unsigned long long>(c.trackChanges), static_cast<unsigned long long>(c.seeks),
+        static_cast<unsigned long long>(c.cylinders));
+    CINFO("  Estimated time   %.1f ms (disk %.1f, cpu %.1f, bios %.1f)", totalUs / 1000.0,
+        c.diskUs / 1000.0, cpuUs / 1000.0, c.biosUs / 1000.0);
+
+    if (g_pathReport[0] == '\0')
+    {
+        return 0;
+    }
+
+    FILE *file = fopen(g_pathReport, "a");
+    if (!file)
+    {
+        CERROR("Could not open '%s' for writing.", g_pathReport);
+        return -1;
+    }
+
+    // The header goes in front of the first row only
+    fseek(file, 0, SEEK_END);
+    if (ftell(file) == 0)
+    {
+        fprintf(file, "image,stop,instructions,bios,int10,int13,int16,soft,read,written,refused,tracks,seeks,cylinders,disk_us,cpu_us,total_us\n");
+    }
+
+    fprintf(file, "%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+        g_pathImage, g_stopNames[g_stop], static_cast<unsigned long long>(c.instructions),
+        static_cast<unsigned long long>(c.biosCalls), static_cast<unsigned long long>(c.videoCalls),
+        static_cast<unsigned long long>(c.diskCalls), static_cast<unsigned long long>(c.keyCalls),
+        static_cast<unsigned long long>(c.softCalls), static_cast<unsigned long long>(c.sectorsRead),
+        static_cast<unsigned long long>(c.sectorsWritten), static_cast<unsigned long long>(c.diskErrors),
+        static_cast<unsigned long long>(c.trackChanges), static_cast<unsigned long long>(c.seeks),
+        static_cast<unsigned long long>(c.cylinders), static_cast<unsigned long long>(c.diskUs),
+        static_cast<unsigned long long>(cpuUs), static_cast<unsigned long long>(totalUs));
+
+    return fclose(file) ? -2 : 0;
+}
+
+
+int main(int argc, char **argv)
+{
+    int result = 0;
+
+    if (initialize(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+
+    while (g_stop == STOP_NONE)
+    {
+        if (g_counters.instructions >= g_limit)
+        {
+            g_stop = STOP_LIMIT;
+            break;
+        }
+
+        CPU_step();
+    }
+
+    if (g_stop == STOP_INVALID)
+    {
+        uint32_t at = MEM_linear(g_sregs[CS], g_ip);
+        CERROR("Unknown instruction %02X %02X at %04X:%04X.", MEM_read8(at), MEM_read8(at + 1), g_sregs[CS], g_ip);
+        result = -1;
+    }
+    else if (g_stop == STOP_LIMIT || g_stop == STOP_VECTOR)
+    {
+        result = -2;
+    }
+
+    for (size_t i = 0; i < g_expected.size(); i++)
+    {
+        if (g_transcript.find(g_expected[i]) == std::string::npos)
+        {
+            CERROR("The output does not contain '%s'.", g_expected[i].c_str());
+            result = -3;
+        }
+    }
+
+    if (report())
+    {
+        result = -4;
+    }
+
+    if (g_pathSave[0] != '\0' && g_imageChanged)
+    {
+        FILE *file = fopen(g_pathSave, "wb");
+        if (!file || fwrite(g_image.data(), 1, g_image.size(), file) != g_image.size())
+        {
+            CERROR("Could not save the image to '%s'.", g_pathSave);
+            result = -5;
+        }
+        if (file) fclose(file);
+    }
+
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,428 @@
+/**
+ * CONTAINER
+ *   A compressed image container. The image is cut into blocks of one track
+ *   each, which are compressed independently; an index in front of the data
+ *   gives the position of every block, so any track can be read on its own.
+ *
+ * FORMAT
+ *   HEADER    See the CIMG fields below.
+ *   INDEX     One entry per block: offset from the start of the file and
+ *             stored length. A block whose stored length equals its plain
+ *             length is stored as is.
+ *   BLOCKS    The (compressed) block data.
+ *
+ * CODEC
+ *   A byte oriented LZ77 variant. Every token either introduces a run of
+ *   literals or a match that copies earlier output of the same block:
+ *     0xxxxxxx                 x+1 literal bytes follow
+ *     1xxxxxxx [ext] dd dd     copy x+3 bytes from dddd bytes back; when x is
+ *                              127 extension bytes are added to the length
+ *                              until one is not 255
+ *   Matches may overlap their own output, so runs (e.g. zero-filled sectors)
+ *   compress to a handful of bytes.
+ */
+#ifndef CONTAINER_HPP
+#define CONTAINER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "layout.hpp"
+
+#define CIMG_MAGIC          "MOSZ"      // Identifies a compressed image
+#define CIMG_VERSION        1
+#define CIMG_MIN_MATCH      3           // Shortest match worth a token
+#define CIMG_MAX_DISTANCE   0xFFFF      // Furthest a match can reach back
+#define CIMG_HASH_BITS      12
+#define CIMG_MAX_IMAGE_SIZE 0x400000    // Largest image accepted; well above a 2.88MB floppy
+
+
+/**
+ * HEADER
+ */
+namespace CIMG
+{
+    typedef Field<0, 4>                 Magic;
+    typedef Field<Magic::end, 2>        Version;
+    typedef Field<Version::end, 2>      Reserved;
+    typedef Field<Reserved::end, 4>     ImageSize;
+    typedef Field<ImageSize::end, 4>    BlockSize;
+    typedef Field<BlockSize::end, 4>    BlockCount;
+
+    constexpr size_t SIZE = BlockCount::end;
+
+    namespace INDEX
+    {
+        typedef Field<0, 4>             Offset;
+        typedef Field<Offset::end, 4>   Length;
+
+        constexpr size_t SIZE = Length::end;
+    }
+}
+
+typedef struct
+{
+    uint32_t    imageSize;
+    uint32_t    blockSize;
+    uint32_t    blockCount;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> lengths;
+} CIMGHeader_t;
+
+
+/**
+ * Checks whether the data starts with the container magic.
+ */
+inline bool CIMG_detect(const uint8_t *data, size_t n)
+{
+    return n >= 4 && !memcmp(data, CIMG_MAGIC, 4);
+}
+
+
+/**
+ * Gets the plain length of the given block; the last one may be short.
+ */
+inline size_t CIMG_plainLength(const CIMGHeader_t *header, size_t index)
+{
+    size_t start = index * header->blockSize;
+    size_t left = header->imageSize - start;
+    return (left < header->blockSize) ? left : header->blockSize;
+}
+
+
+/**
+ * Emits the pending literals up to the given end, in runs of at most 128 bytes.
+ */
+inline bool CIMG_emitLiterals(const uint8_t *src, size_t *anchor, size_t end, uint8_t *dst, size_t *op, size_t cap)
+{
+    while (*anchor < end)
+    {
+        size_t count = end - *anchor;
+        if (count > 128) count = 128;
+        if (*op + 1 + count > cap) return false;
+
+        dst[(*op)++] = static_cast<uint8_t>(count - 1);
+        memcpy(dst + *op, src + *anchor, count);
+        *op += count;
+        *anchor += count;
+    }
+
+    return true;
+}
+
+
+/**
+ * Compresses a single block.
+ * @param src The plain data.
+ * @param n The length of the plain data; at most CIMG_MAX_DISTANCE + 1.
+ * @param dst Receives the compressed data.
+ * @param cap The capacity of the destination.
+ * @return The compressed length, or zero when it would not fit.
+ */
+inline size_t CIMG_compressBlock(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    int32_t table[1 << CIMG_HASH_BITS];
+    size_t ip = 0, op = 0, anchor = 0;
+
+    memset(table, 0xFF, sizeof(table));
+
+    while (ip + CIMG_MIN_MATCH <= n)
+    {
+        uint32_t key = src[ip] | (src[ip + 1] << 8) | (src[ip + 2] << 16);
+        uint32_t hash = (key * 2654435761u) >> (32 - CIMG_HASH_BITS);
+        int32_t candidate = table[hash];
+        size_t length = 0;
+
+        table[hash] = static_cast<int32_t>(ip);
+
+        if (candidate >= 0 && (ip - candidate) <= CIMG_MAX_DISTANCE)
+        {
+            while (ip + length < n && src[candidate + length] == src[ip + length])
+            {
+                length++;
+            }
+        }
+
+        if (length < CIMG_MIN_MATCH)
+        {
+            ip++;
+            continue;
+        }
+
+        if (!CIMG_emitLiterals(src, &anchor, ip, dst, &op, cap))
+        {
+            return 0;
+        }
+
+        // Token, length extension and distance
+        size_t extra = length - CIMG_MIN_MATCH;
+        size_t distance = ip - candidate;
+
+        if (op + 1 + (extra / 255) + 1 + 2 > cap)
+        {
+            return 0;
+        }
+
+        if (extra < 127)
+        {
+            dst[op++] = static_cast<uint8_t>(0x80 | extra);
+        }
+        else
+        {
+            dst[op++] = 0xFF;
+            for (extra -= 127; extra >= 255; extra -= 255)
+            {
+                dst[op++] = 255;
+            }
+            dst[op++] = static_cast<uint8_t>(extra);
+        }
+
+        LE_store16(dst + op, static_cast<uint16_t>(distance));
+        op += 2;
+
+        ip += length;
+        anchor = ip;
+    }
+
+    return CIMG_emitLiterals(src, &anchor, n, dst, &op, cap) ? op : 0;
+}
+
+
+/**
+ * Decompresses a single block.
+ * @param src The compressed data.
+ * @param n The length of the compressed data.
+ * @param dst Receives the plain data.
+ * @param size The exact plain length of the block.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int CIMG_decompressBlock(const uint8_t *src, size_t n, uint8_t *dst, size_t size)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < n)
+    {
+        uint8_t token = src[ip++];
+
+        if (!(token & 0x80))
+        {
+            size_t count = token + 1u;
+            if (ip + count > n || op + count > size) return -1;
+
+            memcpy(dst + op, src + ip, count);
+            ip += count;
+            op += count;
+            continue;
+        }
+
+        size_t length = (token & 0x7F) + CIMG_MIN_MATCH;
+        if ((token & 0x7F) == 0x7F)
+        {
+            uint8_t ext;
+            do
+            {
+                if (ip >= n) return -2;
+                ext = src[ip++];
+                length += ext;
+            }
+            while (ext == 255);
+        }
+
+        if (ip + 2 > n) return -3;
+        size_t distance = LE_load16(src + ip);
+        ip += 2;
+
+        if (distance == 0 || distance > op || op + length > size) return -4;
+
+        // Byte by byte, as the source may overlap the output
+        for (size_t i = 0; i < length; i++, op++)
+        {
+            dst[op] = dst[op - distance];
+        }
+    }
+
+    return (op == size) ? 0 : -5;
+}
+
+
+/**
+ * Writes an image as a container. The output is written front to back, so
+ * a pipe works as well.
+ * @param file The output stream.
+ * @param image The plain image.
+ * @param size The size of the image in bytes.
+ * @param blockSize The size of a block, normally one track.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int CIMG_write(FILE *file, const uint8_t *image, size_t size, size_t blockSize)
+{
+    uint8_t header[CIMG::SIZE];
+    size_t used = 0;
+
+    if (blockSize == 0 || blockSize > CIMG_MAX_DISTANCE + 1)
+    {
+        return -1;
+    }
+
+    size_t count = (size + blockSize - 1) / blockSize;
+    std::vector<uint8_t> index(count * CIMG::INDEX::SIZE);
+    std::vector<uint8_t> data(size);
+    size_t offset = CIMG::SIZE + index.size();
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *plain = image + (i * blockSize);
+        size_t length = ((size - i * blockSize) < blockSize) ? (size - i * blockSize) : blockSize;
+
+        // Only keep the compressed form when it is actually smaller
+        size_t packed = CIMG_compressBlock(plain, length, data.data() + used, length - 1);
+        if (packed == 0)
+        {
+            memcpy(data.data() + used, plain, length);
+            packed = length;
+        }
+
+        setField<CIMG::INDEX::Offset>(index.data() + (i * CIMG::INDEX::SIZE), static_cast<uint32_t>(offset + used));
+        setField<CIMG::INDEX::Length>(index.data() + (i * CIMG::INDEX::SIZE), static_cast<uint32_t>(packed));
+        used += packed;
+    }
+
+    setBytes<CIMG::Magic>(header, CIMG_MAGIC);
+    setField<CIMG::Version>(header, CIMG_VERSION);
+    setField<CIMG::Reserved>(header, 0);
+    setField<CIMG::ImageSize>(header, static_cast<uint32_t>(size));
+    setField<CIMG::BlockSize>(header, static_cast<uint32_t>(blockSize));
+    setField<CIMG::BlockCount>(header, static_cast<uint32_t>(count));
+
+    if (fwrite(header, 1, CIMG::SIZE, file) != CIMG::SIZE ||
+        fwrite(index.data(), 1, index.size(), file) != index.size() ||
+        fwrite(data.data(), 1, used, file) != used)
+    {
+        return -2;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads the header and index of a container.
+ * @param file The input stream, positioned at the start of the container.
+ * @param header Receives the header.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int CIMG_readHeader(FILE *file, CIMGHeader_t *header)
+{
+    uint8_t raw[CIMG::SIZE];
+
+    if (fread(raw, 1, CIMG::SIZE, file) != CIMG::SIZE || !CIMG_detect(raw, CIMG::SIZE))
+    {
+        return -1;
+    }
+
+    if (getField<CIMG::Version>(raw) != CIMG_VERSION)
+    {
+        return -2;
+    }
+
+    header->imageSize = getField<CIMG::ImageSize>(raw);
+    header->blockSize = getField<CIMG::BlockSize>(raw);
+    header->blockCount = getField<CIMG::BlockCount>(raw);
+
+    // The sizes come from the file; a damaged header must not drive the allocations below
+    if (header->imageSize > CIMG_MAX_IMAGE_SIZE ||
+        header->blockSize == 0 || header->blockSize > CIMG_MAX_DISTANCE + 1 ||
+        header->blockCount != (header->imageSize + header->blockSize - 1) / header->blockSize)
+    {
+        return -3;
+    }
+
+    std::vector<uint8_t> index(header->blockCount * CIMG::INDEX::SIZE);
+    if (fread(index.data(), 1, index.size(), file) != index.size())
+    {
+        return -4;
+    }
+
+    header->offsets.resize(header->blockCount);
+    header->lengths.resize(header->blockCount);
+    for (size_t i = 0; i < header->blockCount; i++)
+    {
+        header->offsets[i] = getField<CIMG::INDEX::Offset>(index.data() + (i * CIMG::INDEX::SIZE));
+        header->lengths[i] = getField<CIMG::INDEX::Length>(index.data() + (i * CIMG::INDEX::SIZE));
+
+        if (header->lengths[i] > CIMG_plainLength(header, i))
+        {
+            return -5;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Reads a single block of a container, independent of all the others.
+ * @param file The input stream.
+ * @param header The header of the container.
+ * @param index The block to read.
+ * @param dst Receives the plain block; must hold a full block.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int CIMG_readBlock(FILE *file, const CIMGHeader_t *header, size_t index, uint8_t *dst)
+{
+    static uint8_t packed[CIMG_MAX_DISTANCE + 1];
+    size_t plain = CIMG_plainLength(header, index);
+    size_t length = header->lengths[index];
+
+    if (fseek(file, header->offsets[index], SEEK_SET) || fread(packed, 1, length, file) != length)
+    {
+        return -1;
+    }
+
+    if (length == plain)
+    {
+        memcpy(dst, packed, plain);
+        return 0;
+    }
+
+    return CIMG_decompressBlock(packed, length, dst, plain) ? -2 : 0;
+}
+
+
+/**
+ * Reads a complete container into memory.
+ * @param file The input stream, positioned at the start of the container.
+ * @param image Receives the plain image.
+ * @param size The size the image is expected to have.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int CIMG_read(FILE *file, uint8_t *image, size_t size)
+{
+    CIMGHeader_t header;
+    int result;
+
+    result = CIMG_readHeader(file, &header);
+    if (result)
+    {
+        return result;
+    }
+
+    if (header.imageSize != size)
+    {
+        return -6;
+    }
+
+    for (size_t i = 0; i < header.blockCount; i++)
+    {
+        if (CIMG_readBlock(file, &header, i, image + (i * header.blockSize)))
+        {
+            return -7;
+        }
+    }
+
+    return 0;
+}
+
+#endif //CONTAINER_HPP
@@ -0,0 +1,456 @@
+/**
+ * LAYOUT
+ *   Describes the on-disk structures of FAT12 once, at compile time. All the
+ *   tools decode and encode the boot sector, directory entries and long file
+ *   name entries through this header.
+ *
+ * REMARKS
+ *   Values are assembled from individual bytes, which makes the codecs
+ *   independent of the host's endianness and of the alignment of the data.
+ *   Compilers reduce these to single (unaligned) loads and stores.
+ */
+#ifndef LAYOUT_HPP
+#define LAYOUT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+/**
+ * LITTLE-ENDIAN
+ *   Loads and stores of little-endian values from and to a byte span.
+ */
+inline uint8_t LE_load8(const uint8_t *p)
+{
+    return p[0];
+}
+
+inline uint16_t LE_load16(const uint8_t *p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+inline uint32_t LE_load32(const uint8_t *p)
+{
+    return (static_cast<uint32_t>(p[0]) << 0) |
+           (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) |
+           (static_cast<uint32_t>(p[3]) << 24);
+}
+
+inline uint64_t LE_load64(const uint8_t *p)
+{
+    return (static_cast<uint64_t>(LE_load32(p + 4)) << 32) | LE_load32(p);
+}
+
+inline void LE_store8(uint8_t *p, uint8_t value)
+{
+    p[0] = value;
+}
+
+inline void LE_store16(uint8_t *p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 0);
+    p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+inline void LE_store32(uint8_t *p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 0);
+    p[1] = static_cast<uint8_t>(value >> 8);
+    p[2] = static_cast<uint8_t>(value >> 16);
+    p[3] = static_cast<uint8_t>(value >> 24);
+}
+
+inline void LE_store64(uint8_t *p, uint64_t value)
+{
+    LE_store32(p + 0, static_cast<uint32_t>(value >> 0));
+    LE_store32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+
+/**
+ * FIELDS
+ *   A field is described by its offset and size within a structure. Fields
+ *   are declared relative to the end of the previous field, so a layout can
+ *   never contain gaps or overlaps.
+ */
+template <size_t Offset, size_t Size>
+struct Field
+{
+    static constexpr size_t offset = Offset;
+    static constexpr size_t size = Size;
+    static constexpr size_t end = Offset + Size;
+};
+
+template <size_t Size> struct FieldCodec;
+
+template <> struct FieldCodec<1>
+{
+    static uint32_t load(const uint8_t *p)          { return LE_load8(p); }
+    static void store(uint8_t *p, uint32_t value)   { LE_store8(p, static_cast<uint8_t>(value)); }
+};
+
+template <> struct FieldCodec<2>
+{
+    static uint32_t load(const uint8_t *p)          { return LE_load16(p); }
+    static void store(uint8_t *p, uint32_t value)   { LE_store16(p, static_cast<uint16_t>(value)); }
+};
+
+template <> struct FieldCodec<4>
+{
+    static uint32_t load(const uint8_t *p)          { return LE_load32(p); }
+    static void store(uint8_t *p, uint32_t value)   { LE_store32(p, value); }
+};
+
+/** Gets the numeric value of the field. */
+template <typename F>
+inline uint32_t getField(const uint8_t *base)
+{
+    return FieldCodec<F::size>::load(base + F::offset);
+}
+
+/** Sets the numeric value of the field. */
+template <typename F>
+inline void setField(uint8_t *base, uint32_t value)
+{
+    FieldCodec<F::size>::store(base + F::offset, value);
+}
+
+/** Copies the raw bytes of the field. */
+template <typename F>
+inline void getBytes(const uint8_t *base, void *dest)
+{
+    memcpy(dest, base + F::offset, F::size);
+}
+
+/** Overwrites the raw bytes of the field. */
+template <typename F>
+inline void setBytes(uint8_t *base, const void *src)
+{
+    memcpy(base + F::offset, src, F::size);
+}
+
+
+/**
+ * BIOS PARAMETER BLOCK
+ *   Resides in the boot sector, including the extended BPB.
+ */
+namespace BPB
+{
+    typedef Field<0, 3>                         Jump;
+    typedef Field<Jump::end, 8>                 OemId;
+    typedef Field<OemId::end, 2>                BytesPerSector;
+    typedef Field<BytesPerSector::end, 1>       SectorsPerCluster;
+    typedef Field<SectorsPerCluster::end, 2>    ReservedSectors;
+    typedef Field<ReservedSectors::end, 1>      NumberOfFats;
+    typedef Field<NumberOfFats::end, 2>         MaxRootEntries;
+    typedef Field<MaxRootEntries::end, 2>       SmallSectors;
+    typedef Field<SmallSectors::end, 1>         MediaDescriptor;
+    typedef Field<MediaDescriptor::end, 2>      SectorsPerFat;
+    typedef Field<SectorsPerFat::end, 2>        SectorsPerTrack;
+    typedef Field<SectorsPerTrack::end, 2>      NumberOfHeads;
+    typedef Field<NumberOfHeads::end, 4>        HiddenSectors;
+    typedef Field<HiddenSectors::end, 4>        LargeSectors;
+    typedef Field<LargeSectors::end, 1>         DriveNo;
+    typedef Field<DriveNo::end, 1>              Reserved;
+    typedef Field<Reserved::end, 1>             BootSignature;
+    typedef Field<BootSignature::end, 4>        VolumeId;
+    typedef Field<VolumeId::end, 11>            VolumeLabel;
+    typedef Field<VolumeLabel::end, 8>          FileSystemType;
+
+    constexpr size_t SIZE = FileSystemType::end;
+}
+
+static_assert(BPB::BytesPerSector::offset == 11,    "BPB: bytes per sector");
+static_assert(BPB::SectorsPerCluster::offset == 13, "BPB: sectors per cluster");
+static_assert(BPB::ReservedSectors::offset == 14,   "BPB: reserved sectors");
+static_assert(BPB::NumberOfFats::offset == 16,      "BPB: number of FATs");
+static_assert(BPB::MaxRootEntries::offset == 17,    "BPB: root entries");
+static_assert(BPB::SmallSectors::offset == 19,      "BPB: small sectors");
+static_assert(BPB::MediaDescriptor::offset == 21,   "BPB: media descriptor");
+static_assert(BPB::SectorsPerFat::offset == 22,     "BPB: sectors per FAT");
+static_assert(BPB::SectorsPerTrack::offset == 24,   "BPB: sectors per track");
+static_assert(BPB::NumberOfHeads::offset == 26,     "BPB: number of heads");
+static_assert(BPB::HiddenSectors::offset == 28,     "BPB: hidden sectors");
+static_assert(BPB::LargeSectors::offset == 32,      "BPB: large sectors");
+static_assert(BPB::DriveNo::offset == 36,           "EBPB: drive number");
+static_assert(BPB::BootSignature::offset == 38,     "EBPB: boot signature");
+static_assert(BPB::VolumeId::offset == 39,          "EBPB: volume id");
+static_assert(BPB::VolumeLabel::offset == 43,       "EBPB: volume label");
+static_assert(BPB::FileSystemType::offset == 54,    "EBPB: file system type");
+static_assert(BPB::SIZE == 62,                      "BPB: size");
+
+typedef struct
+{
+    char        oemId[8];
+    uint16_t    bytesPerSector;
+    uint8_t     sectorsPerCluster;
+    uint16_t    reservedSectors;
+    uint8_t     numberOfFats;
+    uint16_t    maxRootEntries;
+    uint16_t    smallSectors;
+    uint8_t     mediaDescriptor;
+    uint16_t    sectorsPerFat;
+    uint16_t    sectorsPerTrack;
+    uint16_t    numberOfHeads;
+    uint32_t    hiddenSectors;
+    uint32_t    largeSectors;
+    uint8_t     driveNo;
+    uint8_t     reserved;
+    uint8_t     bootSignature;
+    uint32_t    volumeId;
+    char        volumeLabel[11];
+    char        fileSystemType[8];
+} BPB_t;
+
+inline void BPB_decode(const uint8_t *src, BPB_t *bpb)
+{
+    getBytes<BPB::OemId>(src, bpb->oemId);
+    bpb->bytesPerSector     = static_cast<uint16_t>(getField<BPB::BytesPerSector>(src));
+    bpb->sectorsPerCluster  = static_cast<uint8_t>(getField<BPB::SectorsPerCluster>(src));
+    bpb->reservedSectors    = static_cast<uint16_t>(getField<BPB::ReservedSectors>(src));
+    bpb->numberOfFats       = static_cast<uint8_t>(getField<BPB::NumberOfFats>(src));
+    bpb->maxRootEntries     = static_cast<uint16_t>(getField<BPB::MaxRootEntries>(src));
+    bpb->smallSectors       = static_cast<uint16_t>(getField<BPB::SmallSectors>(src));
+    bpb->mediaDescriptor    = static_cast<uint8_t>(getField<BPB::MediaDescriptor>(src));
+    bpb->sectorsPerFat      = static_cast<uint16_t>(getField<BPB::SectorsPerFat>(src));
+    bpb->sectorsPerTrack    = static_cast<uint16_t>(getField<BPB::SectorsPerTrack>(src));
+    bpb->numberOfHeads      = static_cast<uint16_t>(getField<BPB::NumberOfHeads>(src));
+    bpb->hiddenSectors      = getField<BPB::HiddenSectors>(src);
+    bpb->largeSectors       = getField<BPB::LargeSectors>(src);
+    bpb->driveNo            = static_cast<uint8_t>(getField<BPB::DriveNo>(src));
+    bpb->reserved           = static_cast<uint8_t>(getField<BPB::Reserved>(src));
+    bpb->bootSignature      = static_cast<uint8_t>(getField<BPB::BootSignature>(src));
+    bpb->volumeId           = getField<BPB::VolumeId>(src);
+    getBytes<BPB::VolumeLabel>(src, bpb->volumeLabel);
+    getBytes<BPB::FileSystemType>(src, bpb->fileSystemType);
+}
+
+inline void BPB_encode(const BPB_t *bpb, uint8_t *dest)
+{
+    setBytes<BPB::OemId>(dest, bpb->oemId);
+    setField<BPB::BytesPerSector>(dest, bpb->bytesPerSector);
+    setField<BPB::SectorsPerCluster>(dest, bpb->sectorsPerCluster);
+    setField<BPB::ReservedSectors>(dest, bpb->reservedSectors);
+    setField<BPB::NumberOfFats>(dest, bpb->numberOfFats);
+    setField<BPB::MaxRootEntries>(dest, bpb->maxRootEntries);
+    setField<BPB::SmallSectors>(dest, bpb->smallSectors);
+    setField<BPB::MediaDescriptor>(dest, bpb->mediaDescriptor);
+    setField<BPB::SectorsPerFat>(dest, bpb->sectorsPerFat);
+    setField<BPB::SectorsPerTrack>(dest, bpb->sectorsPerTrack);
+    setField<BPB::NumberOfHeads>(dest, bpb->numberOfHeads);
+    setField<BPB::HiddenSectors>(dest, bpb->hiddenSectors);
+    setField<BPB::LargeSectors>(dest, bpb->largeSectors);
+    setField<BPB::DriveNo>(dest, bpb->driveNo);
+    setField<BPB::Reserved>(dest, bpb->reserved);
+    setField<BPB::BootSignature>(dest, bpb->bootSignature);
+    setField<BPB::VolumeId>(dest, bpb->volumeId);
+    setBytes<BPB::VolumeLabel>(dest, bpb->volumeLabel);
+    setBytes<BPB::FileSystemType>(dest, bpb->fileSystemType);
+}
+
+
+/**
+ * DIRECTORY ENTRY
+ *   A traditional 8.3 directory entry.
+ */
+namespace DIR
+{
+    typedef Field<0, 8>                         Name;
+    typedef Field<Name::end, 3>                 Extension;
+    typedef Field<Extension::end, 1>            Attributes;
+    typedef Field<Attributes::end, 1>           Reserved;
+    typedef Field<Reserved::end, 1>             CreationTenth;
+    typedef Field<CreationTenth::end, 2>        CreationTime;
+    typedef Field<CreationTime::end, 2>         CreationDate;
+    typedef Field<CreationDate::end, 2>         LastAccessDate;
+    typedef Field<LastAccessDate::end, 2>       Ignored;            // High cluster on FAT32
+    typedef Field<Ignored::end, 2>              LastWriteTime;
+    typedef Field<LastWriteTime::end, 2>        LastWriteDate;
+    typedef Field<LastWriteDate::end, 2>        FirstCluster;
+    typedef Field<FirstCluster::end, 4>         FileSize;
+
+    constexpr size_t SIZE = FileSize::end;
+}
+
+static_assert(DIR::Attributes::offset == 11,    "DIR: attributes");
+static_assert(DIR::CreationTime::offset == 14,  "DIR: creation time");
+static_assert(DIR::LastWriteTime::offset == 22, "DIR: last write time");
+static_assert(DIR::FirstCluster::offset == 26,  "DIR: first cluster");
+static_assert(DIR::FileSize::offset == 28,      "DIR: file size");
+static_assert(DIR::SIZE == 32,                  "DIR: size");
+
+typedef struct
+{
+    char        name[8];
+    char        extension[3];
+    uint8_t     attributes;
+    uint8_t     reserved;
+    uint8_t     creationTenth;
+    uint16_t    creationTime;
+    uint16_t    creationDate;
+    uint16_t    lastAccessDate;
+    uint16_t    ignored;
+    uint16_t    lastWriteTime;
+    uint16_t    lastWriteDate;
+    uint16_t    firstCluster;
+    uint32_t    fileSize;
+} DirEntry_t;
+
+inline void DIR_decode(const uint8_t *src, DirEntry_t *entry)
+{
+    getBytes<DIR::Name>(src, entry->name);
+    getBytes<DIR::Extension>(src, entry->extension);
+    entry->attributes       = static_cast<uint8_t>(getField<DIR::Attributes>(src));
+    entry->reserved         = static_cast<uint8_t>(getField<DIR::Reserved>(src));
+    entry->creationTenth    = static_cast<uint8_t>(getField<DIR::CreationTenth>(src));
+    entry->creationTime     = static_cast<uint16_t>(getField<DIR::CreationTime>(src));
+    entry->creationDate     = static_cast<uint16_t>(getField<DIR::CreationDate>(src));
+    entry->lastAccessDate   = static_cast<uint16_t>(getField<DIR::LastAccessDate>(src));
+    entry->ignored          = static_cast<uint16_t>(getField<DIR::Ignored>(src));
+    entry->lastWriteTime    = static_cast<uint16_t>(getField<DIR::LastWriteTime>(src));
+    entry->lastWriteDate    = static_cast<uint16_t>(getField<DIR::LastWriteDate>(src));
+    entry->firstCluster     = static_cast<uint16_t>(getField<DIR::FirstCluster>(src));
+    entry->fileSize         = getField<DIR::FileSize>(src);
+}
+
+inline void DIR_encode(const DirEntry_t *entry, uint8_t *dest)
+{
+    setBytes<DIR::Name>(dest, entry->name);
+    setBytes<DIR::Extension>(dest, entry->extension);
+    setField<DIR::Attributes>(dest, entry->attributes);
+    setField<DIR::Reserved>(dest, entry->reserved);
+    setField<DIR::CreationTenth>(dest, entry->creationTenth);
+    setField<DIR::CreationTime>(dest, entry->creationTime);
+    setField<DIR::CreationDate>(dest, entry->creationDate);
+    setField<DIR::LastAccessDate>(dest, entry->lastAccessDate);
+    setField<DIR::Ignored>(dest, entry->ignored);
+    setField<DIR::LastWriteTime>(dest, entry->lastWriteTime);
+    setField<DIR::LastWriteDate>(dest, entry->lastWriteDate);
+    setField<DIR::FirstCluster>(dest, entry->firstCluster);
+    setField<DIR::FileSize>(dest, entry->fileSize);
+}
+
+/** Decodes a span of consecutive directory entries. */
+inline void DIR_decodeAll(const uint8_t *src, size_t count, DirEntry_t *entries)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        DIR_decode(src + (i * DIR::SIZE), entries + i);
+    }
+}
+
+/** Encodes a span of consecutive directory entries. */
+inline void DIR_encodeAll(const DirEntry_t *entries, size_t count, uint8_t *dest)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        DIR_encode(entries + i, dest + (i * DIR::SIZE));
+    }
+}
+
+
+/**
+ * LONG FILE NAME ENTRY
+ *   A VFAT entry holding 13 UCS-2 characters of a long file name.
+ */
+namespace LFN
+{
+    typedef Field<0, 1>                         Order;
+    typedef Field<Order::end, 10>               Name0;
+    typedef Field<Name0::end, 1>                Attributes;
+    typedef Field<Attributes::end, 1>           Type;
+    typedef Field<Type::end, 1>                 Checksum;
+    typedef Field<Checksum::end, 12>            Name1;
+    typedef Field<Name1::end, 2>                FirstCluster;       // Always zero
+    typedef Field<FirstCluster::end, 4>         Name2;
+
+    constexpr size_t SIZE = Name2::end;
+    constexpr size_t CHARACTERS = (Name0::size + Name1::size + Name2::size) / 2;
+    constexpr uint8_t LAST = 0x40;                                  // Flag in the order of the last entry
+    constexpr size_t MAX_ENTRIES = 20;                              // 255 characters at most
+}
+
+static_assert(LFN::Attributes::offset == 11,    "LFN: attributes");
+static_assert(LFN::Checksum::offset == 13,      "LFN: checksum");
+static_assert(LFN::Name1::offset == 14,         "LFN: name part 2");
+static_assert(LFN::FirstCluster::offset == 26,  "LFN: first cluster");
+static_assert(LFN::SIZE == DIR::SIZE,           "LFN: size");
+static_assert(LFN::CHARACTERS == 13,            "LFN: characters");
+
+typedef struct
+{
+    uint8_t     order;
+    uint8_t     attributes;
+    uint8_t     type;
+    uint8_t     checksum;
+    uint16_t    firstCluster;
+    uint16_t    name[LFN::CHARACTERS];
+} LFNEntry_t;
+
+inline void LFN_decode(const uint8_t *src, LFNEntry_t *entry)
+{
+    entry->order        = static_cast<uint8_t>(getField<LFN::Order>(src));
+    entry->attributes   = static_cast<uint8_t>(getField<LFN::Attributes>(src));
+    entry->type         = static_cast<uint8_t>(getField<LFN::Type>(src));
+    entry->checksum     = static_cast<uint8_t>(getField<LFN::Checksum>(src));
+    entry->firstCluster = static_cast<uint16_t>(getField<LFN::FirstCluster>(src));
+
+    uint16_t *name = entry->name;
+    for (size_t i = 0; i < LFN::Name0::size; i += 2) *name++ = LE_load16(src + LFN::Name0::offset + i);
+    for (size_t i = 0; i < LFN::Name1::size; i += 2) *name++ = LE_load16(src + LFN::Name1::offset + i);
+    for (size_t i = 0; i < LFN::Name2::size; i += 2) *name++ = LE_load16(src + LFN::Name2::offset + i);
+}
+
+inline void LFN_encode(const LFNEntry_t *entry, uint8_t *dest)
+{
+    setField<LFN::Order>(dest, entry->order);
+    setField<LFN::Attributes>(dest, entry->attributes);
+    setField<LFN::Type>(dest, entry->type);
+    setField<LFN::Checksum>(dest, entry->checksum);
+    setField<LFN::FirstCluster>(dest, entry->firstCluster);
+
+    const uint16_t *name = entry->name;
+    for (size_t i = 0; i < LFN::Name0::size; i += 2) LE_store16(dest + LFN::Name0::offset + i, *name++);
+    for (size_t i = 0; i < LFN::Name1::size; i += 2) LE_store16(dest + LFN::Name1::offset + i, *name++);
+    for (size_t i = 0; i < LFN::Name2::size; i += 2) LE_store16(dest + LFN::Name2::offset + i, *name++);
+}
+
+/** Checksum of the 8.3 name an LFN entry belongs to. */
+inline uint8_t LFN_checksum(const uint8_t *shortName)
+{
+    uint8_t sum = 0;
+
+    for (size_t i = 0; i < (DIR::Name::size + DIR::Extension::size); i++)
+    {
+        sum = static_cast<uint8_t>(((sum & 1) << 7) + (sum >> 1) + shortName[i]);
+    }
+
+    return sum;
+}
+
+
+/**
+ * FAT12 TABLE
+ *   Every two entries share three bytes. The odd entry occupies the upper
+ *   12-bits, the even entry the lower 12-bits of the 16-bit word.
+ */
+inline uint16_t FAT12_getEntry(const uint8_t *table, int index)
+{
+    uint16_t value = LE_load16(table + ((index * 3) / 2));
+    return static_cast<uint16_t>((value >> ((index & 1) * 4)) & 0xFFF);
+}
+
+inline void FAT12_setEntry(uint8_t *table, int index, uint16_t value)
+{
+    uint8_t *p = (table + ((index * 3) / 2));
+    int shift = ((index & 1) * 4);
+    uint16_t mask = static_cast<uint16_t>(0xFFF << shift);
+    uint16_t word = LE_load16(p);
+
+    LE_store16(p, static_cast<uint16_t>((word & ~mask) | ((value << shift) & mask)));
+}
+
+#endif //LAYOUT_HPP
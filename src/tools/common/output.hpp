@@ -0,0 +1,73 @@
+/**
+ * OUTPUT
+ *   Opens the image output of the tools. A path consisting of a single dash
+ *   selects the standard output, which allows an image to be piped straight
+ *   into another program instead of being staged on disk first.
+ *
+ * REMARKS
+ *   A pipe cannot seek, so anything written through these streams has to be
+ *   written front to back. Progress messages must not go to the standard
+ *   output while it carries the image.
+ */
+#ifndef OUTPUT_HPP
+#define OUTPUT_HPP
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <io.h>
+
+#define OUTPUT_STDOUT   "-"     // Path that selects the standard output
+
+
+/**
+ * Checks whether the path selects the standard output.
+ */
+inline bool OUTPUT_isStdout(const char *path)
+{
+    return !strcmp(path, OUTPUT_STDOUT);
+}
+
+
+/**
+ * Opens the output for writing in binary mode.
+ * @param file Receives the opened stream.
+ * @param path The path of the output file, or a dash for the standard output.
+ * @return Zero if successful; otherwise, an error code.
+ */
+inline errno_t OUTPUT_open(FILE **file, const char *path)
+{
+    if (OUTPUT_isStdout(path))
+    {
+        // Text mode would expand every 0Ah byte of the image
+        fflush(stdout);
+        if (_setmode(_fileno(stdout), _O_BINARY) == -1)
+        {
+            return errno;
+        }
+
+        *file = stdout;
+        return 0;
+    }
+
+    return fopen_s(file, path, "wb");
+}
+
+
+/**
+ * Closes the output; the standard output is only flushed.
+ * @param file The stream returned by OUTPUT_open.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int OUTPUT_close(FILE *file)
+{
+    if (file == stdout)
+    {
+        return fflush(file);
+    }
+
+    return fclose(file);
+}
+
+#endif //OUTPUT_HPP
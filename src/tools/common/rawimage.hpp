@@ -0,0 +1,314 @@
+/**
+ * RAW IMAGE
+ *   Writes unformatted device images: every input is placed at the next
+ *   sector boundary, in the order given, and the remainder of the device is
+ *   left empty. Shared by writeraw and the -raw mode of writefloppy.
+ *
+ * REMARKS
+ *   The output is created at its final size with a single end-of-file move
+ *   and mapped into memory. Inputs are read straight into the mapped view, so
+ *   the data is never staged in an intermediate buffer and the padding is
+ *   never written: sectors that receive no data read back as zero, which
+ *   covers both the alignment gaps and the tail of the device.
+ *
+ *   An image can also be streamed to a pipe, which cannot be mapped or
+ *   extended; the inputs are then copied in order and the padding is
+ *   written out explicitly.
+ */
+#ifndef RAWIMAGE_HPP
+#define RAWIMAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN 1
+#endif
+#include <Windows.h>
+
+#define RAW_SECTOR_SIZE     512         // Inputs are aligned to this many bytes
+#define RAW_MAP_EXTENSION   ".map"      // Appended to the image name for the sidecar
+#define RAW_STREAM_BUFFER   0x10000     // Bytes moved per call when streaming
+
+
+/**
+ * PLACEMENT
+ *   Records where a single input ended up in the image.
+ */
+struct RawPlacement_t
+{
+    std::string name;                   /* The name of the input file */
+    size_t      lba;                    /* The first sector of the input */
+    size_t      length;                 /* The length of the input in bytes */
+};
+
+
+/**
+ * IMAGE
+ *   An output image that is being written.
+ */
+struct RawImage_t
+{
+    HANDLE      file;                   /* The output file */
+    HANDLE      mapping;                /* The mapping of the output file */
+    FILE       *stream;                 /* The output stream, when not mapped */
+    uint8_t    *view;                   /* The mapped contents of the image */
+    size_t      size;                   /* The size of the image in bytes */
+    size_t      next;                   /* The offset of the next free sector */
+    bool        trim;                   /* Ends the image after the last input */
+    std::vector<RawPlacement_t> placements;
+};
+
+
+/**
+ * Gets the number of sectors needed to hold the given number of bytes.
+ */
+inline size_t RAW_sectors(size_t length)
+{
+    return (length + RAW_SECTOR_SIZE - 1) / RAW_SECTOR_SIZE;
+}
+
+
+/**
+ * Creates the output image at its final size and maps it into memory.
+ * @param image The image to initialize.
+ * @param path The path of the output file.
+ * @param size The size of the image in bytes.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int RAW_create(RawImage_t *image, const char *path, size_t size)
+{
+    LARGE_INTEGER end;
+
+    image->mapping = NULL;
+    image->stream = NULL;
+    image->view = nullptr;
+    image->size = size;
+    image->next = 0;
+    image->trim = false;
+    image->placements.clear();
+
+    image->file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+        CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (image->file == INVALID_HANDLE_VALUE)
+    {
+        return -1;
+    }
+
+    // Extend the empty file to the size of the device in one go
+    end.QuadPart = static_cast<LONGLONG>(size);
+    if (!SetFilePointerEx(image->file, end, NULL, FILE_BEGIN) || !SetEndOfFile(image->file))
+    {
+        CloseHandle(image->file);
+        return -2;
+    }
+
+    image->mapping = CreateFileMappingA(image->file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    if (image->mapping == NULL)
+    {
+        CloseHandle(image->file);
+        return -3;
+    }
+
+    image->view = static_cast<uint8_t *>(MapViewOfFile(image->mapping, FILE_MAP_WRITE, 0, 0, 0));
+    if (image->view == nullptr)
+    {
+        CloseHandle(image->mapping);
+        CloseHandle(image->file);
+        return -4;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Prepares an image that is written sequentially to an already opened stream.
+ * @param image The image to initialize.
+ * @param stream The output stream, e.g. a pipe.
+ * @param size The size of the image in bytes.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int RAW_createStream(RawImage_t *image, FILE *stream, size_t size)
+{
+    image->file = INVALID_HANDLE_VALUE;
+    image->mapping = NULL;
+    image->stream = stream;
+    image->view = nullptr;
+    image->size = size;
+    image->next = 0;
+    image->trim = false;
+    image->placements.clear();
+
+    return 0;
+}
+
+
+/**
+ * Writes the given number of zero bytes to a streamed image.
+ */
+inline int RAW_streamZeros(RawImage_t *image, size_t count)
+{
+    static const uint8_t zeros[RAW_STREAM_BUFFER] = { 0 };
+
+    while (count > 0)
+    {
+        size_t n = (count < RAW_STREAM_BUFFER) ? count : RAW_STREAM_BUFFER;
+
+        if (fwrite(zeros, 1, n, image->stream) != n)
+        {
+            return -1;
+        }
+
+        count -= n;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Copies the input to a streamed image and pads it to the next sector.
+ */
+inline int RAW_streamFile(RawImage_t *image, FILE *lpFileIn, size_t length)
+{
+    static uint8_t buffer[RAW_STREAM_BUFFER];
+    size_t remaining = length;
+
+    while (remaining > 0)
+    {
+        size_t n = (remaining < RAW_STREAM_BUFFER) ? remaining : RAW_STREAM_BUFFER;
+
+        if (fread(buffer, 1, n, lpFileIn) != n || fwrite(buffer, 1, n, image->stream) != n)
+        {
+            return -1;
+        }
+
+        remaining -= n;
+    }
+
+    return RAW_streamZeros(image, RAW_sectors(length) * RAW_SECTOR_SIZE - length);
+}
+
+
+/**
+ * Places the contents of the input file at the next free sector of the image.
+ * @param image The image to write to.
+ * @param lpFileIn The input file, positioned at its start.
+ * @param name The name to record for the input.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int RAW_append(RawImage_t *image, FILE *lpFileIn, const char *name)
+{
+    long length;
+
+    if (fseek(lpFileIn, 0, SEEK_END) || (length = ftell(lpFileIn)) < 0 || fseek(lpFileIn, 0, SEEK_SET))
+    {
+        return -1;
+    }
+
+    if (static_cast<size_t>(length) > (image->size - image->next))
+    {
+        return -2;
+    }
+
+    if (image->stream)
+    {
+        if (RAW_streamFile(image, lpFileIn, static_cast<size_t>(length)))
+        {
+            return -3;
+        }
+    }
+
+    // Large reads bypass the stream buffer and land directly in the view
+    else if (fread(image->view + image->next, 1, length, lpFileIn) != static_cast<size_t>(length))
+    {
+        return -3;
+    }
+
+    RawPlacement_t placement;
+    placement.name = name;
+    placement.lba = image->next / RAW_SECTOR_SIZE;
+    placement.length = static_cast<size_t>(length);
+    image->placements.push_back(placement);
+
+    image->next += RAW_sectors(placement.length) * RAW_SECTOR_SIZE;
+    return 0;
+}
+
+
+/**
+ * Flushes the image to disk and releases it. A streamed image is padded to
+ * its full size; the stream itself is left open. A trimmed image ends after
+ * the last sector of the last input instead.
+ * @param image The image to close.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int RAW_close(RawImage_t *image)
+{
+    size_t end = image->trim ? image->next : image->size;
+    LARGE_INTEGER length;
+    int result = 0;
+
+    if (image->stream)
+    {
+        if (RAW_streamZeros(image, end - image->next))   result = -1;
+        if (fflush(image->stream))                      result = -2;
+
+        image->stream = NULL;
+        return result;
+    }
+
+    if (!FlushViewOfFile(image->view, 0))   result = -1;
+    if (!UnmapViewOfFile(image->view))      result = -2;
+    if (!CloseHandle(image->mapping))       result = -3;
+
+    // A trimmed image is cut back once the view is gone
+    if (end < image->size)
+    {
+        length.QuadPart = static_cast<LONGLONG>(end);
+        if (!SetFilePointerEx(image->file, length, NULL, FILE_BEGIN) || !SetEndOfFile(image->file))
+        {
+            result = -5;
+        }
+    }
+
+    if (!CloseHandle(image->file))          result = -4;
+
+    image->view = nullptr;
+    return result;
+}
+
+
+/**
+ * Writes the sidecar listing the starting sector of every input, so the
+ * loaders can be pointed at a file without scanning the image.
+ * @param image The image that was written.
+ * @param path The path of the output image; the extension is appended to it.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int RAW_writeMap(const RawImage_t *image, const char *path)
+{
+    std::string mapPath = std::string(path) + RAW_MAP_EXTENSION;
+    FILE *lpFileMap;
+
+    if (fopen_s(&lpFileMap, mapPath.c_str(), "w"))
+    {
+        return -1;
+    }
+
+    fprintf(lpFileMap, "; %-6s %-8s %-10s %s\n", "LBA", "SECTORS", "BYTES", "FILE");
+    for (size_t i = 0; i < image->placements.size(); i++)
+    {
+        const RawPlacement_t &placement = image->placements[i];
+        fprintf(lpFileMap, "%-8zu %-8zu %-10zu %s\n", placement.lba,
+            RAW_sectors(placement.length), placement.length, placement.name.c_str());
+    }
+
+    return fclose(lpFileMap) ? -2 : 0;
+}
+
+#endif //RAWIMAGE_HPP
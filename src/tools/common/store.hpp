@@ -0,0 +1,431 @@
+/**
+ * STORE
+ *   A content addressed store for device images. Images are cut into
+ *   sectors; every distinct sector is kept once in a pack file and an image
+ *   is described by a recipe listing the chunk of each of its sectors. The
+ *   store therefore grows with the amount of changed data, not with the
+ *   number of images kept.
+ *
+ * FILES
+ *   A store is the directory holding the recipes; next to them are:
+ *     chunks.pak   The chunk data, appended to and never rewritten. Chunk n
+ *                  resides at offset n * STORE_CHUNK_SIZE.
+ *     chunks.idx   The content hash of every chunk, in the same order.
+ *   Both files are written at the offset that follows from the number of
+ *   chunks, never in append mode. The pack is always written before the
+ *   index, so after an interrupted write only the chunks present in both
+ *   are valid; opening the store cuts both files back to those chunks.
+ *
+ * REMARKS
+ *   Chunks are keyed by a 64-bit FNV-1a hash. A hit is compared against the
+ *   stored bytes before it is reused, so a collision can never corrupt an
+ *   image; the colliding chunk is simply stored again.
+ */
+#ifndef STORE_HPP
+#define STORE_HPP
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <io.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "layout.hpp"
+
+#define STORE_MAGIC         "MOSR"      // Identifies a recipe
+#define STORE_VERSION       1
+#define STORE_CHUNK_SIZE    512         // One sector per chunk
+#define STORE_PACK          "chunks.pak"
+#define STORE_INDEX         "chunks.idx"
+
+
+/**
+ * RECIPE
+ *   The header is followed by the chunk number of every sector.
+ */
+namespace RECIPE
+{
+    typedef Field<0, 4>                 Magic;
+    typedef Field<Magic::end, 2>        Version;
+    typedef Field<Version::end, 2>      Reserved;
+    typedef Field<Reserved::end, 4>     ChunkSize;
+    typedef Field<ChunkSize::end, 4>    ChunkCount;
+
+    constexpr size_t SIZE = ChunkCount::end;
+}
+
+
+/**
+ * An opened store.
+ */
+typedef struct
+{
+    std::string dir;                                /* Prefix of the store files */
+    FILE *pack;                                     /* The chunk data */
+    FILE *index;                                    /* The chunk hashes */
+    uint32_t count;                                 /* Number of valid chunks */
+    std::unordered_map<uint64_t, uint32_t> lookup;  /* Hash to chunk number */
+} Store_t;
+
+
+/**
+ * Checks whether the data starts with the recipe magic.
+ */
+inline bool STORE_detect(const uint8_t *data, size_t n)
+{
+    return n >= 4 && !memcmp(data, STORE_MAGIC, 4);
+}
+
+
+/**
+ * Gets the 64-bit FNV-1a hash of a chunk.
+ */
+inline uint64_t STORE_hash(const uint8_t *data, size_t n)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+
+/**
+ * Gets the store directory of a recipe, including the trailing separator.
+ */
+inline std::string STORE_dirOf(const char *recipe)
+{
+    const char *end = recipe;
+
+    for (const char *p = recipe; *p; p++)
+    {
+        if (*p == '\\' || *p == '/' || *p == ':')
+        {
+            end = p + 1;
+        }
+    }
+
+    return std::string(recipe, end);
+}
+
+
+/**
+ * Opens a store file for reading and writing; creates it if it does not exist.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_openFile(FILE **file, const std::string &path)
+{
+    errno_t error = fopen_s(file, path.c_str(), "r+b");
+
+    if (error == ENOENT)
+    {
+        error = fopen_s(file, path.c_str(), "w+b");
+    }
+
+    return error ? -1 : 0;
+}
+
+
+/**
+ * Cuts off everything of a store file past the given length.
+ * @param file The store file.
+ * @param length The length to keep; at most the current length.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_trimFile(FILE *file, long length)
+{
+    if (fflush(file) || _chsize_s(_fileno(file), length))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Opens (or creates) the store for adding chunks. A partial chunk, or chunks
+ * that were packed but never indexed, are cut off the files.
+ * @param store The store to initialize.
+ * @param dir The store directory, including the trailing separator.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_open(Store_t *store, const std::string &dir)
+{
+    uint8_t entry[8];
+    long packSize;
+    long indexSize;
+
+    store->dir = dir;
+    store->count = 0;
+    store->lookup.clear();
+
+    if (STORE_openFile(&store->pack, dir + STORE_PACK))
+    {
+        return -1;
+    }
+
+    if (STORE_openFile(&store->index, dir + STORE_INDEX))
+    {
+        fclose(store->pack);
+        return -2;
+    }
+
+    if (fseek(store->pack, 0, SEEK_END) || (packSize = ftell(store->pack)) < 0 ||
+        fseek(store->index, 0, SEEK_END) || (indexSize = ftell(store->index)) < 0)
+    {
+        fclose(store->index);
+        fclose(store->pack);
+        return -3;
+    }
+
+    // Only chunks that are both packed and indexed are valid
+    long count = packSize / STORE_CHUNK_SIZE;
+    if (count > indexSize / static_cast<long>(sizeof(entry)))
+    {
+        count = indexSize / static_cast<long>(sizeof(entry));
+    }
+
+    if ((packSize != count * STORE_CHUNK_SIZE && STORE_trimFile(store->pack, count * STORE_CHUNK_SIZE)) ||
+        (indexSize != count * static_cast<long>(sizeof(entry)) && STORE_trimFile(store->index, count * static_cast<long>(sizeof(entry)))))
+    {
+        fclose(store->index);
+        fclose(store->pack);
+        return -4;
+    }
+
+    rewind(store->index);
+    while (store->count < static_cast<uint32_t>(count) &&
+        fread(entry, 1, sizeof(entry), store->index) == sizeof(entry))
+    {
+        store->lookup.insert(std::make_pair(LE_load64(entry), store->count));
+        store->count++;
+    }
+
+    if (store->count != static_cast<uint32_t>(count))
+    {
+        fclose(store->index);
+        fclose(store->pack);
+        return -5;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Closes the store.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_close(Store_t *store)
+{
+    int result = 0;
+
+    if (fclose(store->index))   result = -1;
+    if (fclose(store->pack))    result = -2;
+
+    return result;
+}
+
+
+/**
+ * Adds a chunk to the store unless an identical one is already present.
+ * @param store The opened store.
+ * @param chunk The chunk data of STORE_CHUNK_SIZE bytes.
+ * @param id Receives the number of the chunk.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_put(Store_t *store, const uint8_t *chunk, uint32_t *id)
+{
+    uint8_t stored[STORE_CHUNK_SIZE];
+    uint8_t entry[8];
+    uint64_t hash = STORE_hash(chunk, STORE_CHUNK_SIZE);
+
+    auto hit = store->lookup.find(hash);
+    if (hit != store->lookup.end())
+    {
+        if (fseek(store->pack, static_cast<long>(hit->second) * STORE_CHUNK_SIZE, SEEK_SET) ||
+            fread(stored, 1, STORE_CHUNK_SIZE, store->pack) != STORE_CHUNK_SIZE)
+        {
+            return -1;
+        }
+
+        if (!memcmp(stored, chunk, STORE_CHUNK_SIZE))
+        {
+            *id = hit->second;
+            return 0;
+        }
+    }
+
+    // Write the chunk behind the last valid one; also needed after a read
+    if (fseek(store->pack, static_cast<long>(store->count) * STORE_CHUNK_SIZE, SEEK_SET) ||
+        fwrite(chunk, 1, STORE_CHUNK_SIZE, store->pack) != STORE_CHUNK_SIZE)
+    {
+        return -2;
+    }
+
+    LE_store64(entry, hash);
+    if (fseek(store->index, static_cast<long>(store->count) * static_cast<long>(sizeof(entry)), SEEK_SET) ||
+        fwrite(entry, 1, sizeof(entry), store->index) != sizeof(entry))
+    {
+        return -3;
+    }
+
+    store->lookup.insert(std::make_pair(hash, store->count));
+    *id = store->count++;
+    return 0;
+}
+
+
+/**
+ * Stores an image and writes its recipe; the store is the recipe's directory.
+ * @param recipe The path of the recipe to write.
+ * @param image The image data.
+ * @param size The size of the image; a multiple of STORE_CHUNK_SIZE.
+ * @param added Receives the number of chunks that were new to the store.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_writeRecipe(const char *recipe, const uint8_t *image, size_t size, size_t *added)
+{
+    Store_t store;
+    uint8_t header[RECIPE::SIZE];
+    size_t count = size / STORE_CHUNK_SIZE;
+    std::vector<uint8_t> ids(count * 4);
+    FILE *file;
+    int result = 0;
+
+    if (size % STORE_CHUNK_SIZE)
+    {
+        return -1;
+    }
+
+    if (STORE_open(&store, STORE_dirOf(recipe)))
+    {
+        return -2;
+    }
+
+    uint32_t before = store.count;
+    for (size_t i = 0; i < count && !result; i++)
+    {
+        uint32_t id;
+
+        result = STORE_put(&store, image + (i * STORE_CHUNK_SIZE), &id);
+        LE_store32(ids.data() + (i * 4), id);
+    }
+
+    *added = store.count - before;
+
+    // The chunks have to be on disk before a recipe may refer to them
+    if (STORE_close(&store) || result)
+    {
+        return -3;
+    }
+
+    setBytes<RECIPE::Magic>(header, STORE_MAGIC);
+    setField<RECIPE::Version>(header, STORE_VERSION);
+    setField<RECIPE::Reserved>(header, 0);
+    setField<RECIPE::ChunkSize>(header, STORE_CHUNK_SIZE);
+    setField<RECIPE::ChunkCount>(header, static_cast<uint32_t>(count));
+
+    if (fopen_s(&file, recipe, "wb"))
+    {
+        return -4;
+    }
+
+    if (fwrite(header, 1, RECIPE::SIZE, file) != RECIPE::SIZE ||
+        fwrite(ids.data(), 1, ids.size(), file) != ids.size())
+    {
+        result = -5;
+    }
+
+    if (fclose(file) && !result)
+    {
+        result = -6;
+    }
+
+    return result;
+}
+
+
+/**
+ * Materializes an image from its recipe. Runs of consecutive chunks are read
+ * from the pack in a single call, so images that were stored in one go are
+ * read back sequentially.
+ * @param file The recipe, positioned at its start.
+ * @param recipe The path of the recipe, used to locate the store.
+ * @param image Receives the image.
+ * @param size The size the image is expected to have.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int STORE_readRecipe(FILE *file, const char *recipe, uint8_t *image, size_t size)
+{
+    uint8_t header[RECIPE::SIZE];
+    FILE *pack;
+    long packSize;
+    int result = 0;
+
+    if (fread(header, 1, RECIPE::SIZE, file) != RECIPE::SIZE || !STORE_detect(header, RECIPE::SIZE))
+    {
+        return -1;
+    }
+
+    if (getField<RECIPE::Version>(header) != STORE_VERSION ||
+        getField<RECIPE::ChunkSize>(header) != STORE_CHUNK_SIZE ||
+        getField<RECIPE::ChunkCount>(header) * static_cast<size_t>(STORE_CHUNK_SIZE) != size)
+    {
+        return -2;
+    }
+
+    size_t count = getField<RECIPE::ChunkCount>(header);
+    std::vector<uint8_t> ids(count * 4);
+    if (fread(ids.data(), 1, ids.size(), file) != ids.size())
+    {
+        return -3;
+    }
+
+    if (fopen_s(&pack, (STORE_dirOf(recipe) + STORE_PACK).c_str(), "rb"))
+    {
+        return -4;
+    }
+
+    if (fseek(pack, 0, SEEK_END) || (packSize = ftell(pack)) < 0)
+    {
+        fclose(pack);
+        return -5;
+    }
+
+    size_t available = static_cast<size_t>(packSize) / STORE_CHUNK_SIZE;
+    for (size_t i = 0; i < count && !result; )
+    {
+        uint32_t first = LE_load32(ids.data() + (i * 4));
+        size_t run = 1;
+
+        while (i + run < count && LE_load32(ids.data() + ((i + run) * 4)) == first + run)
+        {
+            run++;
+        }
+
+        if (first + run > available)
+        {
+            result = -6;
+        }
+        else if (fseek(pack, static_cast<long>(first) * STORE_CHUNK_SIZE, SEEK_SET) ||
+            fread(image + (i * STORE_CHUNK_SIZE), STORE_CHUNK_SIZE, run, pack) != run)
+        {
+            result = -7;
+        }
+
+        i += run;
+    }
+
+    fclose(pack);
+    return result;
+}
+
+#endif //STORE_HPP
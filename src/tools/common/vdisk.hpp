@@ -0,0 +1,372 @@
+/**
+ * VIRTUAL DISK
+ *   Writes an in-memory image as a dynamically allocated virtual disk, so
+ *   it can be attached to a virtual machine without a conversion step.
+ *   Supported are the dynamic VHD and the VirtualBox VDI containers.
+ *
+ * REMARKS
+ *   The caller passes the set of sectors that hold data, which the image
+ *   tools derive from the FAT instead of scanning for zeros. Blocks without
+ *   any such sector are not allocated at all. Within an allocated VHD block
+ *   the sector bitmap only marks the used sectors, so the others read back
+ *   as zero without being looked at.
+ *
+ *   The output is written front to back, so a pipe works as well.
+ *
+ * LIMITATIONS
+ *   These containers cannot boot the system. VirtualBox only accepts raw
+ *   images on its floppy controller, so a VHD or VDI has to be attached as a
+ *   hard disk, and the bootloader hard-codes the floppy geometry and drive 0.
+ *   The formats are meant for inspecting or copying the volume with tools
+ *   and virtual machines that mount such disks; boot from the raw image.
+ */
+#ifndef VDISK_HPP
+#define VDISK_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include "layout.hpp"
+
+#define VDISK_SECTOR_SIZE       512
+#define VHD_BLOCK_SIZE          0x200000    // The block size every VHD reader supports
+#define VHD_TIME_EPOCH          946684800   // 2000-01-01 00:00:00 UTC
+#define VDI_BLOCK_SIZE          0x100000    // The block size VirtualBox creates
+#define VDI_BLOCK_FREE          0xFFFFFFFF  // The block is not allocated
+#define VDI_SIGNATURE           0xBEDA107F
+#define VDI_VERSION             0x00010001
+#define VDI_INFO                "<<< Oracle VM VirtualBox Disk Image >>>\n"
+
+
+/**
+ * BIG-ENDIAN
+ *   The VHD structures are stored in network order.
+ */
+inline void BE_store16(uint8_t *p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value >> 8);
+    p[1] = static_cast<uint8_t>(value >> 0);
+}
+
+inline void BE_store32(uint8_t *p, uint32_t value)
+{
+    BE_store16(p, static_cast<uint16_t>(value >> 16));
+    BE_store16(p + 2, static_cast<uint16_t>(value));
+}
+
+inline void BE_store64(uint8_t *p, uint64_t value)
+{
+    BE_store32(p, static_cast<uint32_t>(value >> 32));
+    BE_store32(p + 4, static_cast<uint32_t>(value));
+}
+
+
+/**
+ * Derives a unique identifier from the image contents and the time, so that
+ * two different disks never share one.
+ */
+inline void VDISK_uuid(const uint8_t *image, size_t size, uint8_t uuid[16])
+{
+    uint64_t a = 14695981039346656037ull;
+    uint64_t b = static_cast<uint64_t>(time(NULL)) * 0x9E3779B97F4A7C15ull;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        a = (a ^ image[i]) * 1099511628211ull;
+    }
+
+    b ^= a >> 17;
+    LE_store64(uuid, a);
+    LE_store64(uuid + 8, b);
+
+    // Version 4, variant 1
+    uuid[6] = static_cast<uint8_t>((uuid[6] & 0x0F) | 0x40);
+    uuid[8] = static_cast<uint8_t>((uuid[8] & 0x3F) | 0x80);
+}
+
+
+/**
+ * Checks whether any sector within the range is used.
+ */
+inline bool VDISK_anyUsed(const std::vector<bool> &used, size_t first, size_t count)
+{
+    for (size_t i = first; i < first + count && i < used.size(); i++)
+    {
+        if (used[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Writes the given data followed by zeros up to the given length.
+ */
+inline int VDISK_writePadded(FILE *file, const uint8_t *data, size_t n, size_t length)
+{
+    static const uint8_t zeros[VDISK_SECTOR_SIZE] = { 0 };
+
+    if (n && fwrite(data, 1, n, file) != n)
+    {
+        return -1;
+    }
+
+    for (length -= n; length > 0; )
+    {
+        size_t count = (length < VDISK_SECTOR_SIZE) ? length : VDISK_SECTOR_SIZE;
+        if (fwrite(zeros, 1, count, file) != count)
+        {
+            return -1;
+        }
+        length -= count;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Gets the one's complement checksum used by the VHD structures.
+ */
+inline uint32_t VHD_checksum(const uint8_t *data, size_t n)
+{
+    uint32_t sum = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += data[i];
+    }
+
+    return ~sum;
+}
+
+
+/**
+ * Writes the image as a dynamic VHD.
+ * @param file The output stream.
+ * @param image The image data.
+ * @param size The size of the image; a multiple of the sector size.
+ * @param used One flag per sector indicating it holds data.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int VHD_write(FILE *file, const uint8_t *image, size_t size, const std::vector<bool> &used)
+{
+    const size_t sectorsPerBlock = VHD_BLOCK_SIZE / VDISK_SECTOR_SIZE;
+    const size_t bitmapSize = ((sectorsPerBlock / 8) + VDISK_SECTOR_SIZE - 1) & ~static_cast<size_t>(VDISK_SECTOR_SIZE - 1);
+    size_t sectors = size / VDISK_SECTOR_SIZE;
+    size_t blocks = (size + VHD_BLOCK_SIZE - 1) / VHD_BLOCK_SIZE;
+    size_t batSize = ((blocks * 4) + VDISK_SECTOR_SIZE - 1) & ~static_cast<size_t>(VDISK_SECTOR_SIZE - 1);
+    uint8_t footer[512], header[1024];
+    std::vector<uint8_t> bat(batSize, 0xFF);
+    std::vector<uint8_t> bitmap(bitmapSize);
+
+    // CHS geometry as defined by the specification
+    uint32_t cylinders, heads, spt, cth;
+    uint32_t total = static_cast<uint32_t>(sectors);
+
+    spt = 17;
+    cth = total / spt;
+    heads = (cth + 1023) / 1024;
+    if (heads < 4) heads = 4;
+    if (cth >= heads * 1024 || heads > 16) { spt = 31; heads = 16; cth = total / spt; }
+    if (cth >= heads * 1024) { spt = 63; heads = 16; cth = total / spt; }
+    cylinders = cth / heads;
+
+    memset(footer, 0, sizeof(footer));
+    memcpy(footer + 0, "conectix", 8);
+    BE_store32(footer + 8, 0x00000002);                 // Features: reserved bit
+    BE_store32(footer + 12, 0x00010000);                // Version 1.0
+    BE_store64(footer + 16, 512);                       // Offset of the dynamic header
+    BE_store32(footer + 24, static_cast<uint32_t>(time(NULL) - VHD_TIME_EPOCH));
+    memcpy(footer + 28, "wfp2", 4);                     // Creator application
+    BE_store32(footer + 32, 0x00010000);
+    memcpy(footer + 36, "Wi2k", 4);                     // Creator host
+    BE_store64(footer + 40, size);
+    BE_store64(footer + 48, size);
+    BE_store16(footer + 56, static_cast<uint16_t>(cylinders));
+    footer[58] = static_cast<uint8_t>(heads);
+    footer[59] = static_cast<uint8_t>(spt);
+    BE_store32(footer + 60, 3);                         // Dynamic disk
+    VDISK_uuid(image, size, footer + 68);
+    BE_store32(footer + 64, VHD_checksum(footer, sizeof(footer)));
+
+    memset(header, 0, sizeof(header));
+    memcpy(header + 0, "cxsparse", 8);
+    BE_store64(header + 8, 0xFFFFFFFFFFFFFFFFull);      // No next structure
+    BE_store64(header + 16, 512 + sizeof(header));      // Offset of the BAT
+    BE_store32(header + 24, 0x00010000);
+    BE_store32(header + 28, static_cast<uint32_t>(blocks));
+    BE_store32(header + 32, VHD_BLOCK_SIZE);
+    BE_store32(header + 36, VHD_checksum(header, sizeof(header)));
+
+    // Blocks follow the BAT in order; unused ones get no space at all
+    size_t next = (512 + sizeof(header) + batSize) / VDISK_SECTOR_SIZE;
+    for (size_t b = 0; b < blocks; b++)
+    {
+        if (VDISK_anyUsed(used, b * sectorsPerBlock, sectorsPerBlock))
+        {
+            BE_store32(bat.data() + (b * 4), static_cast<uint32_t>(next));
+            next += (bitmapSize + VHD_BLOCK_SIZE) / VDISK_SECTOR_SIZE;
+        }
+    }
+
+    if (fwrite(footer, 1, sizeof(footer), file) != sizeof(footer) ||
+        fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+        fwrite(bat.data(), 1, bat.size(), file) != bat.size())
+    {
+        return -1;
+    }
+
+    for (size_t b = 0; b < blocks; b++)
+    {
+        size_t first = b * sectorsPerBlock;
+
+        if (!VDISK_anyUsed(used, first, sectorsPerBlock))
+        {
+            continue;
+        }
+
+        // Sector bitmap; the most significant bit is the first sector
+        std::fill(bitmap.begin(), bitmap.end(), 0);
+        for (size_t s = 0; s < sectorsPerBlock && first + s < sectors; s++)
+        {
+            if (used[first + s])
+            {
+                bitmap[s / 8] |= static_cast<uint8_t>(0x80 >> (s % 8));
+            }
+        }
+
+        size_t offset = first * VDISK_SECTOR_SIZE;
+        size_t n = ((size - offset) < VHD_BLOCK_SIZE) ? (size - offset) : VHD_BLOCK_SIZE;
+
+        if (fwrite(bitmap.data(), 1, bitmap.size(), file) != bitmap.size() ||
+            VDISK_writePadded(file, image + offset, n, VHD_BLOCK_SIZE))
+        {
+            return -2;
+        }
+    }
+
+    // Dynamic disks end with a copy of the footer
+    if (fwrite(footer, 1, sizeof(footer), file) != sizeof(footer))
+    {
+        return -3;
+    }
+
+    return 0;
+}
+
+
+/**
+ * VDI HEADER
+ *   The pre-header followed by the version 1.1 header.
+ */
+namespace VDI
+{
+    typedef Field<0, 64>                        Info;
+    typedef Field<Info::end, 4>                 Signature;
+    typedef Field<Signature::end, 4>            Version;
+    typedef Field<Version::end, 4>              HeaderSize;
+    typedef Field<HeaderSize::end, 4>           Type;
+    typedef Field<Type::end, 4>                 Flags;
+    typedef Field<Flags::end, 256>              Comment;
+    typedef Field<Comment::end, 4>              OffsetBlocks;
+    typedef Field<OffsetBlocks::end, 4>         OffsetData;
+    typedef Field<OffsetData::end, 4>           Cylinders;
+    typedef Field<Cylinders::end, 4>            Heads;
+    typedef Field<Heads::end, 4>                Sectors;
+    typedef Field<Sectors::end, 4>              SectorSize;
+    typedef Field<SectorSize::end, 4>           Unused;
+    typedef Field<Unused::end, 4>               DiskSizeLow;
+    typedef Field<DiskSizeLow::end, 4>          DiskSizeHigh;
+    typedef Field<DiskSizeHigh::end, 4>         BlockSize;
+    typedef Field<BlockSize::end, 4>            BlockExtra;
+    typedef Field<BlockExtra::end, 4>           Blocks;
+    typedef Field<Blocks::end, 4>               BlocksAllocated;
+    typedef Field<BlocksAllocated::end, 16>     UuidCreate;
+    typedef Field<UuidCreate::end, 16>          UuidModify;
+    typedef Field<UuidModify::end, 16>          UuidLinkage;
+    typedef Field<UuidLinkage::end, 16>         UuidParentModify;
+    typedef Field<UuidParentModify::end, 4>     LogicalCylinders;
+    typedef Field<LogicalCylinders::end, 4>     LogicalHeads;
+    typedef Field<LogicalHeads::end, 4>         LogicalSectors;
+    typedef Field<LogicalSectors::end, 4>       LogicalSectorSize;
+
+    constexpr size_t SIZE = LogicalSectorSize::end;
+    constexpr size_t HEADER_SIZE = SIZE - HeaderSize::offset;
+}
+
+static_assert(VDI::HEADER_SIZE == 400, "VDI: header size");
+
+
+/**
+ * Writes the image as a dynamic VDI.
+ * @param file The output stream.
+ * @param image The image data.
+ * @param size The size of the image; a multiple of the sector size.
+ * @param used One flag per sector indicating it holds data.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int VDI_write(FILE *file, const uint8_t *image, size_t size, const std::vector<bool> &used)
+{
+    const size_t sectorsPerBlock = VDI_BLOCK_SIZE / VDISK_SECTOR_SIZE;
+    size_t blocks = (size + VDI_BLOCK_SIZE - 1) / VDI_BLOCK_SIZE;
+    size_t mapOffset = (VDI::SIZE + VDISK_SECTOR_SIZE - 1) & ~static_cast<size_t>(VDISK_SECTOR_SIZE - 1);
+    size_t dataOffset = (mapOffset + (blocks * 4) + VDISK_SECTOR_SIZE - 1) & ~static_cast<size_t>(VDISK_SECTOR_SIZE - 1);
+    std::vector<uint8_t> header(mapOffset, 0);
+    std::vector<uint8_t> map(dataOffset - mapOffset, 0);
+    uint32_t allocated = 0;
+
+    for (size_t b = 0; b < blocks; b++)
+    {
+        bool any = VDISK_anyUsed(used, b * sectorsPerBlock, sectorsPerBlock);
+        LE_store32(map.data() + (b * 4), any ? allocated++ : VDI_BLOCK_FREE);
+    }
+
+    uint8_t *h = header.data();
+    setBytes<VDI::Info>(h, VDI_INFO "\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0");
+    setField<VDI::Signature>(h, VDI_SIGNATURE);
+    setField<VDI::Version>(h, VDI_VERSION);
+    setField<VDI::HeaderSize>(h, VDI::HEADER_SIZE);
+    setField<VDI::Type>(h, 1);                          // Normal, dynamically allocated
+    setField<VDI::OffsetBlocks>(h, static_cast<uint32_t>(mapOffset));
+    setField<VDI::OffsetData>(h, static_cast<uint32_t>(dataOffset));
+    setField<VDI::SectorSize>(h, VDISK_SECTOR_SIZE);
+    setField<VDI::DiskSizeLow>(h, static_cast<uint32_t>(size));
+    setField<VDI::DiskSizeHigh>(h, static_cast<uint32_t>(static_cast<uint64_t>(size) >> 32));
+    setField<VDI::BlockSize>(h, VDI_BLOCK_SIZE);
+    setField<VDI::Blocks>(h, static_cast<uint32_t>(blocks));
+    setField<VDI::BlocksAllocated>(h, allocated);
+    setField<VDI::LogicalSectorSize>(h, VDISK_SECTOR_SIZE);
+    VDISK_uuid(image, size, h + VDI::UuidCreate::offset);
+    memcpy(h + VDI::UuidModify::offset, h + VDI::UuidCreate::offset, 16);
+    h[VDI::UuidModify::offset + 15] ^= 0x5A;
+
+    if (fwrite(header.data(), 1, header.size(), file) != header.size() ||
+        fwrite(map.data(), 1, map.size(), file) != map.size())
+    {
+        return -1;
+    }
+
+    for (size_t b = 0; b < blocks; b++)
+    {
+        size_t offset = b * VDI_BLOCK_SIZE;
+        size_t n = ((size - offset) < VDI_BLOCK_SIZE) ? (size - offset) : VDI_BLOCK_SIZE;
+
+        if (VDISK_anyUsed(used, b * sectorsPerBlock, sectorsPerBlock) &&
+            VDISK_writePadded(file, image + offset, n, VDI_BLOCK_SIZE))
+        {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+#endif //VDISK_HPP
@@ -0,0 +1,326 @@
+/**
+ * VOLUME
+ *   Read-only access to a FAT12 volume held in memory. The geometry is taken
+ *   from the boot sector, and every file and directory reachable from the
+ *   root is collected together with its cluster chain. Used by the commands
+ *   that inspect, verify, compare and extract images.
+ *
+ * REMARKS
+ *   An image without a valid boot sector, such as one built without -b, is
+ *   taken to be a 1.44 MB floppy. Chains are followed defensively: a chain
+ *   that leaves the volume, runs into a free or bad cluster or loops is cut
+ *   off and reported instead of being followed.
+ */
+#ifndef VOLUME_HPP
+#define VOLUME_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "layout.hpp"
+
+#define VOLUME_MAX_DEPTH        32      // Deepest directory that is followed
+#define VOLUME_CHAIN_OK         0       // The chain ends properly
+#define VOLUME_CHAIN_RANGE      1       // The chain leaves the volume
+#define VOLUME_CHAIN_FREE       2       // The chain runs into a free cluster
+#define VOLUME_CHAIN_BAD        3       // The chain runs into a bad cluster
+#define VOLUME_CHAIN_LOOP       4       // The chain refers back to itself
+
+
+/**
+ * An opened volume.
+ */
+typedef struct
+{
+    const uint8_t  *image;              /* The image data */
+    size_t          size;               /* The size of the image in bytes */
+    BPB_t           bpb;                /* The boot sector, or the assumed one */
+    size_t          clusterSize;        /* The size of a cluster in bytes */
+    size_t          fatOffset;          /* The offset of the first FAT */
+    size_t          fatSize;            /* The size of a single FAT in bytes */
+    size_t          rootOffset;         /* The offset of the root directory */
+    size_t          dataOffset;         /* The offset of cluster 2 */
+    int             clusters;           /* The number of data clusters */
+} Volume_t;
+
+
+/**
+ * A file or directory found on a volume.
+ */
+struct VolumeEntry_t
+{
+    std::string             path;       /* The path from the root, e.g. SUBDIR\FILE.TXT */
+    DirEntry_t              entry;      /* The directory entry */
+    int                     depth;      /* Zero for the entries of the root */
+    std::vector<uint16_t>   chain;      /* The clusters of the entry, in order */
+    int                     status;     /* How the chain ended; VOLUME_CHAIN_* */
+};
+
+
+/**
+ * Opens a volume.
+ * @param volume The volume to initialize.
+ * @param image The image data.
+ * @param size The size of the image in bytes.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+inline int VOLUME_open(Volume_t *volume, const uint8_t *image, size_t size)
+{
+    BPB_t *bpb = &volume->bpb;
+
+    if (size < 512)
+    {
+        return -1;
+    }
+
+    volume->image = image;
+    volume->size = size;
+    BPB_decode(image, bpb);
+
+    if (bpb->bytesPerSector == 0 || bpb->sectorsPerCluster == 0 || bpb->numberOfFats == 0)
+    {
+        memset(bpb, 0, sizeof(BPB_t));
+        bpb->bytesPerSector = 512;
+        bpb->sectorsPerCluster = 1;
+        bpb->reservedSectors = 1;
+        bpb->numberOfFats = 2;
+        bpb->maxRootEntries = 224;
+        bpb->smallSectors = 2880;
+        bpb->mediaDescriptor = 0xF0;
+        bpb->sectorsPerFat = 9;
+        bpb->sectorsPerTrack = 18;
+        bpb->numberOfHeads = 2;
+    }
+
+    size_t sector = bpb->bytesPerSector;
+    size_t sectors = bpb->smallSectors ? bpb->smallSectors : bpb->largeSectors;
+    size_t rootSectors = ((bpb->maxRootEntries * DIR::SIZE) + sector - 1) / sector;
+
+    volume->clusterSize = sector * bpb->sectorsPerCluster;
+    volume->fatOffset = bpb->reservedSectors * sector;
+    volume->fatSize = bpb->sectorsPerFat * sector;
+    volume->rootOffset = volume->fatOffset + (bpb->numberOfFats * volume->fatSize);
+    volume->dataOffset = volume->rootOffset + (rootSectors * sector);
+
+    if (sectors * sector > size || volume->dataOffset > sectors * sector)
+    {
+        return -2;
+    }
+
+    volume->clusters = static_cast<int>(((sectors * sector) - volume->dataOffset) / volume->clusterSize);
+
+    // The FAT has to be able to describe every cluster
+    if ((static_cast<size_t>(volume->clusters) + 2) * 3 / 2 > volume->fatSize)
+    {
+        volume->clusters = static_cast<int>((volume->fatSize * 2 / 3) - 2);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Gets the value of a cluster in the given FAT.
+ */
+inline int VOLUME_getEntry(const Volume_t *volume, int cluster, int fat = 0)
+{
+    return FAT12_getEntry(volume->image + volume->fatOffset + (fat * volume->fatSize), cluster);
+}
+
+
+/**
+ * Gets the data of a cluster.
+ */
+inline const uint8_t * VOLUME_cluster(const Volume_t *volume, int cluster)
+{
+    return volume->image + volume->dataOffset + ((cluster - 2) * volume->clusterSize);
+}
+
+
+/**
+ * Follows a cluster chain.
+ * @param volume The opened volume.
+ * @param first The first cluster; zero for an empty chain.
+ * @param chain Receives the clusters of the chain.
+ * @return How the chain ended; one of VOLUME_CHAIN_*.
+ */
+inline int VOLUME_chain(const Volume_t *volume, int first, std::vector<uint16_t> &chain)
+{
+    std::vector<bool> seen(volume->clusters + 2, false);
+
+    chain.clear();
+
+    for (int cluster = first; cluster != 0; )
+    {
+        if (cluster < 2 || cluster >= volume->clusters + 2)
+        {
+            return VOLUME_CHAIN_RANGE;
+        }
+
+        if (seen[cluster])
+        {
+            return VOLUME_CHAIN_LOOP;
+        }
+
+        seen[cluster] = true;
+        chain.push_back(static_cast<uint16_t>(cluster));
+
+        int next = VOLUME_getEntry(volume, cluster);
+        if (next >= 0xFF8)
+        {
+            break;
+        }
+
+        if (next == 0x000)  return VOLUME_CHAIN_FREE;
+        if (next == 0xFF7)  return VOLUME_CHAIN_BAD;
+
+        cluster = next;
+    }
+
+    return VOLUME_CHAIN_OK;
+}
+
+
+/**
+ * Gets the 8.3 name of an entry as NAME.EXT, without padding.
+ */
+inline std::string VOLUME_name(const DirEntry_t *entry)
+{
+    std::string name(entry->name, 8);
+    std::string ext(entry->extension, 3);
+
+    name.erase(name.find_last_not_of(' ') + 1);
+    ext.erase(ext.find_last_not_of(' ') + 1);
+
+    if (!name.empty() && static_cast<uint8_t>(name[0]) == 0x05)
+    {
+        name[0] = static_cast<char>(0xE5);
+    }
+
+    return ext.empty() ? name : (name + "." + ext);
+}
+
+
+/**
+ * Collects the entries of a directory and, recursively, of its subdirectories.
+ */
+inline void VOLUME_walkDir(const Volume_t *volume, const std::vector<uint8_t> &dir,
+    const std::string &prefix, int depth, std::vector<VolumeEntry_t> &entries)
+{
+    for (size_t offset = 0; offset + DIR::SIZE <= dir.size(); offset += DIR::SIZE)
+    {
+        const uint8_t *raw = dir.data() + offset;
+        VolumeEntry_t found;
+
+        // The remainder of the directory is unused
+        if (raw[0] == 0x00)
+        {
+            break;
+        }
+
+        // Skip erased, long name, volume label and special entries
+        if (raw[0] == 0xE5 || raw[0] == 0x2E ||
+            (raw[11] & 0x3F) == 0x0F || (raw[11] & 0x08))
+        {
+            continue;
+        }
+
+        DIR_decode(raw, &found.entry);
+        found.path = prefix + VOLUME_name(&found.entry);
+        found.depth = depth;
+        found.status = VOLUME_chain(volume, found.entry.firstCluster, found.chain);
+        entries.push_back(found);
+
+        if ((found.entry.attributes & 0x10) && depth < VOLUME_MAX_DEPTH)
+        {
+            std::vector<uint8_t> sub;
+            std::vector<uint16_t> chain = found.chain;
+
+            for (size_t i = 0; i < chain.size(); i++)
+            {
+                const uint8_t *data = VOLUME_cluster(volume, chain[i]);
+                sub.insert(sub.end(), data, data + volume->clusterSize);
+            }
+
+            VOLUME_walkDir(volume, sub, found.path + "\\", depth + 1, entries);
+        }
+    }
+}
+
+
+/**
+ * Collects every file and directory reachable from the root, parents first.
+ * @param volume The opened volume.
+ * @param entries Receives the entries.
+ */
+inline void VOLUME_walk(const Volume_t *volume, std::vector<VolumeEntry_t> &entries)
+{
+    const uint8_t *root = volume->image + volume->rootOffset;
+    std::vector<uint8_t> dir(root, root + (volume->bpb.maxRootEntries * DIR::SIZE));
+
+    entries.clear();
+    VOLUME_walkDir(volume, dir, "", 0, entries);
+}
+
+
+/**
+ * Reads the contents of a file; at most the size recorded in its entry.
+ * @param volume The opened volume.
+ * @param entry The entry of the file.
+ * @param data Receives the contents.
+ */
+inline void VOLUME_read(const Volume_t *volume, const VolumeEntry_t *entry, std::vector<uint8_t> &data)
+{
+    size_t remaining = entry->entry.fileSize;
+
+    data.clear();
+
+    for (size_t i = 0; i < entry->chain.size() && remaining > 0; i++)
+    {
+        size_t n = (remaining < volume->clusterSize) ? remaining : volume->clusterSize;
+        const uint8_t *cluster = VOLUME_cluster(volume, entry->chain[i]);
+
+        data.insert(data.end(), cluster, cluster + n);
+        remaining -= n;
+    }
+}
+
+
+/**
+ * Finds an entry by path; the comparison ignores case and accepts both
+ * kinds of separators.
+ * @return The entry, or nullptr if there is none.
+ */
+inline const VolumeEntry_t * VOLUME_find(const std::vector<VolumeEntry_t> &entries, const char *path)
+{
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const std::string &name = entries[i].path;
+        size_t j = 0;
+
+        for (; j < name.size() && path[j]; j++)
+        {
+            char a = (path[j] == '/') ? '\\' : path[j];
+            char b = name[j];
+
+            if (a >= 'a' && a <= 'z') a = static_cast<char>(a - 'a' + 'A');
+            if (b >= 'a' && b <= 'z') b = static_cast<char>(b - 'a' + 'A');
+
+            if (a != b)
+            {
+                break;
+            }
+        }
+
+        if (j == name.size() && path[j] == '\0')
+        {
+            return &entries[i];
+        }
+    }
+
+    return nullptr;
+}
+
+#endif //VOLUME_HPP
@@ -2,6 +2,8 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstring>
+#include <string>
+#include <vector>
 #include "fat12.hpp"
 #include "io.hpp"
 
@@ -40,19 +42,12 @@ const char DATA[] = {
 
 #define STR_OFFSET      12
 #define BUFFER_SIZE     512
-char        g_buffer[BUFFER_SIZE];
-uint8_t     g_u8;
-uint16_t    g_u16;
-uint32_t    g_u32;
-uint64_t    g_u64;
+uint8_t     g_buffer[BUFFER_SIZE];
 
-#define READ_SIZE(count, fmt) \
-    memset(g_buffer, 0, BUFFER_SIZE); \
-    if (count != fread(g_buffer, 1, count, stream)) return -1; printf("%*.*s "fmt"\n", STR_OFFSET, count, g_buffer)
-
-#define READ_BYTE(fmt)  if (readBYTE(stream, &g_u8)) return -1; printf("%*hhu "fmt"\n", STR_OFFSET, g_u8)
-#define READ_WORD(fmt)  if (readWORD(stream, &g_u16)) return -1; printf("%*hu "fmt"\n", STR_OFFSET, g_u16)
-#define READ_DWORD(fmt) if (readDWORD(stream, &g_u32)) return -1; printf("%*u "fmt"\n", STR_OFFSET, g_u32)
+#define PRINT_SIZE(value, fmt)  printf("%*.*s "fmt"\n", STR_OFFSET, (int)sizeof(value), value)
+#define PRINT_BYTE(value, fmt)  printf("%*hhu "fmt"\n", STR_OFFSET, value)
+#define PRINT_WORD(value, fmt)  printf("%*hu "fmt"\n", STR_OFFSET, value)
+#define PRINT_DWORD(value, fmt) printf("%*u "fmt"\n", STR_OFFSET, value)
 
 /** String function declarations */
 #define ATTRIB_BUFF_SIZE    1024
@@ -60,36 +55,102 @@ char g_attributes[ATTRIB_BUFF_SIZE];
 const char* getType(uint16_t type);
 const char* getAttributes(uint8_t attribs);
 
+
+/**
+ * Geometry of the volume as described by the BPB.
+ */
+typedef struct
+{
+    BPB_t       bpb;
+
+    // Derived values
+    int         firstFatSector;
+    int         firstRootSector;
+    int         firstDataSector;
+    int         bytesPerCluster;
+    int         numberOfClusters;   // Including the two reserved entries
+} FATGeometry_t;
+
+int FAT_Geometry(FILE *stream, FATGeometry_t *geo)
+{
+    const BPB_t *bpb = &geo->bpb;
+
+    // The BPB is decoded from the boot sector in one go
+    fseek(stream, 0, SEEK_SET);
+    if (BUFFER_SIZE != fread(g_buffer, 1, BUFFER_SIZE, stream))
+    {
+        return -1;
+    }
+
+    BPB_decode(g_buffer, &geo->bpb);
+
+    // Refuse geometries that would lead to divisions by zero
+    if (!bpb->bytesPerSector || !bpb->sectorsPerCluster ||
+        !bpb->sectorsPerTrack || !bpb->numberOfHeads)
+    {
+        return -2;
+    }
+
+    int rootSectors = ((bpb->maxRootEntries * DIR::SIZE) + (bpb->bytesPerSector - 1)) / bpb->bytesPerSector;
+
+    geo->firstFatSector = bpb->reservedSectors;
+    geo->firstRootSector = geo->firstFatSector + (bpb->numberOfFats * bpb->sectorsPerFat);
+    geo->firstDataSector = geo->firstRootSector + rootSectors;
+    geo->bytesPerCluster = bpb->bytesPerSector * bpb->sectorsPerCluster;
+
+    // Refuse volumes without a data area, like those using the large sector count
+    if (bpb->smallSectors <= geo->firstDataSector)
+    {
+        return -3;
+    }
+
+    geo->numberOfClusters = 2 + ((bpb->smallSectors - geo->firstDataSector) / bpb->sectorsPerCluster);
+
+    // FAT12 can never address more than 0xFF0 clusters
+    if (geo->numberOfClusters > 0xFF0)
+    {
+        geo->numberOfClusters = 0xFF0;
+    }
+
+    return 0;
+}
+
 int FAT_Info(FILE *stream)
 {
-    // JMP instruction
-    fseek(stream, 3, SEEK_SET);
+    FATGeometry_t geo;
+
+    if (FAT_Geometry(stream, &geo) == -1)
+    {
+        return -1;
+    }
+
+    const BPB_t *bpb = &geo.bpb;
 
     // BPB
-    READ_SIZE(8, "OEM ID");
-    READ_WORD("Byters per sector");
-    READ_BYTE("Sectors clusters");
-    READ_WORD("Reserved clusters");
-    READ_BYTE("FAT tables");
-    READ_WORD("Maximum number of root directories");
-    READ_WORD("Total sector count (FAT16 and older)");
-    READ_BYTE("Device Type");
-    READ_WORD("Sectors per FAT");
-    READ_WORD("Sectors per track");
-    READ_WORD("Number of heads");
-    READ_DWORD("Number of hidden sectors");
-    READ_DWORD("Total sector count (FAT32 and newer)");
+    PRINT_SIZE(bpb->oemId, "OEM ID");
+    PRINT_WORD(bpb->bytesPerSector, "Byters per sector");
+    PRINT_BYTE(bpb->sectorsPerCluster, "Sectors clusters");
+    PRINT_WORD(bpb->reservedSectors, "Reserved clusters");
+    PRINT_BYTE(bpb->numberOfFats, "FAT tables");
+    PRINT_WORD(bpb->maxRootEntries, "Maximum number of root directories");
+    PRINT_WORD(bpb->smallSectors, "Total sector count (FAT16 and older)");
+    PRINT_BYTE(bpb->mediaDescriptor, "Device Type");
+    PRINT_WORD(bpb->sectorsPerFat, "Sectors per FAT");
+    PRINT_WORD(bpb->sectorsPerTrack, "Sectors per track");
+    PRINT_WORD(bpb->numberOfHeads, "Number of heads");
+    PRINT_DWORD(bpb->hiddenSectors, "Number of hidden sectors");
+    PRINT_DWORD(bpb->largeSectors, "Total sector count (FAT32 and newer)");
 
     // Extended BPB
-    READ_BYTE("Physical drive number");
-    READ_BYTE("Reserved");
-    READ_BYTE("Boot signature");
+    PRINT_BYTE(bpb->driveNo, "Physical drive number");
+    PRINT_BYTE(bpb->reserved, "Reserved");
+    PRINT_BYTE(bpb->bootSignature, "Boot signature");
 
-    if (g_u8 == 0x29)
+    if (bpb->bootSignature == 0x29)
     {
-        READ_DWORD("Volume id");
-        READ_SIZE(11, "Volume label");
-        READ_SIZE(8, "File system");
+        PRINT_DWORD(bpb->volumeId, "Volume id");
+        PRINT_SIZE(bpb->volumeLabel, "Volume label");
+        PRINT_SIZE(bpb->fileSystemType, "File system");
     }
 
     return 0;
@@ -97,48 +158,33 @@ int FAT_Info(FILE *stream)
 
 int FAT_Table(FILE *stream)
 {
-    uint8_t     buffer[3];  // Entries appear per 3
-    uint16_t    value[2];   // We need 16-bits to hold the result
-
-    uint16_t bytes_per_sector;
-    uint16_t sectors_per_fat;
-    uint8_t number_of_fats;
-    
-    fseek(stream, 11, SEEK_SET);
-    readWORD(stream, &bytes_per_sector);
+    FATGeometry_t geo;
 
-    fseek(stream, 16, SEEK_SET);
-    readBYTE(stream, & number_of_fats);
-
-    fseek(stream, 22, SEEK_SET);
-    readWORD(stream, &sectors_per_fat);
+    if (FAT_Geometry(stream, &geo))
+    {
+        return -1;
+    }
 
-    int length = (bytes_per_sector * sectors_per_fat) / 3;
+    size_t size = (geo.bpb.bytesPerSector * geo.bpb.sectorsPerFat);
+    std::vector<uint8_t> table(size + 1);   // Odd sizes read one byte past the end
+    int length = static_cast<int>((size * 2) / 3);
 
-    for (int y = 0; y < number_of_fats; y++)
+    for (int y = 0; y < geo.bpb.numberOfFats; y++)
     {
         printf("\nFAT_TABLE (%i)\n", y);
 
-        int offset = 512 + ((bytes_per_sector * sectors_per_fat) * y);
-
-        // Set the stream to the first table
-        fseek(stream, offset, SEEK_SET);
+        // Load the entire table at once
+        fseek(stream, (geo.firstFatSector * geo.bpb.bytesPerSector) + (size * y), SEEK_SET);
+        if (size != fread(table.data(), 1, size, stream))
+        {
+            return -1;
+        }
 
-        // NOTE: This should suffice for testing only
         for (int i = 0; i < length; i++)
         {
-            // We do need three bytes for every two entries
-            if (3 != fread(buffer, 1, 3, stream))
-            {
-                return -1;
-            }
-
-            value[0] = ((buffer[1] & 0x0F) << 8) | buffer[0];
-            value[1] = (buffer[2] << 4) | ((buffer[1] & 0xF0) >> 4);
-
-            printf("  0x%03hX 0x%03hX", value[0], value[1]);
+            printf("  0x%03hX", FAT12_getEntry(table.data(), i));
 
-            if ((i%8) == 7)
+            if ((i%16) == 15)
             {
                 printf("\n");
             }
@@ -150,22 +196,25 @@ int FAT_Table(FILE *stream)
 
 int FAT_Dir(FILE *stream)
 {
-    char dir[32];
+    uint8_t dir[DIR::SIZE];
+    DirEntry_t entry;
 
-    if (32 != fread(dir, 1, 32, stream))
+    if (DIR::SIZE != fread(dir, 1, DIR::SIZE, stream))
     {
         printf("FAILED\n");
         return -1;
     }
 
+    DIR_decode(dir, &entry);
+
     // Special characters...
-    if (dir[0] == (char)0xE5) return 0; // Erased file
-    if (dir[0] == (char)0x2E) return 0; // . or .. (special entry)
-    if (dir[0] == (char)0x05) dir[0] = (char)0xE5; // Actual character is 0xE5
-    if (dir[0] == (char)0x00) return 0; // Entry is available and no subsequent entry is in use
+    if (entry.name[0] == (char)0xE5) return 0; // Erased file
+    if (entry.name[0] == (char)0x2E) return 0; // . or .. (special entry)
+    if (entry.name[0] == (char)0x05) entry.name[0] = (char)0xE5; // Actual character is 0xE5
+    if (entry.name[0] == (char)0x00) return 0; // Entry is available and no subsequent entry is in use
 
     // Special cases can be skipped
-    if (dir[11] == FAT_ATTRIB_LONGNAME)
+    if (entry.attributes == FAT_ATTRIB_LONGNAME)
     {
         // VFAT
         return 0;
@@ -173,8 +222,8 @@ int FAT_Dir(FILE *stream)
 
     // Here we split the attributes into two groups, these allows us to
     // easier sort through it all.
-    uint8_t major = (dir[11] & (FAT_ATTRIB_VOLUME_LABEL | FAT_ATTRIB_SUBDIRECTORY | FAT_ATTRIB_ARCHIVE));
-    uint8_t minor = (dir[11] & (FAT_ATTRIB_READ_ONLY | FAT_ATTRIB_HIDDEN | FAT_ATTRIB_SYSTEM));
+    uint8_t major = (entry.attributes & (FAT_ATTRIB_VOLUME_LABEL | FAT_ATTRIB_SUBDIRECTORY | FAT_ATTRIB_ARCHIVE));
+    uint8_t minor = (entry.attributes & (FAT_ATTRIB_READ_ONLY | FAT_ATTRIB_HIDDEN | FAT_ATTRIB_SYSTEM));
 
     if (major != FAT_ATTRIB_VOLUME_LABEL &&
         major != FAT_ATTRIB_SUBDIRECTORY &&
@@ -184,59 +233,27 @@ int FAT_Dir(FILE *stream)
         return 0;
     }
     printf("%-16s", getAttributes(major));
-    printf("\n\t%-16.8s%.3s", dir, dir+8);
-    printf("\n\tLogical sector: %hu", *((short*)(dir + 26)));
+    printf("\n\t%-16.8s%.3s", entry.name, entry.extension);
+    printf("\n\tLogical sector: %hu", entry.firstCluster);
+    printf("\n\tFile size: %u", entry.fileSize);
     printf("\n\n");
 
-//    READ_SIZE(8, "Filename");           //+8 = 8
-//    
-//    char *state = "valid";
-//    if (g_buffer[0] == (char)0xE5)
-//        state = "erased";
-//
-//    printf("\t%s (%hhu)\n", state, g_buffer[0]);
-//    READ_SIZE(3, "Extension");          //+3 = 11
-//    READ_BYTE("Attributes");            //+1 = 12
-//    printf("\t%s\n", getAttributes(g_u8));
-//    READ_BYTE("Reserved");              //+1 = 14
-//    READ_BYTE("Creation->Time[0]");     //+1 = 15
-//    READ_WORD("Creation->Time[1]");     //+2 = 16
-//    READ_WORD("Creation->Date");        //+2 = 18
-//    READ_WORD("LastAccess->Date");      //+2 = 20
-//    READ_WORD("Ignore for FAT12");      //+2 = 22
-//    READ_WORD("LastWrite->Time");       //+2 = 24
-//    READ_WORD("LastWrite->Date");       //+2 = 26
-//    READ_WORD("FirstLogicalSector");    //+2 = 28
-//    READ_DWORD("FileSize");             //+4 = 32
-//    printf("\n");
-
     return 0;
 }
 
 int FAT_Root(FILE *stream)
 {
-    uint16_t bytes_per_sector;
-    uint16_t sectors_per_fat;
-    uint8_t number_of_fats;
-    uint16_t maximum_root_directories;
-    
-    fseek(stream, 11, SEEK_SET);
-    readWORD(stream, &bytes_per_sector);
+    FATGeometry_t geo;
 
-    fseek(stream, 16, SEEK_SET);
-    readBYTE(stream, & number_of_fats);
-
-    fseek(stream, 17, SEEK_SET);
-    readWORD(stream, &maximum_root_directories);
-
-    fseek(stream, 22, SEEK_SET);
-    readWORD(stream, &sectors_per_fat);
+    if (FAT_Geometry(stream, &geo))
+    {
+        return -1;
+    }
 
-    int length = 512 + (bytes_per_sector * number_of_fats * sectors_per_fat);
-    fseek(stream, length, SEEK_SET);
+    fseek(stream, geo.firstRootSector * geo.bpb.bytesPerSector, SEEK_SET);
 
     printf("\n");
-    for (int i = 0; i < maximum_root_directories; i++)
+    for (int i = 0; i < geo.bpb.maxRootEntries; i++)
     {
         int result = FAT_Dir(stream);
         if (result)
@@ -250,27 +267,15 @@ int FAT_Root(FILE *stream)
 
 int FAT_Data(FILE *stream)
 {
-    uint16_t bytes_per_sector;
-    uint16_t sectors_per_fat;
-    uint8_t number_of_fats;
-    uint16_t maximum_root_directories;
-    
-    fseek(stream, 11, SEEK_SET);
-    readWORD(stream, &bytes_per_sector);
-
-    fseek(stream, 16, SEEK_SET);
-    readBYTE(stream, &number_of_fats);
+    FATGeometry_t geo;
 
-    fseek(stream, 17, SEEK_SET);
-    readWORD(stream, &maximum_root_directories);
-
-    fseek(stream, 22, SEEK_SET);
-    readWORD(stream, &sectors_per_fat);
+    if (FAT_Geometry(stream, &geo))
+    {
+        return -1;
+    }
 
     // Set the position 
-    int length = 512 + (bytes_per_sector * number_of_fats * sectors_per_fat) +
-        (maximum_root_directories * 32);
-    fseek(stream, length, SEEK_SET);
+    fseek(stream, geo.firstDataSector * geo.bpb.bytesPerSector, SEEK_SET);
 
     // Test the data
     char buffer[512];
@@ -291,74 +296,403 @@ int FAT_Data(FILE *stream)
     return 0;
 }
 
-int FAT_Sub(FILE *stream)
+/**
+ * CLUSTER OWNERSHIP
+ *   Every data cluster is mapped onto the directory entry that owns it. The map
+ *   is build during a single walk of the directory tree, starting at the root.
+ */
+#define OWNER_FREE      (-1)    // Not referenced and not in use
+#define OWNER_ORPHAN    (-2)    // In use according to the FAT, but not referenced
+#define OWNER_BAD       (-3)    // Marked as a bad cluster
+
+typedef struct
+{
+    std::string             path;
+    uint8_t                 attributes;
+    uint32_t                fileSize;
+    std::vector<uint16_t>   chain;          // All the clusters in order
+    int                     numExtents;     // Runs of consecutive clusters
+    int                     numTracks;      // Number of track changes while reading
+    bool                    crossLinked;
+} FATOwner_t;
+
+typedef struct
 {
-    // NOTE: This is the sub-directory's logical value
-    const int SUB_DIR_LOGICAL = 6;
+    FILE                    *stream;
+    FATGeometry_t           geo;
+    std::vector<uint8_t>    fat;            // The first FAT table
+    std::vector<int>        owner;          // cluster -> index into owners
+    std::vector<FATOwner_t> owners;
+} FATTree_t;
+
+uint16_t FAT_TreeValue(const FATTree_t *tree, int cluster)
+{
+    if ((((cluster * 3) / 2) + 1) >= static_cast<int>(tree->fat.size()))
+    {
+        return 0xFF7;
+    }
 
-    uint16_t bytes_per_sector;
-    uint16_t sectors_per_fat;
-    uint8_t number_of_fats;
-    uint16_t maximum_root_directories;
-    
-    fseek(stream, 11, SEEK_SET);
-    readWORD(stream, &bytes_per_sector);
+    return FAT12_getEntry(tree->fat.data(), cluster);
+}
 
-    fseek(stream, 16, SEEK_SET);
-    readBYTE(stream, &number_of_fats);
+int FAT_TreeSector(const FATTree_t *tree, int cluster)
+{
+    return tree->geo.firstDataSector + ((cluster - 2) * tree->geo.bpb.sectorsPerCluster);
+}
 
-    fseek(stream, 17, SEEK_SET);
-    readWORD(stream, &maximum_root_directories);
+int FAT_TreeTrack(const FATTree_t *tree, int sector)
+{
+    return sector / tree->geo.bpb.sectorsPerTrack;
+}
 
-    fseek(stream, 22, SEEK_SET);
-    readWORD(stream, &sectors_per_fat);
+/** Claims the chain starting at the first cluster for the owner. */
+void FAT_TreeClaim(FATTree_t *tree, int index, uint16_t cluster)
+{
+    FATOwner_t *o = &tree->owners[index];
+    int previous = -1;
 
-    // The starting position would be...
-    int start = 512
-        + (bytes_per_sector * number_of_fats * sectors_per_fat)
-        + (maximum_root_directories * 32);
+    while (cluster >= 2 && cluster < tree->geo.numberOfClusters)
+    {
+        if (tree->owner[cluster] != OWNER_FREE)
+        {
+            // Either a cross-link or a loop; stop either way
+            o->crossLinked = true;
+            break;
+        }
 
-    // Translate the logical sector to physical sector
-    int offset = (bytes_per_sector * (SUB_DIR_LOGICAL - 2));
+        tree->owner[cluster] = index;
+        o->chain.push_back(cluster);
 
-    // Set the position 
-    int length = start + offset;
-    fseek(stream, length, SEEK_SET);
+        if (cluster != previous + 1)
+        {
+            o->numExtents++;
+        }
 
-#if 0
-    // Load the data
-    char buffer[512];
-    if (512 != fread(buffer, 1, 512, stream))
+        int sector = FAT_TreeSector(tree, cluster);
+        if (previous == -1 || FAT_TreeTrack(tree, sector) != FAT_TreeTrack(tree, FAT_TreeSector(tree, previous)))
+        {
+            o->numTracks++;
+        }
+
+        previous = cluster;
+        cluster = FAT_TreeValue(tree, cluster);
+    }
+}
+
+/** Decodes the characters of a LFN entry; non-ASCII is replaced. Returns false if the order is out of range. */
+bool FAT_TreeLongName(const uint8_t *src, char *lfn, size_t size)
+{
+    LFNEntry_t entry;
+    LFN_decode(src, &entry);
+
+    size_t order = entry.order & 0x1F;
+    if (order < 1 || order > LFN::MAX_ENTRIES)
     {
-        return -1;
+        return false;
+    }
+
+    size_t position = (order - 1) * LFN::CHARACTERS;
+    if (position + LFN::CHARACTERS >= size)
+    {
+        return false;
     }
 
-    // Output the data as hexadecimal characters
-    for (int i = 0; i < 512; i++)
+    for (size_t i = 0; i < LFN::CHARACTERS; i++)
     {
-        printf("%02hhX", buffer[i]);
+        uint16_t ch = entry.name[i];
 
-        if ((i%16) == 15)
+        if (ch == 0x0000 || ch == 0xFFFF)
         {
-            printf("\n");
+            ch = 0;
         }
-        else if ((i%2) == 1)
+        else if (ch > 0x7E)
         {
-            printf(" ");
+            ch = '?';
         }
+
+        lfn[position + i] = static_cast<char>(ch);
     }
-#else
 
-    for (int i = 0; i < (512/32); i++)
+    return true;
+}
+
+int FAT_TreeDir(FATTree_t *tree, const uint8_t *dir, int count, const std::string &parent, int depth)
+{
+    char lfn[LFN::CHARACTERS * LFN::MAX_ENTRIES + 1];
+    uint8_t checksum = 0;
+    bool hasLfn = false;
+
+    memset(lfn, 0, sizeof(lfn));
+
+    // Decode the whole directory at once
+    std::vector<DirEntry_t> entries(count);
+    DIR_decodeAll(dir, count, entries.data());
+
+    for (int i = 0; i < count; i++)
     {
-        int result = FAT_Dir(stream);
+        const DirEntry_t *entry = &entries[i];
+        uint8_t first = static_cast<uint8_t>(entry->name[0]);
+
+        if (first == 0x00) break;                   // No subsequent entries in use
+        if (first == 0xE5) { hasLfn = false; continue; }
+
+        if (entry->attributes == FAT_ATTRIB_LONGNAME)
+        {
+            const uint8_t *raw = (dir + (i * DIR::SIZE));
+
+            // The last LFN entry is stored first and starts a new name
+            if (first & LFN::LAST)
+            {
+                memset(lfn, 0, sizeof(lfn));
+                hasLfn = true;
+                checksum = static_cast<uint8_t>(getField<LFN::Checksum>(raw));
+            }
+
+            // A damaged order drops the whole name; the short name is used instead
+            if (!FAT_TreeLongName(raw, lfn, sizeof(lfn)))
+            {
+                hasLfn = false;
+            }
+            continue;
+        }
+
+        if (first == 0x2E || (entry->attributes & FAT_ATTRIB_VOLUME_LABEL))
+        {
+            hasLfn = false;
+            continue;
+        }
+
+        // Prefer the long name, but only when it belongs to this entry
+        std::string leaf;
+        if (hasLfn && checksum == LFN_checksum(dir + (i * DIR::SIZE)))
+        {
+            leaf = lfn;
+        }
+        else
+        {
+            char name[13];
+            int n = 0;
+            for (int j = 0; j < 8 && entry->name[j] != ' '; j++) name[n++] = entry->name[j];
+            if (entry->extension[0] != ' ') name[n++] = '.';
+            for (int j = 0; j < 3 && entry->extension[j] != ' '; j++) name[n++] = entry->extension[j];
+            name[n] = '\0';
+            if (name[0] == 0x05) name[0] = static_cast<char>(0xE5);
+            leaf = name;
+        }
+
+        FATOwner_t o;
+        o.path = parent + "/" + leaf;
+        o.attributes = entry->attributes;
+        o.fileSize = entry->fileSize;
+        o.numExtents = 0;
+        o.numTracks = 0;
+        o.crossLinked = false;
+        hasLfn = false;
+
+        int index = static_cast<int>(tree->owners.size());
+        tree->owners.push_back(o);
+        FAT_TreeClaim(tree, index, entry->firstCluster);
+
+        if (!(entry->attributes & FAT_ATTRIB_SUBDIRECTORY))
+        {
+            continue;
+        }
+
+        if (depth >= 32)
+        {
+            fprintf(stderr, "WARNING: Directory '%s' is nested too deep.\n", tree->owners[index].path.c_str());
+            continue;
+        }
+
+        // Load the full chain of the sub-directory before descending
+        const std::vector<uint16_t> chain = tree->owners[index].chain;
+        std::vector<uint8_t> data(chain.size() * tree->geo.bytesPerCluster);
+
+        for (size_t c = 0; c < chain.size(); c++)
+        {
+            fseek(tree->stream, FAT_TreeSector(tree, chain[c]) * tree->geo.bpb.bytesPerSector, SEEK_SET);
+
+            if (tree->geo.bytesPerCluster != static_cast<int>(fread(&data[c * tree->geo.bytesPerCluster], 1, tree->geo.bytesPerCluster, tree->stream)))
+            {
+                return -1;
+            }
+        }
+
+        int result = FAT_TreeDir(tree, data.data(), static_cast<int>(data.size() / DIR::SIZE), tree->owners[index].path, depth + 1);
         if (result)
         {
             return result;
         }
     }
 
-#endif
+    return 0;
+}
+
+void FAT_TreeExtents(const FATTree_t *tree)
+{
+    printf("\nFILES\n");
+
+    for (size_t i = 0; i < tree->owners.size(); i++)
+    {
+        const FATOwner_t *o = &tree->owners[i];
+
+        printf("  %-32s %s %7u bytes %4zu clusters %3i extents %3i tracks%s\n    ",
+            o->path.c_str(),
+            (o->attributes & FAT_ATTRIB_SUBDIRECTORY) ? "DIR " : "FILE",
+            o->fileSize, o->chain.size(), o->numExtents, o->numTracks,
+            o->crossLinked ? " CROSS-LINKED" : "");
+
+        // Print the runs of consecutive clusters
+        for (size_t c = 0; c < o->chain.size(); )
+        {
+            size_t e = c;
+            while ((e + 1) < o->chain.size() && o->chain[e + 1] == (o->chain[e] + 1))
+            {
+                e++;
+            }
+
+            if (e == c)
+                printf(" %hu", o->chain[c]);
+            else
+                printf(" %hu-%hu", o->chain[c], o->chain[e]);
+
+            c = e + 1;
+        }
+
+        printf("\n");
+    }
+}
+
+void FAT_TreeHistogram(const FATTree_t *tree)
+{
+    static const char *LABELS[] = { "empty", "1", "2", "3", "4-7", "8-15", "16+" };
+    int buckets[7] = { 0 };
+    int orphans = 0, used = 0;
+
+    for (size_t i = 0; i < tree->owners.size(); i++)
+    {
+        int n = tree->owners[i].numExtents;
+        int b = (n < 4) ? n : (n < 8) ? 4 : (n < 16) ? 5 : 6;
+        buckets[b]++;
+    }
+
+    for (int c = 2; c < tree->geo.numberOfClusters; c++)
+    {
+        if (tree->owner[c] >= 0) used++;
+        if (tree->owner[c] == OWNER_ORPHAN) orphans++;
+    }
+
+    printf("\nFRAGMENTATION (extents per entry)\n");
+    for (int b = 0; b < 7; b++)
+    {
+        printf("  %-6s %5i ", LABELS[b], buckets[b]);
+        for (int i = 0; i < buckets[b] && i < 64; i++) printf("*");
+        printf("\n");
+    }
+
+    printf("\n  %i of %i clusters in use, %i orphaned\n", used, tree->geo.numberOfClusters - 2, orphans);
+}
+
+void FAT_TreeMap(const FATTree_t *tree)
+{
+    const FATGeometry_t *geo = &tree->geo;
+    int sectorsPerCylinder = geo->bpb.sectorsPerTrack * geo->bpb.numberOfHeads;
+    int cylinders = (geo->bpb.smallSectors + sectorsPerCylinder - 1) / sectorsPerCylinder;
+
+    printf("\nDISK MAP (B=boot F=FAT R=root D=directory #=file .=free ?=orphan X=bad)\n");
+
+    for (int cyl = 0; cyl < cylinders; cyl++)
+    {
+        printf("  %02i", cyl);
+
+        for (int head = 0; head < geo->bpb.numberOfHeads; head++)
+        {
+            printf(" ");
+
+            for (int s = 0; s < geo->bpb.sectorsPerTrack; s++)
+            {
+                int sector = (cyl * sectorsPerCylinder) + (head * geo->bpb.sectorsPerTrack) + s;
+                char ch = ' ';
+
+                if (sector >= geo->bpb.smallSectors)            ch = ' ';
+                else if (sector < geo->firstFatSector)      ch = 'B';
+                else if (sector < geo->firstRootSector)     ch = 'F';
+                else if (sector < geo->firstDataSector)     ch = 'R';
+                else
+                {
+                    int cluster = 2 + ((sector - geo->firstDataSector) / geo->bpb.sectorsPerCluster);
+                    int owner = (cluster < geo->numberOfClusters) ? tree->owner[cluster] : OWNER_FREE;
+
+                    if (owner == OWNER_FREE)        ch = '.';
+                    else if (owner == OWNER_ORPHAN) ch = '?';
+                    else if (owner == OWNER_BAD)    ch = 'X';
+                    else if (tree->owners[owner].attributes & FAT_ATTRIB_SUBDIRECTORY) ch = 'D';
+                    else                            ch = '#';
+                }
+
+                printf("%c", ch);
+            }
+        }
+
+        printf("\n");
+    }
+}
+
+int FAT_Tree(FILE *stream)
+{
+    FATTree_t tree;
+    tree.stream = stream;
+
+    if (FAT_Geometry(stream, &tree.geo))
+    {
+        return -1;
+    }
+
+    // Load the first FAT table
+    tree.fat.resize(tree.geo.bpb.sectorsPerFat * tree.geo.bpb.bytesPerSector);
+    fseek(stream, tree.geo.firstFatSector * tree.geo.bpb.bytesPerSector, SEEK_SET);
+    if (tree.fat.size() != fread(tree.fat.data(), 1, tree.fat.size(), stream))
+    {
+        return -2;
+    }
+
+    // Load the root directory
+    std::vector<uint8_t> root(tree.geo.bpb.maxRootEntries * DIR::SIZE);
+    fseek(stream, tree.geo.firstRootSector * tree.geo.bpb.bytesPerSector, SEEK_SET);
+    if (root.size() != fread(root.data(), 1, root.size(), stream))
+    {
+        return -3;
+    }
+
+    tree.owner.assign(tree.geo.numberOfClusters, OWNER_FREE);
+
+    if (FAT_TreeDir(&tree, root.data(), tree.geo.bpb.maxRootEntries, "", 0))
+    {
+        return -4;
+    }
+
+    // Whatever the FAT uses but the tree did not reach
+    for (int c = 2; c < tree.geo.numberOfClusters; c++)
+    {
+        if (tree.owner[c] != OWNER_FREE)
+        {
+            continue;
+        }
+
+        uint16_t value = FAT_TreeValue(&tree, c);
+        if (value == 0xFF7)
+        {
+            tree.owner[c] = OWNER_BAD;
+        }
+        else if (value != 0x000)
+        {
+            tree.owner[c] = OWNER_ORPHAN;
+        }
+    }
+
+    FAT_TreeExtents(&tree);
+    FAT_TreeHistogram(&tree);
+    FAT_TreeMap(&tree);
 
     return 0;
 }
@@ -413,8 +747,8 @@ int main(int argc, char **argv)
     }
 #endif
 
-    // Read the sub-directory
-    if (FAT_Sub(iFile))
+    // Walk the directory tree
+    if (FAT_Tree(iFile))
     {
         fclose(iFile);
         return 0;
@@ -50,43 +50,11 @@
     (((char)(l)))
 
 
-typedef struct
-{
-    short time;
-    short date;
-} DateTime_t;
-
-/**
- * A traditional FAT entry.
- */
-typedef struct
-{
-    char        filename[8];
-    char        extension[3];
-    uint8_t     attributes;
-    char        reserved[2];
-    DateTime_t  creation;
-    short       lastAccessDate;
-    char        ignored[2];
-    DateTime_t  lastWrite;
-    short       firstLogicalSector;
-    int         fileSize;
-} FATEntry_t;
-
 /**
- * A Long-File-Name (LFN) entry in FAT.
+ * The directory, long-file-name and boot sector layouts are shared by all the
+ * tools and described in the common layout header.
  */
-typedef struct
-{
-    char        index;
-    wchar_t     str0[5];
-    uint8_t     attributes;
-    char        reserved;
-    uint8_t     checksum;
-    wchar_t     str1[6];
-    short       firstLogicalSector;
-    wchar_t     str2[2];
-} LFNEntry_t;
+#include "../common/layout.hpp"
 
 // FAT entry types for next sector
 #define FAT_TYPE_UNUSED             ((unsigned char)(0x000))
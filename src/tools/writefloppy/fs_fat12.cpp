@@ -1,22 +1,413 @@
+#include <cstddef>
 #include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <vector>
 #include "fs_fat12.hpp"
 #include "globals.hpp"
 #include "io.hpp"
+#include "../common/layout.hpp"
+
+#define FAT12_MAX_CLUSTERS      4084    // Above this count the volume is FAT16
+#define FAT12_MAX_FAT_SECTORS   12      // Sectors needed for 4086 entries
+#define FAT12_DIR_ARCHIVE       0x20    // Attribute set on every written file
+#define FAT12_COPY_SECTORS      64      // Sectors moved per read while copying
 
 
 /**
  * The FAT table plays a central role. Therefor it is handy to have it set as
- * global variable instead of using it in the function.
+ * global variable instead of using it in the function. It is sized for the
+ * largest FAT12 table; the image itself is never held in memory.
  */
-unsigned char fat_Table[512 * 9]; // bytes_per_sector * sectors_per_fat
+unsigned char fat_Table[512 * FAT12_MAX_FAT_SECTORS]; // bytes_per_sector * sectors_per_fat
 
 
-/** For a description see the header file. */
-int FAT12_CopyData(FILE *oFile)
+/**
+ * A file as it will be laid out on the volume.
+ */
+struct FAT12Plan_t
+{
+    char *filename;         // The path of the input file
+    DirEntry_t entry;       // The root directory entry of the file
+    size_t clusters;        // The number of clusters the file occupies
+};
+
+
+/** The layout of the whole volume, derived from the bootloader and file sizes. */
+struct FAT12Layout_t
+{
+    BPB_t bpb;
+    size_t bytesPerCluster;
+    size_t totalSectors;
+    size_t fatSectors;      // First sector of the first FAT
+    size_t rootSectors;     // Number of sectors of the root directory
+    size_t dataSectors;     // First sector of the data area
+    size_t clusterCount;    // Number of data clusters on the volume
+    std::vector<FAT12Plan_t> files;
+};
+
+
+void FAT12_TrimFileName(char filename[MAX_PATH]);
+
+
+/** Convert a host filename into a space padded 8.3 name. */
+static int FAT12_ShortName(const char *path, char name[8], char ext[3])
+{
+    char base[MAX_PATH];
+    char suffix[MAX_PATH];
+    const char *start = path;
+    char *dot;
+
+    // Strip the directories from the path
+    for (const char *p = path; *p; p++)
+    {
+        if (*p == '\\' || *p == '/' || *p == ':')
+        {
+            start = p + 1;
+        }
+    }
+
+    strncpy_s(base, MAX_PATH, start, _TRUNCATE);
+
+    // Seperate the extension before trimming, as the dots are dropped
+    suffix[0] = '\0';
+    dot = strrchr(base, '.');
+    if (dot)
+    {
+        strncpy_s(suffix, MAX_PATH, dot + 1, _TRUNCATE);
+        *dot = '\0';
+    }
+
+    FAT12_TrimFileName(base);
+    FAT12_TrimFileName(suffix);
+
+    memset(name, ' ', 8);
+    memcpy(name, base, strnlen(base, 8));
+    memset(ext, ' ', 3);
+    memcpy(ext, suffix, strnlen(suffix, 3));
+
+    return (name[0] == ' ') ? -1 : 0;
+}
+
+
+/** Read the BPB from the bootloader and derive the geometry of the volume. */
+static int FAT12_PlanVolume(FAT12Layout_t *layout, unsigned char bootSector[512])
 {
+    BPB_t *bpb = &layout->bpb;
+    FILE *iFile;
     size_t size;
+    errno_t err;
+
+    err = fopen_s(&iFile, g_bootloader, "rb");
+    if (err)
+    {
+        fprintf(stderr, "I/O ERROR: Could not open bootloader file '%s' for reading.\n", g_bootloader);
+        return -1;
+    }
+
+    memset(bootSector, 0, 512);
+    size = fread(bootSector, 1, 512, iFile);
+    fclose(iFile);
+
+    if (size < BPB::SIZE)
+    {
+        fprintf(stderr, "I/O ERROR: Bootloader '%s' is too small to hold a BPB.\n", g_bootloader);
+        return -2;
+    }
+
+    BPB_decode(bootSector, bpb);
+
+    // Only the geometry this writer (and the kernel) understands is accepted
+    if (bpb->bytesPerSector != 512 || bpb->sectorsPerCluster == 0 ||
+        bpb->reservedSectors == 0 || bpb->numberOfFats == 0 || bpb->maxRootEntries == 0 ||
+        bpb->sectorsPerFat == 0 || bpb->sectorsPerFat > FAT12_MAX_FAT_SECTORS)
+    {
+        fprintf(stderr, "I/O ERROR: Bootloader '%s' does not contain a valid FAT12 BPB.\n", g_bootloader);
+        return -3;
+    }
+
+    layout->bytesPerCluster = bpb->bytesPerSector * bpb->sectorsPerCluster;
+    layout->totalSectors = bpb->smallSectors ? bpb->smallSectors : bpb->largeSectors;
+    layout->fatSectors = bpb->reservedSectors;
+    layout->rootSectors = (bpb->maxRootEntries * DIR::SIZE + 511) / 512;
+    layout->dataSectors = layout->fatSectors + (bpb->numberOfFats * bpb->sectorsPerFat) + layout->rootSectors;
+
+    if (layout->totalSectors <= layout->dataSectors)
+    {
+        fprintf(stderr, "I/O ERROR: The BPB leaves no room for data.\n");
+        return -4;
+    }
+
+    layout->clusterCount = (layout->totalSectors - layout->dataSectors) / bpb->sectorsPerCluster;
+    if (layout->clusterCount > FAT12_MAX_CLUSTERS ||
+        (layout->clusterCount + 2) * 3 / 2 > bpb->sectorsPerFat * 512u)
+    {
+        fprintf(stderr, "I/O ERROR: The BPB does not describe a FAT12 volume.\n");
+        return -5;
+    }
+
+    return 0;
+}
+
+
+/** Assign root entries and contiguous cluster runs to all the queued files. */
+static int FAT12_PlanFiles(FAT12Layout_t *layout)
+{
+    size_t nextCluster = 2;
+    time_t now = time(NULL);
+    struct tm local;
+    uint16_t date, stamp;
+
+    localtime_s(&local, &now);
+    date = static_cast<uint16_t>(((local.tm_year - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday);
+    stamp = static_cast<uint16_t>((local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2));
+
+    while (!g_queue.empty())
+    {
+        FileArg arg = g_queue.front();
+        FAT12Plan_t plan;
+        long int size;
+        FILE *iFile;
+
+        g_queue.pop();
+
+        // Only the size is needed now; the data is read while writing
+        if (fopen_s(&iFile, arg.filename, "rb"))
+        {
+            fprintf(stderr, "I/O Error: Could not open '%s' for reading.\n", arg.filename);
+            return -1;
+        }
+
+        size = fsize(iFile);
+        fclose(iFile);
+
+        if (size < 0)
+        {
+            fprintf(stderr, "I/O ERROR: Incorrect file size of %li\n", size);
+            return -2;
+        }
+
+        memset(&plan.entry, 0, sizeof(plan.entry));
+        if (FAT12_ShortName(arg.filename, plan.entry.name, plan.entry.extension))
+        {
+            fprintf(stderr, "I/O ERROR: '%s' has no valid 8.3 name.\n", arg.filename);
+            return -3;
+        }
+
+        for (size_t i = 0; i < layout->files.size(); i++)
+        {
+            const DirEntry_t &other = layout->files[i].entry;
+            if (!memcmp(other.name, plan.entry.name, 8) && !memcmp(other.extension, plan.entry.extension, 3))
+            {
+                fprintf(stderr, "I/O ERROR: '%s' has the same 8.3 name as '%s'.\n", arg.filename, layout->files[i].filename);
+                return -4;
+            }
+        }
+
+        if (layout->files.size() >= layout->bpb.maxRootEntries)
+        {
+            fprintf(stderr, "I/O ERROR: The root directory can hold no more than %u files.\n", layout->bpb.maxRootEntries);
+            return -5;
+        }
+
+        plan.filename = arg.filename;
+        plan.clusters = (static_cast<size_t>(size) + layout->bytesPerCluster - 1) / layout->bytesPerCluster;
+
+        if (nextCluster - 2 + plan.clusters > layout->clusterCount)
+        {
+            fprintf(stderr, "I/O ERROR: '%s' does not fit on the volume.\n", arg.filename);
+            return -6;
+        }
+
+        plan.entry.attributes = FAT12_DIR_ARCHIVE;
+        if (arg.attributes & ATTRIB_READONLY)   plan.entry.attributes |= 0x01;
+        if (arg.attributes & ATTRIB_HIDDEN)     plan.entry.attributes |= 0x02;
+        if (arg.attributes & ATTRIB_SYSTEM)     plan.entry.attributes |= 0x04;
+
+        plan.entry.creationDate = date;
+        plan.entry.creationTime = stamp;
+        plan.entry.lastAccessDate = date;
+        plan.entry.lastWriteDate = date;
+        plan.entry.lastWriteTime = stamp;
+        plan.entry.firstCluster = static_cast<uint16_t>(plan.clusters ? nextCluster : 0);
+        plan.entry.fileSize = static_cast<uint32_t>(size);
+
+        nextCluster += plan.clusters;
+        layout->files.push_back(plan);
+    }
+
+    return 0;
+}
+
+
+/** Write the given number of zero sectors to the output. */
+static int FAT12_WriteZeros(FILE *oFile, size_t sectors)
+{
+    static const unsigned char zeros[512 * FAT12_COPY_SECTORS] = { 0 };
+
+    while (sectors > 0)
+    {
+        size_t count = (sectors < FAT12_COPY_SECTORS) ? sectors : FAT12_COPY_SECTORS;
+
+        if (fwrite(zeros, 512, count, oFile) != count)
+        {
+            return -1;
+        }
+
+        sectors -= count;
+    }
+
+    return 0;
+}
+
+
+/** Stream the data of a single planned file into its clusters. */
+static int FAT12_WriteFile(FILE *oFile, const FAT12Layout_t *layout, const FAT12Plan_t *plan)
+{
+    static unsigned char buffer[512 * FAT12_COPY_SECTORS];
+    size_t remaining = plan->entry.fileSize;
+    size_t written = 0;
     FILE *iFile;
 
+    if (fopen_s(&iFile, plan->filename, "rb"))
+    {
+        fprintf(stderr, "I/O Error: Could not open '%s' for reading.\n", plan->filename);
+        return -1;
+    }
+
+    while (remaining > 0)
+    {
+        size_t want = (remaining < sizeof(buffer)) ? remaining : sizeof(buffer);
+        size_t read = fread(buffer, 1, want, iFile);
+
+        // The file changed between planning and writing
+        if (read != want)
+        {
+            fprintf(stderr, "I/O ERROR: '%s' is shorter than when it was planned.\n", plan->filename);
+            fclose(iFile);
+            return -2;
+        }
+
+        if (fwrite(buffer, 1, read, oFile) != read)
+        {
+            fclose(iFile);
+            return -3;
+        }
+
+        remaining -= read;
+        written += read;
+    }
+
+    fclose(iFile);
+
+    // Fill the tail of the last cluster
+    size_t slack = plan->clusters * layout->bytesPerCluster - written;
+    if (slack > 0)
+    {
+        memset(buffer, 0, slack);
+        if (fwrite(buffer, 1, slack, oFile) != slack)
+        {
+            return -4;
+        }
+    }
+
+    return 0;
+}
+
+
+/** For a description see the header file. */
+int FAT12_CopyData(FILE *oFile)
+{
+    unsigned char sector[512];
+    unsigned char bootSector[512];
+    FAT12Layout_t layout;
+    size_t fatBytes, index;
+    const BPB_t &bpb = layout.bpb;
+
+    // Plan everything up front, so the image can be written in one pass
+    if (FAT12_PlanVolume(&layout, bootSector))
+    {
+        return 1;
+    }
+
+    if (FAT12_PlanFiles(&layout))
+    {
+        return 2;
+    }
+
+    // Boot sector and the remainder of the reserved area
+    if (fwrite(bootSector, 1, 512, oFile) != 512 ||
+        FAT12_WriteZeros(oFile, bpb.reservedSectors - 1))
+    {
+        fprintf(stderr, "I/O ERROR: Could not write the reserved sectors.\n");
+        return 3;
+    }
+
+    // The FAT follows directly from the contiguous cluster runs
+    fatBytes = bpb.sectorsPerFat * 512u;
+    memset(fat_Table, 0, fatBytes);
+    FAT12_setEntry(fat_Table, 0, static_cast<uint16_t>(0xF00 | bpb.mediaDescriptor));
+    FAT12_setEntry(fat_Table, 1, 0xFFF);
+
+    for (size_t i = 0; i < layout.files.size(); i++)
+    {
+        const FAT12Plan_t &plan = layout.files[i];
+        for (size_t c = 0; c < plan.clusters; c++)
+        {
+            int cluster = plan.entry.firstCluster + static_cast<int>(c);
+            FAT12_setEntry(fat_Table, cluster, static_cast<uint16_t>((c + 1 < plan.clusters) ? (cluster + 1) : 0xFFF));
+        }
+    }
+
+    for (int i = 0; i < bpb.numberOfFats; i++)
+    {
+        if (fwrite(fat_Table, 1, fatBytes, oFile) != fatBytes)
+        {
+            fprintf(stderr, "I/O ERROR: Could not write FAT %i.\n", i);
+            return 4;
+        }
+    }
+
+    // Root directory, one sector at a time
+    index = 0;
+    for (size_t s = 0; s < layout.rootSectors; s++)
+    {
+        memset(sector, 0, 512);
+
+        for (size_t e = 0; e < 512 / DIR::SIZE && index < layout.files.size(); e++, index++)
+        {
+            DIR_encode(&layout.files[index].entry, sector + (e * DIR::SIZE));
+        }
+
+        if (fwrite(sector, 1, 512, oFile) != 512)
+        {
+            fprintf(stderr, "I/O ERROR: Could not write the root directory.\n");
+            return 5;
+        }
+    }
+
+    // File data in cluster order
+    for (size_t i = 0; i < layout.files.size(); i++)
+    {
+        if (FAT12_WriteFile(oFile, &layout, &layout.files[i]))
+        {
+            fprintf(stderr, "I/O ERROR: Could not write '%s'.\n", layout.files[i].filename);
+            return 6;
+        }
+    }
+
+    // Pad the output to the size of the volume
+    size_t used = 0;
+    for (size_t i = 0; i < layout.files.size(); i++)
+    {
+        used += layout.files[i].clusters * bpb.sectorsPerCluster;
+    }
+
+    if (FAT12_WriteZeros(oFile, layout.totalSectors - layout.dataSectors - used))
+    {
+        fprintf(stderr, "I/O ERROR: Could not pad the output.\n");
+        return 7;
+    }
 
     return 0;
 }
@@ -5,7 +5,9 @@
 
 /**
  * Copies the data from the input files in the given order into the output file.
- * It uses the FAT12 filesystem in the outputed file.
+ * It uses the FAT12 filesystem in the outputed file. The geometry is taken from
+ * the BPB of the bootloader and the complete layout is planned from the file
+ * sizes, after which the image is written front to back in a single pass.
  * @param oFile The output file stream.
  * @return Zero if successful; otherwise, a non-zero value.
  */
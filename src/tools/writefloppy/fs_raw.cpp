@@ -5,84 +5,67 @@
 #include "fs_raw.hpp"
 #include "globals.hpp"
 #include "utility.hpp"
+#include "../common/rawimage.hpp"
 
 /** For a description see the header file. */
-int Raw_CopyData(FILE *oFile)
+int Raw_CopyData(const char *path)
 {
-    char buffer[BUFFER_SIZE];
-    size_t offset, written, read = BUFFER_SIZE;
+    RawImage_t image;
     size_t size;
+    char *filename;
     FILE *iFile;
+    int result;
 
-    // Always start with the bootloader first
-    iFile = FS_OpenBootloader(&size);
-    if (iFile == NULL)
+    // The image is created at its final size; the padding behind every file
+    // and the tail of the floppy are never written and read back as zero.
+    result = RAW_create(&image, path, FLOPPY_SIZE);
+    if (result)
     {
-        fprintf(stderr, "I/O ERROR: A.\n");
-        return -1;
+        fprintf(stderr, "I/O ERROR: Could not create '%s' (%i, %lu).\n", path, result, GetLastError());
+        return 1;
     }
 
-    // Read and write per buffer till the output file has been filled
-    for (offset = 0; offset < FLOPPY_SIZE; offset += BUFFER_SIZE)
+    // Always start with the bootloader first
+    iFile = FS_OpenBootloader(&size);
+    filename = g_bootloader;
+
+    while (iFile)
     {
-        // Open a new file if non is opened
-        if (!iFile)
+        result = RAW_append(&image, iFile, filename);
+        fclose(iFile);
+
+        if (result)
         {
-            iFile = FS_OpenNextFile(&size, NULL);
-            if (!iFile)
-            {
-                fprintf(stderr, "I/O ERROR: A.\n");
-                return -1;
-            }
+            fprintf(stderr, "I/O ERROR: Could not write '%s' (%i).\n", filename, result);
+            break;
         }
 
-        // Clear the buffer
-        memset(buffer, 0, BUFFER_SIZE);
-
-        if (iFile)
+        // Stop when all the files have been written
+        if (g_queue.empty())
         {
-            // Read from the input file
-            read = fread(buffer, 1, BUFFER_SIZE, iFile);
+            break;
+        }
 
-            // The filesize may be exactly that of a single buffer, hence we
-            // need to keep track of the size as this has to be checked as well.
-            size -= read;
+        iFile = FS_OpenNextFile(&size, &filename);
+    }
 
-            // We read to the end of the file
-            if (read != BUFFER_SIZE)
-            {
-                if (feof(iFile))
-                {
-                    fclose(iFile);
-                    iFile = NULL;
-                }
-                else
-                {
-                    if (!ferror(iFile))
-                    {
-                        fprintf(stderr, "I/O ERROR: An unknown condition occured.\n");
-                        fclose(iFile);
-                        return 4;
-                    }
-                }
-            }
-            else if (size <= 0)
-            {
-                fclose(iFile);
-                iFile = NULL;
-            }
-        }
+    // A file could not be opened or written
+    if (!iFile || result)
+    {
+        RAW_close(&image);
+        return 2;
+    }
 
-        // Write the buffer to the output file
-        written = fwrite(buffer, 1, BUFFER_SIZE, oFile);
+    if (RAW_close(&image))
+    {
+        fprintf(stderr, "I/O ERROR: Could not flush '%s'.\n", path);
+        return 3;
+    }
 
-        // Could not write the file, abort end give an error
-        if (written != BUFFER_SIZE)
-        {
-            fprintf(stderr, "I/O ERROR: Could not write all the bytes, %zu of %i were written.\n", written, BUFFER_SIZE);
-            fclose(iFile);
-            return 1;
-        }
+    if (RAW_writeMap(&image, path))
+    {
+        fprintf(stderr, "I/O ERROR: Could not write the sector map of '%s'.\n", path);
+        return 4;
     }
 
     return 0;
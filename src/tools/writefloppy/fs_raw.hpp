@@ -4,10 +4,11 @@
 #include <cstdio>
 
 /**
- * Copies the data from the input files in the given order into the output file.
- * @param oFile The output file stream.
+ * Copies the data from the input files in the given order into the output file,
+ * each starting at a sector boundary, and writes a sidecar with their LBAs.
+ * @param path The path of the output file.
  * @return Zero if successful; otherwise, a non-zero value.
  */
-int Raw_CopyData(FILE *oFile);
+int Raw_CopyData(const char *path);
 
 #endif //FS_RAW_HPP
@@ -2,6 +2,7 @@
 #include <cstdio>
 #include <cstdint>
 #include "io.hpp"
+#include "../common/layout.hpp"
 
 
 /**
@@ -32,24 +33,6 @@ long int fsize(FILE *stream)
     return size;
 }
 
-/**
- * Determines the machine's endianness.
- * @return true if little-endian; otherwise, big-endian is assumed.
- */
-bool isLittleEndian(void)
-{
-    union
-    {
-        unsigned char buffer[4];
-        unsigned int value;
-    };
-    
-    value = 0x11223344;
-
-    // We only accomodate for Little and Big endianness
-    return (buffer[0] == 0x44);
-}
-
 /**
  * Reads a BYTE from the stream into the referenced variable.
  * @param stream The file stream to read from.
@@ -65,7 +48,7 @@ int readBYTE(FILE *stream, void *out)
         return -1;
     }
 
-    *(static_cast<int8_t*>(out)) = static_cast<int8_t>(value);
+    *(static_cast<uint8_t*>(out)) = static_cast<uint8_t>(value);
 
     return 0;
 }
@@ -78,7 +61,7 @@ int readBYTE(FILE *stream, void *out)
  */
 int writeBYTE(FILE *stream, void *in)
 {
-    int result = fputc(*(static_cast<int8_t*>(in)), stream);
+    int result = fputc(*(static_cast<uint8_t*>(in)), stream);
 
     if (result == EOF)
     {
@@ -96,28 +79,14 @@ int writeBYTE(FILE *stream, void *in)
  */
 int readWORD(FILE *stream, void *out)
 {
-    union
-    {
-        int8_t  buffer[2];
-        int16_t value;
-    };
+    uint8_t buffer[2];
 
     if (2 != fread(buffer, 1, 2, stream))
     {
         return -1;
     }
 
-    if (!isLittleEndian())
-    {
-        *(static_cast<int16_t*>(out)) = static_cast<int16_t>(
-            (static_cast<uint16_t>(buffer[0]) << 8) |
-            (static_cast<uint16_t>(buffer[1]) << 0)
-        );
-    }
-    else
-    {
-        *(static_cast<int16_t*>(out)) = value;
-    }
+    *(static_cast<uint16_t*>(out)) = LE_load16(buffer);
 
     return 0;
 }
@@ -130,27 +99,11 @@ int readWORD(FILE *stream, void *out)
  */
 int writeWORD(FILE *stream, void *in)
 {
-    union
-    {
-        int8_t  buffer[2];
-        int16_t value;
-    } out, tmp;
+    uint8_t buffer[2];
 
-    if (!isLittleEndian())
-    {
-        tmp.value = *(static_cast<int16_t*>(in));
+    LE_store16(buffer, *(static_cast<uint16_t*>(in)));
 
-        out.value = static_cast<int16_t>(
-            (static_cast<uint16_t>(tmp.buffer[0]) << 8) |
-            (static_cast<uint16_t>(tmp.buffer[1]) << 0)
-        );
-    }
-    else
-    {
-        out.value = *(static_cast<int16_t*>(in));
-    }
-
-    return (2 != fwrite(out.buffer, 1, 2, stream)) ? -1 : 0;
+    return (2 != fwrite(buffer, 1, 2, stream)) ? -1 : 0;
 }
 
 /**
@@ -161,30 +114,14 @@ int writeWORD(FILE *stream, void *in)
  */
 int readDWORD(FILE *stream, void *out)
 {
-    union
-    {
-        int8_t  buffer[4];
-        int32_t value;
-    };
+    uint8_t buffer[4];
 
     if (4 != fread(buffer, 1, 4, stream))
     {
         return -1;
     }
 
-    if (!isLittleEndian())
-    {
-        *(static_cast<int32_t*>(out)) = static_cast<int32_t>(
-            (static_cast<uint32_t>(buffer[0]) << 24) |
-            (static_cast<uint32_t>(buffer[1]) << 16) |
-            (static_cast<uint32_t>(buffer[2]) << 8) |
-            (static_cast<uint32_t>(buffer[3]) << 0)
-        );
-    }
-    else
-    {
-        *(static_cast<int32_t*>(out)) = value;
-    }
+    *(static_cast<uint32_t*>(out)) = LE_load32(buffer);
 
     return 0;
 }
@@ -197,29 +134,11 @@ int readDWORD(FILE *stream, void *out)
  */
 int writeDWORD(FILE *stream, void *in)
 {
-    union
-    {
-        int8_t  buffer[4];
-        int32_t value;
-    } out, tmp;
+    uint8_t buffer[4];
 
-    if (!isLittleEndian())
-    {
-        tmp.value = *(static_cast<int32_t*>(in));
-
-        out.value = static_cast<int32_t>(
-            (static_cast<uint32_t>(tmp.buffer[0]) << 24) |
-            (static_cast<uint32_t>(tmp.buffer[1]) << 16) |
-            (static_cast<uint32_t>(tmp.buffer[2]) << 8) |
-            (static_cast<uint32_t>(tmp.buffer[3]) << 0)
-        );
-    }
-    else
-    {
-        out.value = *(static_cast<int32_t*>(in));
-    }
+    LE_store32(buffer, *(static_cast<uint32_t*>(in)));
 
-    return (4 != fwrite(out.buffer, 1, 4, stream)) ? -1 : 0;
+    return (4 != fwrite(buffer, 1, 4, stream)) ? -1 : 0;
 }
 
 /**
@@ -230,34 +149,14 @@ int writeDWORD(FILE *stream, void *in)
  */
 int readQWORD(FILE *stream, void *out)
 {
-    union
-    {
-        int8_t  buffer[8];
-        int64_t value;
-    };
+    uint8_t buffer[8];
 
     if (8 != fread(buffer, 1, 8, stream))
     {
         return -1;
     }
 
-    if (!isLittleEndian())
-    {
-        *(static_cast<int64_t*>(out)) = static_cast<int64_t>(
-            (static_cast<uint64_t>(buffer[0]) << 56) |
-            (static_cast<uint64_t>(buffer[1]) << 48) |
-            (static_cast<uint64_t>(buffer[2]) << 40) |
-            (static_cast<uint64_t>(buffer[3]) << 32) |
-            (static_cast<uint64_t>(buffer[4]) << 24) |
-            (static_cast<uint64_t>(buffer[5]) << 16) |
-            (static_cast<uint64_t>(buffer[6]) << 8) |
-            (static_cast<uint64_t>(buffer[7]) << 0)
-        );
-    }
-    else
-    {
-        *(static_cast<int64_t*>(out)) = value;
-    }
+    *(static_cast<uint64_t*>(out)) = LE_load64(buffer);
 
     return 0;
 }
@@ -270,27 +169,9 @@ int readQWORD(FILE *stream, void *out)
  */
 int writeQWORD(FILE *stream, void *in)
 {
-    union
-    {
-        int8_t  buffer[8];
-        int64_t value;
-    } out, tmp;
+    uint8_t buffer[8];
 
-    if (!isLittleEndian())
-    {
-        tmp.value = *(static_cast<int64_t*>(in));
-
-        out.value = static_cast<int64_t>(
-            (static_cast<uint64_t>(tmp.buffer[0]) << 24) |
-            (static_cast<uint64_t>(tmp.buffer[1]) << 16) |
-            (static_cast<uint64_t>(tmp.buffer[2]) << 8) |
-            (static_cast<uint64_t>(tmp.buffer[3]) << 0)
-        );
-    }
-    else
-    {
-        out.value = *(static_cast<int64_t*>(in));
-    }
+    LE_store64(buffer, *(static_cast<uint64_t*>(in)));
 
-    return (4 != fwrite(out.buffer, 1, 4, stream)) ? -1 : 0;
+    return (8 != fwrite(buffer, 1, 8, stream)) ? -1 : 0;
 }
@@ -4,9 +4,6 @@
 /** Get the size of the file stream. */
 long int fsize(FILE *stream);
 
-/** Get an indicator to whether the machine uses little-endian. */
-bool isLittleEndian(void);
-
 /**
  * Read data from a stream in little-endian.
  */
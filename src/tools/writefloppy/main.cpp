@@ -220,18 +220,10 @@ int main(int argc, char **argv)
     FILE *oFile = NULL; // output
     errno_t err; // Windows error
 
-    // Open the output file in write/binary
-    err = fopen_s(&oFile, g_outputFile, "wb");
-    if (err)
-    {
-        return 0;
-    }
-
-    // Copy the data using the specified filesystem format;
-    // and give a message on both success and failure.
+    // The raw writer maps the output itself
     if (g_filesystem == FS_RAW)
     {
-        if (!Raw_CopyData(oFile))
+        if (!Raw_CopyData(g_outputFile))
         {
             printf("Data has been written successfully!\n");
         }
@@ -239,8 +231,20 @@ int main(int argc, char **argv)
         {
             printf("ERROR: Raw write failed.\n");
         }
+
+        return 0;
     }
-    else if (g_filesystem == FS_FAT12)
+
+    // Open the output file in write/binary
+    err = fopen_s(&oFile, g_outputFile, "wb");
+    if (err)
+    {
+        return 0;
+    }
+
+    // Copy the data using the specified filesystem format;
+    // and give a message on both success and failure.
+    if (g_filesystem == FS_FAT12)
     {
         if (!FAT12_CopyData(oFile))
         {
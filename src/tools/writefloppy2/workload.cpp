@@ -0,0 +1,963 @@
+/**
+ * WORKLOAD
+ *   Generates synthetic file sets for the image tools and benchmarks how they
+ *   scale. A set is written to a host directory, so it can be imported with
+ *   the -t option of writefloppy2, or used as a loose list of input files.
+ *
+ * GENERATORS
+ *   tiny <dir> <count> [size]                Many files of at most one cluster.
+ *   large <dir> <count> <size>               A few large files.
+ *   tree <dir> <depth> <fanout> <files>      A directory tree, files in every directory.
+ *   fill <dir> <percent>                     Mixed file sizes up to a share of the disk.
+ *   fragment <image> <output>                Scatters every chain of a plain image.
+ *
+ * BENCHMARK
+ *   bench <tool> <csv> builds an image from every workload at increasing fill
+ *   levels, and defragments a scattered image, with the given writefloppy2.
+ *   The time of each run includes starting the process; the best of several
+ *   runs is kept. Every row is printed and appended to the CSV file.
+ *
+ * REMARKS
+ *   File contents come from a seeded generator, so a set can be recreated
+ *   exactly from its seed. Sizes are drawn log-uniformly, which gives many
+ *   small files and a few big ones, like a real payload.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define WIN32_LEAN_AND_MEAN 1
+#include <Windows.h>
+
+const bool VERBOSE = false;
+
+#define CINFO(fmt, ...)     fprintf(stdout, fmt"\n", ##__VA_ARGS__)
+#define CWARN(fmt, ...)     fprintf(stdout, "WARNING: "fmt"\n", ##__VA_ARGS__)
+#define CERROR(fmt, ...)    fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
+#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(stdout, "[VERBOSE] "fmt"\n", ##__VA_ARGS__); }
+
+#include "settings.inc"
+#include "../common/layout.hpp"
+#include "../common/volume.hpp"
+
+#define WL_FILES_PER_DIR    126         // Files per generated directory; with . and .. 8 clusters
+#define WL_MAX_FILE         0x10000     // Largest file of a mixed set
+#define WL_WRITE_BUFFER     0x1000      // Bytes generated per write
+#define WL_BENCH_DIR        "bench"     // Holds the sets and images of a benchmark
+#define WL_DEFAULT_SEED     0x4D4F5331  // Used unless -r is given
+#define WL_DEFAULT_RUNS     3           // Runs per benchmark step; the best is kept
+#define WL_QUIET            " >NUL"     // Silences the tool while it is timed
+
+char g_workingDirectory[MAX_PATH];      /* The path to the working directory */
+uint32_t g_seed;                        /* The state of the random generator */
+int g_runs;                             /* Runs per benchmark step */
+
+
+/**
+ * The layout of an image, as measured after a run.
+ */
+typedef struct
+{
+    int     files;                      /* The number of files */
+    int     dirs;                       /* The number of directories */
+    size_t  bytes;                      /* The size of all files together */
+    int     used;                       /* The number of allocated clusters */
+    int     fragmented;                 /* Chains that consist of several runs */
+    int     extraRuns;                  /* Runs beyond the first, over all chains */
+    int     freeRuns;                   /* Separate runs of free clusters */
+    int     largestFree;                /* The longest run of free clusters */
+} Layout_t;
+
+
+/**
+ * Sets the default values for the dynamic settings.
+ */
+void setDefaults(void)
+{
+    memset(g_workingDirectory, 0, MAX_PATH);
+    g_seed = WL_DEFAULT_SEED;
+    g_runs = WL_DEFAULT_RUNS;
+}
+
+
+/**
+ * Gets the next number of the random generator; xorshift32.
+ */
+uint32_t WL_random(void)
+{
+    g_seed ^= g_seed << 13;
+    g_seed ^= g_seed >> 17;
+    g_seed ^= g_seed << 5;
+    return g_seed;
+}
+
+
+/**
+ * Gets a random number in the range [low, high].
+ */
+size_t WL_range(size_t low, size_t high)
+{
+    return low + (WL_random() % (high - low + 1));
+}
+
+
+/**
+ * Gets a random size in the range [1, max], drawn log-uniformly.
+ */
+size_t WL_logSize(size_t max)
+{
+    int bits = 0;
+
+    while ((static_cast<size_t>(2) << bits) <= max)
+    {
+        bits++;
+    }
+
+    size_t low = static_cast<size_t>(1) << WL_range(0, bits);
+    size_t high = (low * 2 - 1 < max) ? (low * 2 - 1) : max;
+    return WL_range(low, high);
+}
+
+
+/**
+ * Gets the number of clusters a file of the given size takes.
+ */
+int WL_clusters(size_t size)
+{
+    return static_cast<int>((size + BYTES_PER_CLUSTER - 1) / BYTES_PER_CLUSTER);
+}
+
+
+/**
+ * Creates a directory; one that already exists is fine.
+ */
+int WL_makeDir(const std::string &path)
+{
+    if (!CreateDirectoryA(path.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        CERROR("Could not create directory '%s'. (%i)", path.c_str(), GetLastError());
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Removes a directory and everything in it; one that does not exist is fine.
+ */
+int WL_removeTree(const std::string &path)
+{
+    WIN32_FIND_DATAA find;
+    HANDLE handle;
+    int result = 0;
+
+    handle = FindFirstFileA((path + "\\*").c_str(), &find);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return 0;
+    }
+
+    do
+    {
+        std::string child = path + "\\" + find.cFileName;
+
+        if (!strcmp(find.cFileName, ".") || !strcmp(find.cFileName, ".."))
+        {
+            continue;
+        }
+
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)   result |= WL_removeTree(child);
+        else if (!DeleteFileA(child.c_str()))                   result = -1;
+    }
+    while (FindNextFileA(handle, &find));
+
+    FindClose(handle);
+
+    if (!RemoveDirectoryA(path.c_str()))
+    {
+        result = -2;
+    }
+
+    return result;
+}
+
+
+/**
+ * Writes a file of random contents.
+ * @param path The path of the file.
+ * @param size The size of the file in bytes.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int WL_writeFile(const std::string &path, size_t size)
+{
+    uint8_t buffer[WL_WRITE_BUFFER];
+    FILE *file;
+    int result = 0;
+
+    if (fopen_s(&file, path.c_str(), "wb"))
+    {
+        CERROR("Could not open file '%s' for writing.", path.c_str());
+        return -1;
+    }
+
+    for (size_t written = 0; written < size && !result; )
+    {
+        size_t n = ((size - written) < WL_WRITE_BUFFER) ? (size - written) : WL_WRITE_BUFFER;
+
+        for (size_t i = 0; i < n; i += 4)
+        {
+            uint32_t value = WL_random();
+            memcpy(buffer + i, &value, ((n - i) < 4) ? (n - i) : 4);
+        }
+
+        result = (fwrite(buffer, 1, n, file) != n) ? -2 : 0;
+        written += n;
+    }
+
+    if (fclose(file) && !result)
+    {
+        result = -3;
+    }
+
+    if (result)
+    {
+        CERROR("Could not write file '%s'. (%i)", path.c_str(), result);
+    }
+
+    return result;
+}
+
+
+/**
+ * Writes a list of files, grouping them into subdirectories of at most
+ * WL_FILES_PER_DIR files once they no longer fit the root.
+ * @param dir The directory to write to.
+ * @param prefix The first letter of the file names.
+ * @param sizes The size of every file.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int WL_writeSet(const std::string &dir, char prefix, const std::vector<size_t> &sizes)
+{
+    bool grouped = sizes.size() > WL_FILES_PER_DIR;
+    char name[MAX_PATH];
+    std::string group = dir;
+
+    if (WL_makeDir(dir))
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        if (grouped && (i % WL_FILES_PER_DIR) == 0)
+        {
+            sprintf_s(name, MAX_PATH, "%s\\D%04zu", dir.c_str(), i / WL_FILES_PER_DIR);
+            group = name;
+
+            if (WL_makeDir(group))
+            {
+                return -1;
+            }
+        }
+
+        sprintf_s(name, MAX_PATH, "%s\\%c%06zu.DAT", group.c_str(), prefix, i);
+        if (WL_writeFile(name, sizes[i]))
+        {
+            return -2;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Generates many tiny files; a size of zero picks one per file, up to a cluster.
+ */
+int GEN_tiny(const std::string &dir, int count, size_t size)
+{
+    std::vector<size_t> sizes;
+
+    for (int i = 0; i < count; i++)
+    {
+        sizes.push_back(size ? size : WL_range(1, BYTES_PER_CLUSTER));
+    }
+
+    return WL_writeSet(dir, 'T', sizes);
+}
+
+
+/**
+ * Generates a few large files of the same size.
+ */
+int GEN_large(const std::string &dir, int count, size_t size)
+{
+    return WL_writeSet(dir, 'L', std::vector<size_t>(count, size));
+}
+
+
+/**
+ * Generates a directory tree with files of mixed sizes in every directory.
+ * @param dir The directory to write to.
+ * @param depth The number of levels below the given directory.
+ * @param fanout The number of subdirectories per directory.
+ * @param files The number of files per directory.
+ * @param size The largest size of a file.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int GEN_tree(const std::string &dir, int depth, int fanout, int files, size_t size)
+{
+    char name[MAX_PATH];
+
+    if (WL_makeDir(dir))
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < files; i++)
+    {
+        sprintf_s(name, MAX_PATH, "%s\\F%04i.DAT", dir.c_str(), i);
+        if (WL_writeFile(name, WL_logSize(size)))
+        {
+            return -2;
+        }
+    }
+
+    for (int i = 0; i < fanout && depth > 0; i++)
+    {
+        sprintf_s(name, MAX_PATH, "%s\\S%02i", dir.c_str(), i);
+        if (GEN_tree(name, depth - 1, fanout, files, size))
+        {
+            return -3;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Generates files of mixed sizes until they take the given share of the data
+ * clusters; the directories they are grouped into are counted as well.
+ */
+int GEN_fill(const std::string &dir, int percent)
+{
+    int target = static_cast<int>((static_cast<long long>(DATA_CLUSTERS) * percent) / 100);
+    std::vector<size_t> sizes;
+    int clusters = 0;
+
+    while (true)
+    {
+        size_t size = WL_logSize(WL_MAX_FILE);
+        int groups = static_cast<int>(sizes.size() / WL_FILES_PER_DIR) + 1;
+        int entries = WL_clusters((WL_FILES_PER_DIR + 2) * DIR::SIZE) * ((sizes.size() >= WL_FILES_PER_DIR) ? groups : 0);
+
+        if (clusters + entries + WL_clusters(size) > target)
+        {
+            break;
+        }
+
+        clusters += WL_clusters(size);
+        sizes.push_back(size);
+    }
+
+    return WL_writeSet(dir, 'M', sizes);
+}
+
+
+/**
+ * Scatters the chains of a plain image: the clusters of all chains are dealt
+ * out in turns and spread evenly over the volume, so consecutive clusters of
+ * a file are never adjacent and the free space is cut into small runs.
+ * @param pathIn The plain image to scatter.
+ * @param pathOut The path of the scattered image.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int GEN_fragment(const char *pathIn, const char *pathOut)
+{
+    std::vector<uint8_t> image(DEVICE_SIZE, 0);
+    std::vector<VolumeEntry_t> entries;
+    Volume_t volume;
+    FILE *file;
+
+    if (fopen_s(&file, pathIn, "rb"))
+    {
+        CERROR("Could not open image '%s'.", pathIn);
+        return -1;
+    }
+
+    size_t read = fread(image.data(), 1, DEVICE_SIZE, file);
+    fclose(file);
+
+    if (read != DEVICE_SIZE || VOLUME_open(&volume, image.data(), image.size()))
+    {
+        CERROR("'%s' is not a plain 1.44MB FAT12 image.", pathIn);
+        return -2;
+    }
+
+    VOLUME_walk(&volume, entries);
+
+    // Every cluster has to belong to a single chain, or the moves would clash
+    std::vector<int> remap(volume.clusters + 2, 0);
+    std::vector<int> available;
+    size_t total = 0, longest = 0;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].status != VOLUME_CHAIN_OK)
+        {
+            CERROR("The chain of '%s' is broken.", entries[i].path.c_str());
+            return -3;
+        }
+
+        for (size_t j = 0; j < entries[i].chain.size(); j++)
+        {
+            if (remap[entries[i].chain[j]]++)
+            {
+                CERROR("'%s' shares a cluster with another file.", entries[i].path.c_str());
+                return -4;
+            }
+        }
+
+        total += entries[i].chain.size();
+        longest = (entries[i].chain.size() > longest) ? entries[i].chain.size() : longest;
+    }
+
+    for (int i = 2; i < volume.clusters + 2; i++)
+    {
+        if (VOLUME_getEntry(&volume, i) != 0xFF7)
+        {
+            available.push_back(i);
+        }
+    }
+
+    if (total == 0 || total > available.size())
+    {
+        CERROR("The image holds no chains to scatter.");
+        return -5;
+    }
+
+    // Deal the clusters out in turns and spread them over the volume
+    size_t k = 0;
+    for (size_t round = 0; round < longest; round++)
+    {
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (round < entries[i].chain.size())
+            {
+                remap[entries[i].chain[round]] = available[(k++ * available.size()) / total];
+            }
+        }
+    }
+
+    // Rebuild the FAT and move the data; bad clusters stay where they are
+    std::vector<uint8_t> fat(volume.fatSize, 0);
+    std::vector<uint8_t> scattered(image);
+
+    FAT12_setEntry(fat.data(), 0, static_cast<uint16_t>(VOLUME_getEntry(&volume, 0)));
+    FAT12_setEntry(fat.data(), 1, static_cast<uint16_t>(VOLUME_getEntry(&volume, 1)));
+    for (int i = 2; i < volume.clusters + 2; i++)
+    {
+        if (VOLUME_getEntry(&volume, i) == 0xFF7)
+        {
+            FAT12_setEntry(fat.data(), i, 0xFF7);
+        }
+    }
+
+    memset(scattered.data() + volume.dataOffset, 0, volume.clusters * volume.clusterSize);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const std::vector<uint16_t> &chain = entries[i].chain;
+
+        for (size_t j = 0; j < chain.size(); j++)
+        {
+            int to = remap[chain[j]];
+            int next = (j + 1 < chain.size()) ? remap[chain[j + 1]] : 0xFFF;
+
+            FAT12_setEntry(fat.data(), to, static_cast<uint16_t>(next));
+            memcpy(scattered.data() + volume.dataOffset + ((to - 2) * volume.clusterSize),
+                VOLUME_cluster(&volume, chain[j]), volume.clusterSize);
+        }
+    }
+
+    for (int i = 0; i < volume.bpb.numberOfFats; i++)
+    {
+        memcpy(scattered.data() + volume.fatOffset + (i * volume.fatSize), fat.data(), volume.fatSize);
+    }
+
+    // Point the directory entries, including '.' and '..', at the new clusters
+    std::vector<uint8_t *> dirs;
+    for (size_t i = 0; i < volume.bpb.maxRootEntries; i++)
+    {
+        dirs.push_back(scattered.data() + volume.rootOffset + (i * DIR::SIZE));
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].entry.attributes & 0x10)
+        {
+            for (size_t j = 0; j < entries[i].chain.size(); j++)
+            {
+                uint8_t *data = scattered.data() + volume.dataOffset + ((remap[entries[i].chain[j]] - 2) * volume.clusterSize);
+                for (size_t offset = 0; offset < volume.clusterSize; offset += DIR::SIZE)
+                {
+                    dirs.push_back(data + offset);
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        uint8_t *entry = dirs[i];
+        uint16_t first = LE_load16(entry + DIR::FirstCluster::offset);
+
+        if (entry[0] != 0x00 && entry[0] != 0xE5 && (entry[11] & 0x3F) != 0x0F &&
+            first >= 2 && first < volume.clusters + 2)
+        {
+            LE_store16(entry + DIR::FirstCluster::offset, static_cast<uint16_t>(remap[first]));
+        }
+    }
+
+    if (fopen_s(&file, pathOut, "wb"))
+    {
+        CERROR("Could not open image '%s' for writing.", pathOut);
+        return -6;
+    }
+
+    size_t written = fwrite(scattered.data(), 1, scattered.size(), file);
+    if ((fclose(file) != 0) | (written != scattered.size()))
+    {
+        CERROR("Could not write image '%s'.", pathOut);
+        return -7;
+    }
+
+    CINFO("Scattered %zu clusters of %zu chains over %zu clusters.", total, entries.size(), available.size());
+    return 0;
+}
+
+
+/**
+ * Measures the layout of a plain image.
+ * @param path The path of the image.
+ * @param layout Receives the layout.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int WL_measure(const char *path, Layout_t *layout)
+{
+    std::vector<uint8_t> image(DEVICE_SIZE, 0);
+    std::vector<VolumeEntry_t> entries;
+    Volume_t volume;
+    FILE *file;
+
+    memset(layout, 0, sizeof(Layout_t));
+
+    if (fopen_s(&file, path, "rb"))
+    {
+        return -1;
+    }
+
+    size_t read = fread(image.data(), 1, DEVICE_SIZE, file);
+    fclose(file);
+
+    // A short read would be measured as a mostly empty volume
+    if (read != DEVICE_SIZE)
+    {
+        return -2;
+    }
+
+    if (VOLUME_open(&volume, image.data(), image.size()))
+    {
+        return -3;
+    }
+
+    VOLUME_walk(&volume, entries);
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const std::vector<uint16_t> &chain = entries[i].chain;
+        int runs = chain.empty() ? 0 : 1;
+
+        for (size_t j = 1; j < chain.size(); j++)
+        {
+            runs += (chain[j] != chain[j - 1] + 1) ? 1 : 0;
+        }
+
+        if (entries[i].entry.attributes & 0x10)     layout->dirs++;
+        else                                        { layout->files++; layout->bytes += entries[i].entry.fileSize; }
+
+        layout->fragmented += (runs > 1) ? 1 : 0;
+        layout->extraRuns += (runs > 1) ? (runs - 1) : 0;
+    }
+
+    for (int i = 2, run = 0; i < volume.clusters + 2; i++)
+    {
+        bool unused = VOLUME_getEntry(&volume, i) == 0x000;
+
+        layout->used += unused ? 0 : 1;
+        layout->freeRuns += (unused && run == 0) ? 1 : 0;
+
+        run = unused ? (run + 1) : 0;
+        layout->largestFree = (run > layout->largestFree) ? run : layout->largestFree;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Writes an empty volume whose boot sector only holds the BPB of the device;
+ * the benchmark builds every image on top of it, like the Makefile does
+ * with its base image.
+ */
+int WL_writeBaseImage(const char *path)
+{
+    std::vector<uint8_t> image(DEVICE_SIZE, 0);
+    BPB_t bpb;
+    FILE *file;
+
+    memset(&bpb, 0, sizeof(BPB_t));
+    memcpy(bpb.oemId, "WORKLOAD", 8);
+    bpb.bytesPerSector = BYTES_PER_SECTOR;
+    bpb.sectorsPerCluster = SECTORS_PER_CLUSTER;
+    bpb.reservedSectors = RESERVED_CLUSTERS;
+    bpb.numberOfFats = NUMBER_OF_FAT;
+    bpb.maxRootEntries = MAX_ROOT_DIRECTORIES;
+    bpb.smallSectors = TOTAL_SECTORS_FAT16;
+    bpb.mediaDescriptor = DEVICE_TYPE;
+    bpb.sectorsPerFat = SECTORS_PER_FAT;
+    bpb.sectorsPerTrack = SECTORS_PER_TRACK;
+    bpb.numberOfHeads = NUMBER_OF_HEADS;
+    bpb.bootSignature = BOOT_SIGNATURE;
+    bpb.volumeId = VOLUME_ID;
+    memcpy(bpb.volumeLabel, "NO NAME    ", 11);
+    memcpy(bpb.fileSystemType, "FAT12   ", 8);
+
+    image[0] = 0xEB;
+    image[1] = 0x3C;
+    image[2] = 0x90;
+    BPB_encode(&bpb, image.data());
+    image[510] = 0x55;
+    image[511] = 0xAA;
+
+    for (int i = 0; i < NUMBER_OF_FAT; i++)
+    {
+        uint8_t *fat = image.data() + ((RESERVED_CLUSTERS + (i * SECTORS_PER_FAT)) * BYTES_PER_SECTOR);
+
+        FAT12_setEntry(fat, 0, 0xF00 | DEVICE_TYPE);
+        FAT12_setEntry(fat, 1, 0xFFF);
+    }
+
+    if (fopen_s(&file, path, "wb"))
+    {
+        return -1;
+    }
+
+    size_t written = fwrite(image.data(), 1, image.size(), file);
+    return ((fclose(file) != 0) | (written != image.size())) ? -2 : 0;
+}
+
+
+/**
+ * Runs a command a number of times.
+ * @param command The command line to run.
+ * @param seconds Receives the time of the fastest run.
+ * @return The exit code of the last run.
+ */
+int BENCH_time(const char *command, double *seconds)
+{
+    int result = 0;
+
+    *seconds = 0.0;
+
+    for (int i = 0; i < g_runs; i++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        result = system(command);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+        if (i == 0 || elapsed.count() < *seconds)
+        {
+            *seconds = elapsed.count();
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * Prints a row of the benchmark and appends it to the CSV file.
+ */
+void BENCH_report(FILE *csv, const char *workload, int level, bool passed, double seconds, const Layout_t *layout)
+{
+    double throughput = (seconds > 0.0) ? (layout->bytes / 1024.0) / seconds : 0.0;
+
+    CINFO("  %-9s %3i%% %-4s %6i %4i %8zu %8.3f %9.1f %5i %5i %5i %5i %5i", workload, level,
+        passed ? "ok" : "FAIL", layout->files, layout->dirs, layout->bytes, seconds, throughput,
+        layout->used, layout->fragmented, layout->extraRuns, layout->freeRuns, layout->largestFree);
+
+    fprintf(csv, "%s,%i,%s,%i,%i,%zu,%.4f,%.1f,%i,%i,%i,%i,%i\n", workload, level,
+        passed ? "ok" : "fail", layout->files, layout->dirs, layout->bytes, seconds, throughput,
+        layout->used, layout->fragmented, layout->extraRuns, layout->freeRuns, layout->largestFree);
+}
+
+
+/**
+ * Generates one workload of the benchmark at the given fill level.
+ */
+int BENCH_generate(const std::string &dir, const char *workload, int level)
+{
+    int target = (DATA_CLUSTERS * level) / 100;
+
+    // Tiny files take one cluster each, and one more per 16 directory entries
+    if (!strcmp(workload, "tiny"))      return GEN_tiny(dir, (target * 16) / 17, 0);
+
+    // Four files share the target equally
+    if (!strcmp(workload, "large"))     return GEN_large(dir, 4, (static_cast<size_t>(target) * BYTES_PER_CLUSTER) / 4);
+
+    // Three levels of three subdirectories; 40 directories of single cluster files
+    if (!strcmp(workload, "tree"))      return GEN_tree(dir, 3, 3, (target * 16) / (40 * 17), BYTES_PER_CLUSTER);
+
+    return GEN_fill(dir, level);
+}
+
+
+/**
+ * Builds an image from every workload at increasing fill levels, then
+ * scatters and defragments one of them.
+ * @param tool The path of writefloppy2.
+ * @param pathCsv The CSV file the results are appended to.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int BENCH_run(const char *tool, const char *pathCsv)
+{
+    static const char *workloads[] = { "tiny", "large", "tree", "fill" };
+    static const int levels[] = { 10, 25, 50, 75, 90, 98 };
+    char command[MAX_PATH * 4];
+    char image[MAX_PATH];
+    char base[MAX_PATH];
+    Layout_t layout;
+    double seconds;
+    FILE *csv;
+
+    if (fopen_s(&csv, pathCsv, "a"))
+    {
+        CERROR("Could not open '%s' for writing.", pathCsv);
+        return -1;
+    }
+
+    // Appended runs share the header of the first one
+    if (fseek(csv, 0, SEEK_END) == 0 && ftell(csv) == 0)
+    {
+        fprintf(csv, "workload,level,status,files,dirs,bytes,seconds,kbps,clusters,fragmented,extraruns,freeruns,largestfree\n");
+    }
+
+    sprintf_s(base, MAX_PATH, "%s\\base.flp", WL_BENCH_DIR);
+    if (WL_removeTree(WL_BENCH_DIR) || WL_makeDir(WL_BENCH_DIR) || WL_writeBaseImage(base))
+    {
+        fclose(csv);
+        return -2;
+    }
+
+    CINFO("  %-9s %4s %-4s %6s %4s %8s %8s %9s %5s %5s %5s %5s %5s", "WORKLOAD", "FILL", "", "FILES",
+        "DIRS", "BYTES", "SECONDS", "KB/S", "USED", "FRAG", "EXTRA", "FREE", "LARGE");
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        for (size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); l++)
+        {
+            char set[MAX_PATH];
+
+            g_seed = WL_DEFAULT_SEED + static_cast<uint32_t>((w * 100) + levels[l]);
+            sprintf_s(set, MAX_PATH, "%s\\%s%02i", WL_BENCH_DIR, workloads[w], levels[l]);
+            sprintf_s(image, MAX_PATH, "%s.flp", set);
+
+            if (BENCH_generate(set, workloads[w], levels[l]))
+            {
+                fclose(csv);
+                return -3;
+            }
+
+            // A set that does not fit is part of the result, not an error
+            sprintf_s(command, sizeof(command), "\"%s\" build -i %s -o %s -t %s%s", tool, base, image, set, WL_QUIET);
+            bool passed = (BENCH_time(command, &seconds) == 0);
+            passed = (WL_measure(image, &layout) == 0) && passed;
+
+            BENCH_report(csv, workloads[w], levels[l], passed, seconds, &layout);
+            WL_removeTree(set);
+        }
+    }
+
+    // Scatter the mixed set and let the tool put it back together
+    char scattered[MAX_PATH], defragmented[MAX_PATH];
+
+    sprintf_s(image, MAX_PATH, "%s\\fill75.flp", WL_BENCH_DIR);
+    sprintf_s(scattered, MAX_PATH, "%s\\scattered.flp", WL_BENCH_DIR);
+    sprintf_s(defragmented, MAX_PATH, "%s\\defrag.flp", WL_BENCH_DIR);
+
+    if (GEN_fragment(image, scattered) == 0 && WL_measure(scattered, &layout) == 0)
+    {
+        BENCH_report(csv, "scattered", 75, true, 0.0, &layout);
+
+        // The tool exits with zero even when it fails, so only a fresh output counts
+        DeleteFileA(defragmented);
+
+        sprintf_s(command, sizeof(command), "\"%s\" -i %s -o %s -d%s", tool, scattered, defragmented, WL_QUIET);
+        bool passed = (BENCH_time(command, &seconds) == 0);
+        passed = (WL_measure(defragmented, &layout) == 0) && passed;
+
+        BENCH_report(csv, "defrag", 75, passed, seconds, &layout);
+    }
+
+    return fclose(csv) ? -4 : 0;
+}
+
+
+void printUsage(char *lpExeName)
+{
+/**
+ * OPTIONS
+ *   -w <path>  Changes the working directory.
+ *   -r <seed>  Seeds the random generator.
+ *   -n <runs>  Sets the number of runs per benchmark step.
+ */
+
+    printf("\nUSAGE: %s <options> <generator> <arguments>\n", lpExeName);
+    printf("\nEXAMPLE: %s -r 7 tree set 3 4 20\n", lpExeName);
+
+#define OPTION_EXT(arg0, arg1, text) \
+    printf("  %-2s %-8s %s\n", arg0, arg1, text)
+
+#define OPTION(arg0, text) \
+    printf("  %-11s %s\n", arg0, text)
+
+    // Options
+    printf("\nOPTIONS\n");
+    OPTION_EXT("-w", "<path>", "Changes the working directory.");
+    OPTION_EXT("-r", "<seed>", "Seeds the random generator; the same seed gives the same set.");
+    OPTION_EXT("-n", "<runs>", "Runs every benchmark step this many times and keeps the best.");
+
+    // Generators
+    printf("\nGENERATORS\n");
+    OPTION("tiny", "<dir> <count> [size] Many files of at most one cluster.");
+    OPTION("large", "<dir> <count> <size> A few large files.");
+    OPTION("tree", "<dir> <depth> <fanout> <files> Files in every directory of a tree.");
+    OPTION("fill", "<dir> <percent> Mixed sizes up to a share of the disk.");
+    OPTION("fragment", "<image> <output> Scatters every chain of a plain image.");
+    OPTION("bench", "<tool> <csv> Times writefloppy2 over every workload and fill level.");
+}
+
+
+/**
+ * Initializes the program for further operations.
+ * @param argc The number of arguments available.
+ * @param argv The array containing the arguments.
+ * @param first Receives the index of the generator name.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int initialize(int argc, char **argv, int *first)
+{
+    int i;
+
+    if (argc < 3)
+    {
+        printUsage(argv[0]);
+        return -1;
+    }
+
+    // First set all the settings to their defaults
+    setDefaults();
+
+    // The options come before the generator
+    for (i = 1; i < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            CWARN("Argument %s has no value specified.", argv[i]);
+            return -2;
+        }
+
+        if (argv[i][1] == 'w')          strncpy_s(g_workingDirectory, MAX_PATH, argv[i + 1], _TRUNCATE);
+        else if (argv[i][1] == 'r')     g_seed = static_cast<uint32_t>(strtoul(argv[i + 1], NULL, 0));
+        else if (argv[i][1] == 'n')     g_runs = atoi(argv[i + 1]);
+        else
+        {
+            CWARN("Uknown argument '%s'", argv[i]);
+            return -2;
+        }
+    }
+
+    // Zero would stop the generator for good
+    g_seed = g_seed ? g_seed : WL_DEFAULT_SEED;
+    g_runs = (g_runs > 0) ? g_runs : 1;
+
+    if (g_workingDirectory[0] != '\0' && !SetCurrentDirectoryA(g_workingDirectory))
+    {
+        CERROR("Could not change the working directory to '%s'. (%i)", g_workingDirectory, GetLastError());
+        return -3;
+    }
+
+    *first = i;
+    return (i < argc) ? 0 : -4;
+}
+
+
+int main(int argc, char **argv)
+{
+    int first, result;
+
+    if (initialize(argc, argv, &first))
+    {
+        return EXIT_FAILURE;
+    }
+
+    const char *name = argv[first];
+    char **args = argv + first + 1;
+    int count = argc - first - 1;
+
+#define NEEDS(n) \
+    if (count < (n)) { CERROR("The %s generator needs %i arguments.", name, (n)); return EXIT_FAILURE; }
+
+    if (!strcmp(name, "tiny"))
+    {
+        NEEDS(2);
+        result = GEN_tiny(args[0], atoi(args[1]), (count > 2) ? strtoul(args[2], NULL, 0) : 0);
+    }
+    else if (!strcmp(name, "large"))
+    {
+        NEEDS(3);
+        result = GEN_large(args[0], atoi(args[1]), strtoul(args[2], NULL, 0));
+    }
+    else if (!strcmp(name, "tree"))
+    {
+        NEEDS(4);
+        result = GEN_tree(args[0], atoi(args[1]), atoi(args[2]), atoi(args[3]), WL_MAX_FILE);
+    }
+    else if (!strcmp(name, "fill"))
+    {
+        NEEDS(2);
+        result = GEN_fill(args[0], atoi(args[1]));
+    }
+    else if (!strcmp(name, "fragment"))
+    {
+        NEEDS(2);
+        result = GEN_fragment(args[0], args[1]);
+    }
+    else if (!strcmp(name, "bench"))
+    {
+        NEEDS(2);
+        result = BENCH_run(args[0], args[1]);
+    }
+    else
+    {
+        CERROR("Unknown generator '%s'.", name);
+        return EXIT_FAILURE;
+    }
+
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
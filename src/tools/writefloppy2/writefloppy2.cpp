@@ -16,7 +16,10 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <future>
 #include <queue>
+#include <string>
+#include <vector>
 
 #define WIN32_LEAN_AND_MEAN 1
 #include <Windows.h>
@@ -28,10 +31,10 @@ typedef unsigned long long int qword;
 
 const bool VERBOSE = false;
 
-#define CINFO(fmt, ...)     fprintf(stdout, fmt"\n", ##__VA_ARGS__)
-#define CWARN(fmt, ...)     fprintf(stdout, "WARNING: "fmt"\n", ##__VA_ARGS__)
+#define CINFO(fmt, ...)     fprintf(g_console, fmt"\n", ##__VA_ARGS__)
+#define CWARN(fmt, ...)     fprintf(g_console, "WARNING: "fmt"\n", ##__VA_ARGS__)
 #define CERROR(fmt, ...)    fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
-#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(stdout, "[VERBOSE] "fmt"\n", ##__VA_ARGS__); }
+#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(g_console, "[VERBOSE] "fmt"\n", ##__VA_ARGS__); }
 #define CASSERT(ex, fmt, ...) \
     if (!(ex)) { \
         fprintf(stderr, "ASSERTION FAILURE\n\t%s @ %i\n\t"#ex"\n\t"fmt"\n", __FILE__, __LINE__, ##__VA_ARGS__); \
@@ -39,27 +42,13 @@ const bool VERBOSE = false;
     }
 
 #include "settings.inc"
-
-
-/**
- * DIRECTORY
- *   Defines a single directory object.
- */
-typedef struct Entry
-{
-    char            name[8];            /* The name of the entry */
-    char            extension[3];       /* The extension of the entry */
-    unsigned char   attributes;         /* The attributes of the entry */
-    char            reserved[2];        /* Reserved for future use */
-    short           creationTime;       /* Time at which the entry was created */
-    short           creationDate;       /* Date at which the entry was created */
-    short           lastAccessDate;     /* Date at which the entry was last accessed */
-    char            ignore[2];          /* Ignore for FAT12 */
-    short           lastWriteTime;      /* Time at which the last write occured */
-    short           lastWriteDate;      /* Date at which the last write occured */
-    short           firstLogicalSector; /* First logical sector of the entry */
-    int             size;               /* The size of the entry */
-} entry_t;
+#include "../common/layout.hpp"
+#include "../common/output.hpp"
+#include "../common/container.hpp"
+#include "../common/store.hpp"
+#include "../common/vdisk.hpp"
+#include "../common/volume.hpp"
+#include "../common/rawimage.hpp"
 
 
 // FAT entry types for next sector
@@ -92,6 +81,20 @@ typedef struct Entry
 char g_data[DEVICE_SIZE];
 
 
+/**
+ * LAZY LOADING
+ *   A plain input image is not read as a whole. The boot sector, FATs and
+ *   root directory are loaded up front; a data cluster is read from the
+ *   source the first time FAT_getDataPtr hands it out. When the output
+ *   replaces the input, only the sectors that changed are written back.
+ */
+FILE *g_source;                     /* The input image while clusters are loaded on demand */
+bool g_resident[DATA_CLUSTERS + 2]; /* The cluster is valid in g_data */
+bool g_known[DATA_CLUSTERS + 2];    /* The cluster is valid in g_pristine */
+char g_pristine[DEVICE_SIZE];       /* The loaded sectors as they are in the source */
+int g_faults;                       /* The number of clusters read from the source */
+
+
 /**
  * FAT TABLE
  *   Points to the first FAT table within the image data.
@@ -113,11 +116,24 @@ char *fat_data;
 char g_bootSector[MAX_PATH];        /* The filename of the boot sector file */
 char g_workingDirectory[MAX_PATH];  /* The path to the working directory */
 char g_pathOut[MAX_PATH];           /* The filename of the output file */
+bool g_outputGiven;                 /* The output file was set explicitly */
 char g_pathIn[MAX_PATH];            /* The filename of the input file */
+char g_pathTree[MAX_PATH];          /* The host directory to import */
+FILE *g_console = stdout;           /* Receives the progress messages */
 bool g_strip;                       /* Strip the input volume of unnecessary data */
 bool g_format;                      /* Formats the input volume, except the boot sector */
 bool g_defragment;                  /* Defragments the input volume */
+bool g_compress;                    /* Writes the output as a compressed container */
+bool g_store;                       /* Writes the output as a recipe into a store */
+bool g_watch;                       /* Keeps running and patches changed inputs */
+bool g_trim;                        /* Ends the output after the last used sector */
+bool g_pad;                         /* Accepts input images shorter than the device */
+bool g_vhd;                         /* Writes the output as a dynamic VHD */
+bool g_vdi;                         /* Writes the output as a dynamic VDI */
+bool g_inPlace;                     /* The output replaces the input; only changes are written */
 std::queue<char*> g_queue;          /* All the input file names */
+std::vector<char*> g_watched;       /* The input files that are watched for changes */
+std::vector<int> g_reserved;        /* The bytes reserved for each watched file */
 
 
 #define FILE_BUFFER_SIZE  0x11000      /* Increase if necessary */
@@ -132,9 +148,22 @@ char g_bufferFileData[FILE_BUFFER_SIZE];    /* Allocations exceeed max */
 int OP_strip(void);
 int OP_format(void);
 int OP_defragment(void);
-int OP_addFile(FILE *file, const char *path);
+int OP_addFile(FILE *file, const char *path, int reserve);
+int OP_parseReservation(char *spec, int *reserve);
 int OP_searchFile(const char * name, void ** dest);
 int OP_convertToFileName(const char * in, char name[8], char ext[3]);
+const char * OP_baseName(const char *path);
+int OP_watch(void);
+int OP_importTree(const char *path);
+int configure(int argc, char **argv);
+bool CMD_isCommand(const char *name);
+int CMD_run(int argc, char **argv);
+size_t FAT_usedLength(void);
+void FAT_usedSectors(std::vector<bool> &used);
+void FAT_setResident(void);
+void FAT_loadRemaining(void);
+int FAT_release(void);
+int FAT_saveInPlace(void);
 
 
 /**
@@ -146,17 +175,30 @@ void setDefaults(void)
     memset(g_bootSector, 0, MAX_PATH);
     memset(g_workingDirectory, 0, MAX_PATH);
     memset(g_pathIn, 0, MAX_PATH);
+    memset(g_pathTree, 0, MAX_PATH);
 
     // The output path always needs a default name
     strncpy_s(g_pathOut, MAX_PATH, "default.flp", _TRUNCATE);
+    g_outputGiven = false;
 
     // Boolean settings
     g_strip = false;
     g_format = false;
     g_defragment = false;
-
-    // Clear the buffer
+    g_compress = false;
+    g_store = false;
+    g_watch = false;
+    g_trim = false;
+    g_pad = false;
+    g_vhd = false;
+    g_vdi = false;
+    g_inPlace = false;
+
+    // Clear the buffer; without an input every cluster is already resident
     memset(g_data, 0, DEVICE_SIZE);
+    g_source = NULL;
+    g_faults = 0;
+    FAT_setResident();
 
     // FAT references within the data buffer
     fat_table = (g_data + BYTES_PER_CLUSTER);
@@ -183,7 +225,32 @@ bool procArguments(int argc, char **argv)
         {
             arg = (argv[i] + 1);
 
-            if (arg[0] == 'b')
+            if (!strcmp(arg, "-watch"))
+            {
+                g_watch = true;
+                CVERBOSE("Watch mode is enabled.");
+            }
+            else if (!strcmp(arg, "-trim"))
+            {
+                g_trim = true;
+                CVERBOSE("Trimmed output is enabled.");
+            }
+            else if (!strcmp(arg, "-pad"))
+            {
+                g_pad = true;
+                CVERBOSE("Short input images are padded.");
+            }
+            else if (!strcmp(arg, "-vhd"))
+            {
+                g_vhd = true;
+                CVERBOSE("Dynamic VHD output is enabled.");
+            }
+            else if (!strcmp(arg, "-vdi"))
+            {
+                g_vdi = true;
+                CVERBOSE("Dynamic VDI output is enabled.");
+            }
+            else if (arg[0] == 'b')
             {
                 VALUE_CHECK("-b");
                 strncpy_s(g_bootSector, MAX_PATH, argv[i], _TRUNCATE);
@@ -199,7 +266,14 @@ bool procArguments(int argc, char **argv)
             {
                 VALUE_CHECK("-o");
                 strncpy_s(g_pathOut, MAX_PATH, argv[i], _TRUNCATE);
+                g_outputGiven = true;
                 CVERBOSE("Set output file to '%s'", g_pathOut);
+
+                // The image takes the standard output; keep it clean
+                if (OUTPUT_isStdout(g_pathOut))
+                {
+                    g_console = stderr;
+                }
             }
             else if (arg[0] == 'i')
             {
@@ -207,6 +281,12 @@ bool procArguments(int argc, char **argv)
                 strncpy_s(g_pathIn, MAX_PATH, argv[i], _TRUNCATE);
                 CVERBOSE("Set input file to '%s'", g_pathIn);
             }
+            else if (arg[0] == 't')
+            {
+                VALUE_CHECK("-t");
+                strncpy_s(g_pathTree, MAX_PATH, argv[i], _TRUNCATE);
+                CVERBOSE("Set import directory to '%s'", g_pathTree);
+            }
             else if (arg[0] == 's')
             {
                 g_strip = true;
@@ -222,6 +302,16 @@ bool procArguments(int argc, char **argv)
                 g_format = true;
                 CVERBOSE("Formatting mode is enabled.");
             }
+            else if (arg[0] == 'z')
+            {
+                g_compress = true;
+                CVERBOSE("Compressed output is enabled.");
+            }
+            else if (arg[0] == 'k')
+            {
+                g_store = true;
+                CVERBOSE("Store output is enabled.");
+            }
             else
             {
                 // Always assume errouness operations occur when the input is
@@ -271,21 +361,48 @@ void printUsage(char *lpExeName)
     // Options
     printf("\nOPTIONS\n");
     OPTION_EXT("-w", "<path>", "Changes the working directory.");
-    OPTION_EXT("-o", "<path>", "Changes the output file.");
-    OPTION_EXT("-i", "<path>", "Use an existing FAT12 converted 1.44MB floppy image.");
+    OPTION_EXT("-o", "<path>", "Changes the output file; use - for the standard output.");
+    OPTION_EXT("-i", "<path>", "Use an existing FAT12 converted 1.44MB floppy image; plain, compressed or a recipe.");
+    OPTION_EXT("", "", "A plain image that is also the output is updated in place.");
     OPTION_EXT("-b", "<path>", "Override the bootsector with the specified file. (File must be exactly 512-bytes.)");
+    OPTION_EXT("-t", "<path>", "Imports the host directory tree, including subdirectories, into the root.");
     OPTION("-s", "Requires -i. Strips the volume of unused data, like long filenames.");
-    OPTION("-d", "Requires -i. Defragments the volume.");
+    OPTION("-d", "Requires -i. Defragments the volume; all files are moved to the front.");
     OPTION("-f", "Requires -i. Formats the volume, but keeps the bootsector as is.");
+    OPTION("-z", "Writes the output as a compressed container.");
+    OPTION("-k", "Writes the output as a recipe; its directory holds the deduplicated sectors.");
+    OPTION("--watch", "Keeps running and patches the image whenever an input file changes.");
+    OPTION("--trim", "Ends the output after the last used sector; combine with -d to compact first.");
+    OPTION("--pad", "Requires -i. Accepts a trimmed image and pads it to the full device size.");
+    OPTION("--vhd", "Writes the output as a dynamic VHD; only blocks holding data are allocated.");
+    OPTION("--vdi", "Writes the output as a dynamic VDI; only blocks holding data are allocated.");
+    OPTION_EXT("", "", "Both attach as a hard disk and do not boot; use them to mount the volume elsewhere.");
 
 #define ATTRIBUTE(arg0, text) \
     printf("  %-3s %s\n", arg0, text)
 
+    // Commands
+    printf("\nCOMMANDS\n");
+    printf("  %s <command> <arguments> [then <command> <arguments> ...]\n", lpExeName);
+    printf("  The commands share one volume, which is loaded and saved only once.\n");
+    OPTION("build", "Takes the options and files above; saves at the end when -o is given.");
+    OPTION("raw", "-o <path> [-w <path>] [--trim] files; writes an unformatted image.");
+    OPTION("inspect", "Lists every file and directory of the volume.");
+    OPTION("stats", "Summarizes the use and fragmentation of the volume.");
+    OPTION("verify", "Checks the FATs, cluster chains and directories; fails on errors.");
+    OPTION("diff", "<path> Compares the volume with another image.");
+    OPTION("extract", "<name> <path> Copies a file of the volume to the host.");
+
     // Attributes
     printf("\nFILE ATTRIBUTES\n");
     ATTRIBUTE("H", "Hidden");
     ATTRIBUTE("R", "Read-Only");
     ATTRIBUTE("S", "System");
+
+    // Reservations
+    printf("\nRESERVATIONS\n");
+    printf("  Append :<size>[K] to a file to reserve contiguous space for it to grow into,\n");
+    printf("  e.g. NOTES.TXT:32K. The file need not exist; it is then created empty.\n");
 }
 
 
@@ -297,24 +414,36 @@ void printUsage(char *lpExeName)
  */
 int initialize(int argc, char **argv)
 {
-    CINFO("Initializing...");
-
     if (argc < 3)
     {
         printUsage(argv[0]);
         return -1;
     }
 
+    return configure(argc - 1, argv + 1);
+}
+
+
+/**
+ * Applies the user arguments on top of the default settings.
+ * @param argc The number of arguments, excluding the program name.
+ * @param argv The array containing the arguments.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int configure(int argc, char **argv)
+{
     // First set all the settings to their defaults
     setDefaults();
 
     // Process all the user arguments
-    if (!procArguments(argc - 1, argv + 1))
+    if (!procArguments(argc, argv))
     {
         //CERROR("Could not process the passed arguments.");
         return -2;
     }
 
+    CINFO("Initializing...");
+
     // Change the working directory if specified
     if (g_workingDirectory[0] != '\0')
     {
@@ -331,6 +460,18 @@ int initialize(int argc, char **argv)
     // Mutually exclusive settings
     CASSERT(!g_format || (g_format && !(g_strip || g_defragment)),
         "Conflicting settings detected; format is mutually exclusive with stripping and/or defragmentation.");
+    CASSERT(!(g_compress && g_store),
+        "Conflicting settings detected; compressed output is mutually exclusive with store output.");
+    CASSERT(!g_watch || !(g_compress || g_store || OUTPUT_isStdout(g_pathOut)),
+        "Conflicting settings detected; watch mode requires a plain output file.");
+    CASSERT(!g_trim || !(g_compress || g_store || g_watch),
+        "Conflicting settings detected; trimmed output requires a plain output file.");
+    CASSERT(!(g_vhd || g_vdi) || (!(g_vhd && g_vdi) && !(g_compress || g_store || g_watch || g_trim)),
+        "Conflicting settings detected; virtual disk output is mutually exclusive with other output formats.");
+
+    // Rewriting the input as is only has to write what changed
+    g_inPlace = (g_pathIn[0] != '\0') && !_stricmp(g_pathIn, g_pathOut) &&
+        !(g_compress || g_store || g_vhd || g_vdi || g_trim || g_pad || g_watch);
 
     return 0;
 }
@@ -414,27 +555,31 @@ int FAT_proc(void)
  */
 int FAT_verify(void)
 {
+    BPB_t bpb;
+
     CVERBOSE("Verifying FAT boot sector...");
 
+    BPB_decode(reinterpret_cast<byte *>(g_data), &bpb);
+
     // Skip the OEM
-    if (*(reinterpret_cast<word *>(g_data + 11)) != BYTES_PER_SECTOR)        return -1;
-    if (*(reinterpret_cast<byte *>(g_data + 13)) != SECTORS_PER_CLUSTER)     return -2;
-    if (*(reinterpret_cast<word *>(g_data + 14)) != RESERVED_CLUSTERS)       return -3;
-    if (*(reinterpret_cast<byte *>(g_data + 16)) != NUMBER_OF_FAT)           return -4;
-    if (*(reinterpret_cast<word *>(g_data + 17)) != MAX_ROOT_DIRECTORIES)    return -5;
-    if (*(reinterpret_cast<word *>(g_data + 19)) != TOTAL_SECTORS_FAT16)     return -6;
-    if (*(reinterpret_cast<byte *>(g_data + 21)) != DEVICE_TYPE)             return -7;
-    if (*(reinterpret_cast<word *>(g_data + 22)) != SECTORS_PER_FAT)         return -8;
-    if (*(reinterpret_cast<word *>(g_data + 24)) != SECTORS_PER_TRACK)       return -9;
-    if (*(reinterpret_cast<word *>(g_data + 26)) != NUMBER_OF_HEADS)         return -10;
-    if (*(reinterpret_cast<dword*>(g_data + 28)) != NUMBER_OF_HIDDEN_SEC)    return -11;
-    if (*(reinterpret_cast<dword*>(g_data + 32)) != TOTAL_SECTORS_FAT32)     return -12;
-    if (*(reinterpret_cast<byte *>(g_data + 36)) != PHYSICAL_DRIVE_NUM)      return -13;
-    if (*(reinterpret_cast<byte *>(g_data + 37)) != RESERVED_VALUE)          return -14;
-    if (*(reinterpret_cast<byte *>(g_data + 38)) != BOOT_SIGNATURE)          return -15;
+    if (bpb.bytesPerSector != BYTES_PER_SECTOR)         return -1;
+    if (bpb.sectorsPerCluster != SECTORS_PER_CLUSTER)   return -2;
+    if (bpb.reservedSectors != RESERVED_CLUSTERS)       return -3;
+    if (bpb.numberOfFats != NUMBER_OF_FAT)              return -4;
+    if (bpb.maxRootEntries != MAX_ROOT_DIRECTORIES)     return -5;
+    if (bpb.smallSectors != TOTAL_SECTORS_FAT16)        return -6;
+    if (bpb.mediaDescriptor != DEVICE_TYPE)             return -7;
+    if (bpb.sectorsPerFat != SECTORS_PER_FAT)           return -8;
+    if (bpb.sectorsPerTrack != SECTORS_PER_TRACK)       return -9;
+    if (bpb.numberOfHeads != NUMBER_OF_HEADS)           return -10;
+    if (bpb.hiddenSectors != NUMBER_OF_HIDDEN_SEC)      return -11;
+    if (bpb.largeSectors != TOTAL_SECTORS_FAT32)        return -12;
+    if (bpb.driveNo != PHYSICAL_DRIVE_NUM)              return -13;
+    if (bpb.reserved != RESERVED_VALUE)                 return -14;
+    if (bpb.bootSignature != BOOT_SIGNATURE)            return -15;
     // Skip volume id
-    if (memcmp("NO NAME    ", (g_data + 43), 11))   return -16;
-    if (memcmp("FAT12   ", (g_data + 54), 8))       return -17;
+    if (memcmp("NO NAME    ", bpb.volumeLabel, 11))     return -16;
+    if (memcmp("FAT12   ", bpb.fileSystemType, 8))      return -17;
 
     return 0;
 }
@@ -449,16 +594,70 @@ int FAT_load(FILE *file)
 {
     int result;
     size_t read;
+    byte magic[4];
 
-    // Read the entire file
-    read = fread(g_data, 1, DEVICE_SIZE, file);
+    // Compressed containers are recognized by their magic
+    read = fread(magic, 1, sizeof(magic), file);
     CASSERT(ferror(file) == 0, "An error occured whilst reading data.");
+    rewind(file);
 
-    // Ensure the entire file was read
-    if (read != DEVICE_SIZE)
+    if (STORE_detect(magic, read))
     {
-        CERROR("Could not read entire file. File exceeds the maximum size.");
-        return -3;
+        CINFO("Materializing image from recipe...");
+
+        result = STORE_readRecipe(file, g_pathIn, reinterpret_cast<byte *>(g_data), DEVICE_SIZE);
+        if (result)
+        {
+            CERROR("Could not materialize the image. (%i)", result);
+            return -6;
+        }
+    }
+    else if (CIMG_detect(magic, read))
+    {
+        CINFO("Decompressing image file...");
+
+        result = CIMG_read(file, reinterpret_cast<byte *>(g_data), DEVICE_SIZE);
+        if (result)
+        {
+            CERROR("Could not decompress the image. (%i)", result);
+            return -5;
+        }
+    }
+    else
+    {
+        long size;
+
+        if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET))
+        {
+            CERROR("Could not determine the size of the image.");
+            return -3;
+        }
+
+        // A trimmed image is zero-padded, which requires the metadata to be
+        // complete; the missing clusters read as zero when loaded.
+        if (size != DEVICE_SIZE)
+        {
+            if (!g_pad || size > DEVICE_SIZE || size < (METADATA_SECTORS * BYTES_PER_SECTOR))
+            {
+                CERROR("Could not read entire file. File exceeds the maximum size.");
+                return -3;
+            }
+
+            CINFO("Padding image from %li to %i bytes.", size, DEVICE_SIZE);
+        }
+
+        // Only the metadata is read now; data clusters follow on demand
+        read = fread(g_data, 1, METADATA_SECTORS * BYTES_PER_SECTOR, file);
+        CASSERT(ferror(file) == 0, "An error occured whilst reading data.");
+
+        if (read != METADATA_SECTORS * BYTES_PER_SECTOR)
+        {
+            return -3;
+        }
+
+        memcpy(g_pristine, g_data, read);
+        memset(g_resident, false, sizeof(g_resident));
+        g_source = file;
     }
 
     // FATs generally contain two tables, we can verify the first with the
@@ -513,13 +712,32 @@ int FAT_save(FILE *file)
 {
     size_t written;
 
+    if (g_compress)
+    {
+        CINFO("Writing compressed image file...");
+        return CIMG_write(file, reinterpret_cast<byte *>(g_data), DEVICE_SIZE, BYTES_PER_SECTOR * SECTORS_PER_TRACK);
+    }
+
+    if (g_vhd || g_vdi)
+    {
+        std::vector<bool> used;
+        FAT_usedSectors(used);
+
+        CINFO("Writing %s virtual disk...", g_vhd ? "VHD" : "VDI");
+        return g_vhd ? VHD_write(file, reinterpret_cast<byte *>(g_data), DEVICE_SIZE, used)
+                     : VDI_write(file, reinterpret_cast<byte *>(g_data), DEVICE_SIZE, used);
+    }
+
+    // The boot sector keeps describing the full device
+    size_t length = g_trim ? FAT_usedLength() : DEVICE_SIZE;
+
     CINFO("Writing image file...");
 
-    written = fwrite(g_data, 1, DEVICE_SIZE, file);
+    written = fwrite(g_data, 1, length, file);
     CASSERT(ferror(file) == 0, "An error occured whilst writing to '%s'", g_pathOut);
 
     // Ensure the entire file was written
-    if (written != DEVICE_SIZE)
+    if (written != length)
     {
         return -1;
     }
@@ -529,92 +747,175 @@ int FAT_save(FILE *file)
 
 
 /**
- * Main program entry point.
- * @param argc The number of arguments passed to the application.
- * @param argv The array containing the passed arguments.
+ * Loads the input image, if any, and adds the host tree and files to it.
  * @return Zero if successful; otherwise, a non-zero value.
  */
-int main(int argc, char **argv)
+int buildVolume(void)
 {
     FILE *lpFile;
     errno_t err;
     int result;
 
-    // Initialize all the values and settings based on defaults and user input
-    if (initialize(argc, argv))
-    {
-        //CERROR("Failed to initialize application.");
-        return 0;
-    }
-
     // Should we load an existing file
     if (g_pathIn[0] != '\0')
     {
-        err = fopen_s(&lpFile, g_pathIn, "rb");
+        err = fopen_s(&lpFile, g_pathIn, g_inPlace ? "r+b" : "rb");
         if (err)
         {
             CERROR("Could not open input file '%s' for reading. (%d)", g_pathIn, err);
-            return 0;
+            return -1;
         }
 
+        // A lazily loaded image stays open as the source of its clusters
         result = FAT_load(lpFile);
-        fclose(lpFile);
+        if (lpFile != g_source)
+        {
+            fclose(lpFile);
+        }
 
         if (result)
         {
             CERROR("Could not load FAT12 image. (%i)", result);
-            return 0;
+            return -2;
         }
     }
 
-    int file_index = 0;
+    // Import the host tree before the individual files
+    if (g_pathTree[0] != '\0')
+    {
+        result = OP_importTree(g_pathTree);
+        if (result)
+        {
+            CERROR("Could not import directory '%s'. (%i)", g_pathTree, result);
+            return -3;
+        }
+    }
 
     // Add all the individual files
     while (!g_queue.empty())
     {
         char *filename = g_queue.front();
+        int reserve;
 
-        // Need a lot of dummy files
-        //int max = (file_index > 0) ? 12 : 1;
-        //for (int i = 0; i < max; i++) {
+        // Strip the reservation, if any, from the file name
+        if (OP_parseReservation(filename, &reserve))
+        {
+            CERROR("Invalid reservation for '%s'.", filename);
+            return -4;
+        }
 
-            err = fopen_s(&lpFile, filename, "rb");
-            if (err)
-            {
-                CERROR("Could not open file '%s' for reading. (%d)", filename, err);
-                return 0;
-            }
+        err = fopen_s(&lpFile, filename, "rb");
+        if (err && !reserve)
+        {
+            CERROR("Could not open file '%s' for reading. (%d)", filename, err);
+            return -5;
+        }
 
-            result = OP_addFile(lpFile, filename);
+        // A reserved file that does not exist yet is created empty
+        result = OP_addFile(err ? NULL : lpFile, filename, reserve);
+        if (!err)
+        {
             fclose(lpFile);
+        }
 
-            if (result)
-            {
-                CERROR("Could not add file '%s'. (%i)", filename, result);
-                return 0;
-            }
-        //}
-        //file_index++;
+        if (result)
+        {
+            CERROR("Could not add file '%s'. (%i)", filename, result);
+            return -6;
+        }
 
+        g_watched.push_back(filename);
+        g_reserved.push_back(reserve);
         g_queue.pop();
     }
 
+    return 0;
+}
+
+
+/**
+ * Writes the volume to the output and, in watch mode, keeps it up to date.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int saveVolume(void)
+{
+    FILE *lpFile;
+    errno_t err;
+    int result;
+
+    // Write back only the sectors that changed
+    if (g_inPlace && g_source)
+    {
+        result = FAT_saveInPlace();
+        if (result)
+        {
+            CERROR("Could not update FAT12 image in place. (%i)", result);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    // Every other output covers the whole device
+    FAT_loadRemaining();
+    if (FAT_release())
+    {
+        CERROR("Could not close input file '%s'.", g_pathIn);
+        return -2;
+    }
+
+    // Save the data as a recipe; only sectors new to the store are written.
+    if (g_store)
+    {
+        size_t added;
+
+        if (OUTPUT_isStdout(g_pathOut))
+        {
+            CERROR("A recipe cannot be written to the standard output.");
+            return -3;
+        }
+
+        result = STORE_writeRecipe(g_pathOut, reinterpret_cast<byte *>(g_data), DEVICE_SIZE, &added);
+        if (result)
+        {
+            CERROR("Could not store FAT12 image. (%i)", result);
+            return -4;
+        }
+
+        CINFO("Stored recipe '%s'; %zu new sectors.", g_pathOut, added);
+    }
+
     // Save the data as a FAT12 image.
+    else
     {
-        err = fopen_s(&lpFile, g_pathOut, "wb");
+        err = OUTPUT_open(&lpFile, g_pathOut);
         if (err)
         {
             CERROR("Could not open output file '%s' for writing. (%d)", g_pathOut, err);
-            return 0;
+            return -5;
         }
 
         result = FAT_save(lpFile);
-        fclose(lpFile);
+        if (OUTPUT_close(lpFile) && !result)
+        {
+            result = -2;
+        }
 
         if (result)
         {
             CERROR("Could not save FAT12 image. (%i)", result);
-            return 0;
+            return -6;
+        }
+    }
+
+    // Keep the volume resident and patch it on every change
+    if (g_watch)
+    {
+        result = OP_watch();
+        if (result)
+        {
+            CERROR("Watching stopped. (%i)", result);
+            return -7;
         }
     }
 
@@ -623,29 +924,41 @@ int main(int argc, char **argv)
 
 
 /**
- * Gets the entry in the FAT table at the specified index.
+ * Main program entry point.
+ * @param argc The number of arguments passed to the application.
+ * @param argv The array containing the passed arguments.
+ * @return Zero if successful; otherwise, a non-zero value.
  */
-int FAT_getEntry(int index)
+int main(int argc, char **argv)
 {
-    int value;
-    char *target = (fat_table + ((index * 3) / 2));
-    char b0 = *(target + 0);
-    char b1 = *(target + 1);
+    // A leading command word selects the chained command mode
+    if (argc > 1 && CMD_isCommand(argv[1]))
+    {
+        return CMD_run(argc - 1, argv + 1);
+    }
 
-    if (index & 1)
+    // Initialize all the values and settings based on defaults and user input
+    if (initialize(argc, argv))
     {
-        value = 
-            ((b0 >> 4) & 0x00F) |
-            ((b1 << 4) & 0xFF0);
+        //CERROR("Failed to initialize application.");
+        return 0;
     }
-    else
+
+    if (buildVolume() == 0)
     {
-        value =
-            ((b0 << 0) & 0x0FF) |
-            ((b1 << 8) & 0xF00);
+        saveVolume();
     }
 
-    return value;
+    return 0;
+}
+
+
+/**
+ * Gets the entry in the FAT table at the specified index.
+ */
+int FAT_getEntry(int index)
+{
+    return FAT12_getEntry(reinterpret_cast<byte *>(fat_table), index);
 }
 
 
@@ -659,111 +972,369 @@ void FAT_setEntry(int index, int value)
     // Backup tables also have to be set
     for (int i = 0; i < NUMBER_OF_FAT; i++)
     {
-        char *target = (fat_table + (FAT_SIZE * i) + ((index * 3) / 2));
-        char *b0 = (target + 0);
-        char *b1 = (target + 1);
-
-        if (index & 1)
-        {
-            *b0 = ((value << 4) & 0xF0) | (*b0 & 0x0F);
-            *b1 = ((value >> 4) & 0xFF);
-        }
-        else
-        {
-            *b0 = ((value >> 0) & 0xFF);
-            *b1 = ((value >> 8) & 0x0F) | (*b1 & 0xF0);
-        }
+        FAT12_setEntry(reinterpret_cast<byte *>(fat_table + (FAT_SIZE * i)), index, static_cast<word>(value));
     }
 }
 
 
 /**
- * Gets a pointer to the data based on the index from the FAT table.
+ * Gets the offset of a cluster within the image data.
  * @param entryIndex The entry index from the FAT table.
- * @return A pointer to the data of the entry.
+ * @return The offset in bytes.
  */
-char * FAT_getDataPtr(int entryIndex)
+size_t FAT_getOffset(int entryIndex)
 {
-    CASSERT(entryIndex >= 0x000 && entryIndex < 0xFF0, "entryIndex = 0x%03X", entryIndex);
-    int offset = ((33 + entryIndex - 2) * BYTES_PER_CLUSTER);
-    return (g_data + offset);
+    return (METADATA_SECTORS * BYTES_PER_SECTOR) + ((entryIndex - 2) * BYTES_PER_CLUSTER);
 }
 
 
 /**
- * Searches for the first available cluster on the volume.
- * @param logicalCluster The logical cluster value.
- * @return Zero if successful; otherwise, a non-zero value.
+ * Reads a run of clusters from the source image. Clusters past the end of a
+ * trimmed image read as zero.
+ * @param first The first cluster of the run.
+ * @param count The number of clusters in the run.
  */
-int FAT_findEmptyCluster(short *logicalCluster)
+void FAT_loadClusters(int first, int count)
 {
-    short maxDataClusters = (DATA_SIZE / BYTES_PER_CLUSTER);
+    size_t offset = FAT_getOffset(first);
+    size_t length = count * BYTES_PER_CLUSTER;
+    size_t read = 0;
 
-    for (short i = 0; i < maxDataClusters; i++)
+    if (!fseek(g_source, static_cast<long>(offset), SEEK_SET))
     {
-        int index = FAT_getEntry(i);
-        if (index == 0)
-        {
-            *logicalCluster = i;
-            return 0;
-        }
+        read = fread(g_data + offset, 1, length, g_source);
     }
+    CASSERT(ferror(g_source) == 0, "An error occured whilst reading data.");
 
-    return -1;
+    memset(g_data + offset + read, 0, length - read);
+    memcpy(g_pristine + offset, g_data + offset, length);
+
+    for (int i = first; i < first + count; i++)
+    {
+        g_resident[i] = true;
+        g_known[i] = true;
+    }
+
+    g_faults += count;
 }
 
 
 /**
- * Creates an entry in the FAT table. (DOES NOT ASSIGN A LOGICAL SECTOR!)
- * @param entryIndex The index of the newly created entry.
- * @param name The name to use for the entry.
- * @param ext The extension to use for the entry.
- * @param attribs The attributes for the entry. (aka ARCHIVE, DIRECTORY, etc.)
- * @param data The data to write.
- * @param size The size of the data.
- * @return Zero if successful; otherwise, a non-zero value.
+ * Reads every cluster that is not resident yet, in as few calls as possible.
  */
-int FAT_createFile(int *entryIndex, char name[8], char ext[3], char attribs, char *data, int size)
+void FAT_loadRemaining(void)
 {
-    int i;
-    char *dir = fat_data;
+    if (!g_source)
+    {
+        return;
+    }
 
-    // Find the first empty index...
-    for (i = 0; i < MAX_ROOT_DIRECTORIES; i++)
+    for (int i = 2; i < DATA_CLUSTERS + 2; )
     {
-        // Only empty and erased can be written to
-        if (dir[0] == FAT_FLAG_EMPTY ||
-            dir[0] == FAT_FLAG_ERASED)
+        int run = 0;
+        while (i + run < DATA_CLUSTERS + 2 && !g_resident[i + run])
         {
-            *entryIndex = i;
-            break;
+            run++;
         }
 
-        dir += 32;
-    }
+        if (run)
+        {
+            FAT_loadClusters(i, run);
+        }
 
-    // There were no empty entries
-    if (i == MAX_ROOT_DIRECTORIES)
-    {
-        return -1;
+        i += run + 1;
     }
+}
 
-    // Determine the number of required clusters
-    int reqClusters = (size / BYTES_PER_CLUSTER);
-    if (size % BYTES_PER_CLUSTER)
-    {
-        // We need an extra cluster
-        reqClusters += 1;
-    }
 
-    int rem = size;
-    short cluster, firstCluster = -1, lastCluster = -1;
+/**
+ * Marks every cluster as resident without reading it; used when the data
+ * area is overwritten as a whole.
+ */
+void FAT_setResident(void)
+{
+    memset(g_resident, true, sizeof(g_resident));
+}
 
-    // Keep looping till we allocated all the clusters
-    for (i = 0; i < reqClusters; i++)
+
+/**
+ * Closes the source image; the clusters that were not loaded are lost.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int FAT_release(void)
+{
+    int result = 0;
+
+    if (g_source)
+    {
+        result = fclose(g_source);
+        g_source = NULL;
+    }
+
+    FAT_setResident();
+    return result;
+}
+
+
+/**
+ * Checks whether a sector differs from the source image.
+ */
+bool FAT_sectorChanged(int sector)
+{
+    if (sector >= METADATA_SECTORS)
+    {
+        int cluster = ((sector - METADATA_SECTORS) / SECTORS_PER_CLUSTER) + 2;
+
+        // Untouched clusters are unchanged; overwritten ones are unknown
+        if (!g_resident[cluster])   return false;
+        if (!g_known[cluster])      return true;
+    }
+
+    size_t offset = sector * BYTES_PER_SECTOR;
+    return memcmp(g_data + offset, g_pristine + offset, BYTES_PER_SECTOR) != 0;
+}
+
+
+/**
+ * Writes the changed sectors back into the source image and closes it.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int FAT_saveInPlace(void)
+{
+    int written = 0;
+    int result = 0;
+
+    for (int i = 0; i < TOTAL_SECTORS_FAT16 && !result; )
+    {
+        int run = 0;
+        while (i + run < TOTAL_SECTORS_FAT16 && FAT_sectorChanged(i + run))
+        {
+            run++;
+        }
+
+        if (run && (fseek(g_source, i * BYTES_PER_SECTOR, SEEK_SET) ||
+            fwrite(g_data + (i * BYTES_PER_SECTOR), BYTES_PER_SECTOR, run, g_source) != static_cast<size_t>(run)))
+        {
+            result = -1;
+        }
+
+        written += run;
+        i += run + 1;
+    }
+
+    CINFO("Updated %i sectors in place; %i clusters were read.", written, g_faults);
+
+    if (FAT_release() && !result)
+    {
+        result = -2;
+    }
+
+    return result;
+}
+
+
+/**
+ * Gets a pointer to the data based on the index from the FAT table.
+ * @param entryIndex The entry index from the FAT table.
+ * @return A pointer to the data of the entry.
+ */
+char * FAT_getDataPtr(int entryIndex)
+{
+    CASSERT(entryIndex >= 0x000 && entryIndex < 0xFF0, "entryIndex = 0x%03X", entryIndex);
+
+    // Data clusters of the input are read on first use
+    if (entryIndex >= 2 && entryIndex < DATA_CLUSTERS + 2 && !g_resident[entryIndex])
+    {
+        FAT_loadClusters(entryIndex, 1);
+    }
+
+    return (g_data + FAT_getOffset(entryIndex));
+}
+
+
+/**
+ * Gets a pointer to a cluster that is about to be overwritten as a whole, so
+ * its previous contents are not read from the source.
+ * @param entryIndex The entry index from the FAT table.
+ * @return A pointer to the data of the entry.
+ */
+char * FAT_getNewDataPtr(int entryIndex)
+{
+    if (entryIndex >= 2 && entryIndex < DATA_CLUSTERS + 2)
+    {
+        g_resident[entryIndex] = true;
+    }
+
+    return FAT_getDataPtr(entryIndex);
+}
+
+
+/**
+ * Searches for the first available cluster on the volume.
+ * @param logicalCluster The logical cluster value.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int FAT_findEmptyCluster(short *logicalCluster)
+{
+    // Clusters 0 and 1 are reserved; data clusters are numbered from 2
+    for (short i = 2; i < DATA_CLUSTERS + 2; i++)
+    {
+        int index = FAT_getEntry(i);
+        if (index == 0)
+        {
+            *logicalCluster = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Searches for the first run of consecutive available clusters.
+ * @param count The number of clusters the run must hold.
+ * @param logicalCluster Receives the first cluster of the run.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int FAT_findEmptyRun(int count, short *logicalCluster)
+{
+    int run = 0;
+
+    for (short i = 2; i < DATA_CLUSTERS + 2; i++)
+    {
+        run = (FAT_getEntry(i) == 0) ? (run + 1) : 0;
+        if (run == count)
+        {
+            *logicalCluster = static_cast<short>(i - count + 1);
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+/**
+ * Gets the length of the image up to and including the last used sector.
+ * @return The length in bytes; at least the boot sector, FATs and root.
+ */
+size_t FAT_usedLength(void)
+{
+    int last = 0;
+
+    // Bad clusters are not data and may be dropped from the end
+    for (int i = 2; i < DATA_CLUSTERS + 2; i++)
+    {
+        int value = FAT_getEntry(i);
+        if (value != 0x000 && value != 0xFF7)
+        {
+            last = i;
+        }
+    }
+
+    if (last == 0)
+    {
+        return METADATA_SECTORS * BYTES_PER_SECTOR;
+    }
+
+    return FAT_getOffset(last) + BYTES_PER_CLUSTER;
+}
+
+
+/**
+ * Gets the sectors holding data according to the FAT; the boot sector, FATs
+ * and root directory always count as used.
+ * @param used Receives one flag per sector of the device.
+ */
+void FAT_usedSectors(std::vector<bool> &used)
+{
+    used.assign(TOTAL_SECTORS_FAT16, false);
+
+    for (int i = 0; i < METADATA_SECTORS; i++)
+    {
+        used[i] = true;
+    }
+
+    for (int i = 2; i < DATA_CLUSTERS + 2; i++)
+    {
+        int value = FAT_getEntry(i);
+        if (value != 0x000 && value != 0xFF7)
+        {
+            size_t sector = FAT_getOffset(i) / BYTES_PER_SECTOR;
+            for (int j = 0; j < SECTORS_PER_CLUSTER; j++)
+            {
+                used[sector + j] = true;
+            }
+        }
+    }
+}
+
+
+/**
+ * Creates an entry in the FAT table. (DOES NOT ASSIGN A LOGICAL SECTOR!)
+ * @param entryIndex The index of the newly created entry.
+ * @param name The name to use for the entry.
+ * @param ext The extension to use for the entry.
+ * @param attribs The attributes for the entry. (aka ARCHIVE, DIRECTORY, etc.)
+ * @param data The data to write.
+ * @param size The size of the data.
+ * @param reserve The number of bytes to allocate contiguously; the file can
+ *                grow into these without fragmenting. Zero for no reservation.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int FAT_createFile(int *entryIndex, char name[8], char ext[3], char attribs, char *data, int size, int reserve)
+{
+    int i;
+    char *dir = fat_data;
+
+    // Find the first empty index...
+    for (i = 0; i < MAX_ROOT_DIRECTORIES; i++)
+    {
+        // Only empty and erased can be written to
+        if (dir[0] == FAT_FLAG_EMPTY ||
+            dir[0] == FAT_FLAG_ERASED)
+        {
+            *entryIndex = i;
+            break;
+        }
+
+        dir += 32;
+    }
+
+    // There were no empty entries
+    if (i == MAX_ROOT_DIRECTORIES)
+    {
+        return -1;
+    }
+
+    // Determine the number of required clusters
+    int allocate = (reserve > size) ? reserve : size;
+    int reqClusters = (allocate / BYTES_PER_CLUSTER);
+    if (allocate % BYTES_PER_CLUSTER)
+    {
+        // We need an extra cluster
+        reqClusters += 1;
+    }
+
+    int rem = size;
+    short cluster, firstCluster = -1, lastCluster = -1, run = -1;
+
+    // A reservation has to be a single run, or growth would fragment anyway
+    if (reserve > 0 && FAT_findEmptyRun(reqClusters, &run))
+    {
+        return -3;
+    }
+
+    // Keep looping till we allocated all the clusters
+    for (i = 0; i < reqClusters; i++)
     {
-        // Find the first empty cluster
-        if (FAT_findEmptyCluster(&cluster))
+        // Take the next cluster of the run, or else the first empty cluster
+        if (run != -1)
+        {
+            cluster = static_cast<short>(run + i);
+        }
+        else if (FAT_findEmptyCluster(&cluster))
         {
             return -2;
         }
@@ -784,22 +1355,24 @@ int FAT_createFile(int *entryIndex, char name[8], char ext[3], char attribs, cha
         // Ensure the file always ends
         FAT_setEntry(cluster, 0xFFF);
 
-        // Get the pointer to the cluster data
-        char *dataCluster = FAT_getDataPtr(cluster);
+        // Get the pointer to the cluster data; all of it is written below
+        char *dataCluster = FAT_getNewDataPtr(cluster);
 
         // Make it fit to all the buffers and write
         int write = (rem >= BYTES_PER_CLUSTER) ? BYTES_PER_CLUSTER : rem;
         memcpy(dataCluster, data, write);
+        memset(dataCluster + write, 0, BYTES_PER_CLUSTER - write);
         data += write;
         rem -= write;
     }
 
     // Store the file information
-    memcpy(dir, name, 8);
-    memcpy(dir + 8, ext, 3);
-    memcpy(dir + 11, &attribs, 1);
-    memcpy(dir + 26, &firstCluster, 2);
-    memcpy(dir + 28, &size, 4);
+    byte *entry = reinterpret_cast<byte *>(dir);
+    setBytes<DIR::Name>(entry, name);
+    setBytes<DIR::Extension>(entry, ext);
+    setField<DIR::Attributes>(entry, static_cast<byte>(attribs));
+    setField<DIR::FirstCluster>(entry, static_cast<word>(firstCluster));
+    setField<DIR::FileSize>(entry, static_cast<dword>(size));
 
     return 0;
 }
@@ -892,7 +1465,7 @@ int OP_stripVar(char *dir, int numEntries)
         // The file entry is a sub-directory
         if (fileEntry[11] & FAT_ATTRIB_SUBDIRECTORY)
         {
-            short sector = *(reinterpret_cast<short*>(fileEntry + 26));
+            word sector = static_cast<word>(getField<DIR::FirstCluster>(reinterpret_cast<byte *>(fileEntry)));
             //int index = FAT_getEntry(sector);
             char *data_p = FAT_getDataPtr(sector);
             result = OP_stripVar(data_p, ENTRIES_PER_DIR);
@@ -926,8 +1499,9 @@ int OP_format(void)
 {
     CVERBOSE("OP: formatting...");
 
-    // Clear the data, except the volume
+    // Clear the data, except the volume; nothing has to be loaded for that
     memset(fat_data + 32, 0, DATA_SIZE - 32);
+    FAT_setResident();
     
     // Clear all the FAT tables in one sweep
     memset(fat_table, 0, (NUMBER_OF_FAT * FAT_SIZE));
@@ -941,114 +1515,286 @@ int OP_format(void)
 
 
 /**
- * Defragment the volume.
- * @return Zero if successful; otherwise, a non-zero value.
+ * DEFRAGMENT
+ *   The volume is rebuilt from a copy of itself.
  */
-int OP_defragment(void)
-{
-    CVERBOSE("OP: defragment...");
-
-    return -1;
-}
+char g_original[DEVICE_SIZE];       /* The volume before it was defragmented */
 
 
 /**
- * Adds a file to the image.
- * @param file The file to add.
- * @param path The path to the file.
+ * Copies a cluster chain of the original volume to the next free clusters.
+ * @param first The first cluster of the chain in the original volume.
+ * @param next The next free cluster; advanced past the copied chain.
+ * @param newFirst Receives the first cluster of the copy; zero if empty.
  * @return Zero if successful; otherwise, a non-zero value.
  */
-int OP_addFile(FILE *file, const char *path)
+int OP_defragmentChain(int first, int *next, int *newFirst)
 {
-    const char *sep0, *sep1;
-    char name[8], ext[3];
+    const byte *table = reinterpret_cast<const byte *>(g_original + BYTES_PER_CLUSTER);
+    int cluster = first;
+    int previous = -1;
 
-    CVERBOSE("OP: adding '%s'...", path);
-   
-    // Get the path
-    sep0 = strrchr(path, '/');
-    sep1 = strrchr(path, '\\');
+    *newFirst = 0;
 
-    // Choose the seperator to use
-    if (sep1)
+    for (int n = 0; cluster >= 2 && cluster < DATA_CLUSTERS + 2; n++)
     {
-        if (!sep0)
+        // A chain longer than the volume has to contain a loop
+        if (n >= DATA_CLUSTERS)
         {
-            sep0 = sep1;
+            return -1;
         }
-        else
+
+        // Bad clusters stay where they are
+        while (*next < DATA_CLUSTERS + 2 && FAT_getEntry(*next) == 0xFF7)
         {
-            if (sep0 < sep1)
-            {
-                sep0 = sep1;
-            }
+            (*next)++;
         }
-    }
-
-    // If there is a seperator we will replace the path
-    if (sep0)
-    {
-        OP_convertToFileName(sep0 + 1, name, ext);
-    }
-    else
-    {
-        OP_convertToFileName(path, name, ext);
-    }
 
-    CINFO("Writing '%s' to '%.8s'.'%.3s'", path, name, ext);
+        if (*next >= DATA_CLUSTERS + 2)
+        {
+            return -2;
+        }
 
-    // Get the file size
-    fseek(file, 0, SEEK_END);
-    long int size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+        memcpy(FAT_getDataPtr(*next), g_original + (FAT_getDataPtr(cluster) - g_data), BYTES_PER_CLUSTER);
 
-    // Ensure we're still error free
-    CASSERT(ferror(file) == 0, "Could not determine the file size of '%s'", path);
-    CASSERT(size <= FILE_BUFFER_SIZE, "Increase FILE_BUFFER_SIZE constant");
+        if (previous == -1)
+        {
+            *newFirst = *next;
+        }
+        else
+        {
+            FAT_setEntry(previous, *next);
+        }
 
-    size_t read = fread(g_bufferFileData, 1, size, file);
-    CASSERT(ferror(file) == 0, "Could not read from '%s'", path);
-    if (read != size)
-    {
-        return -2;
+        FAT_setEntry(*next, 0xFFF);
+        previous = (*next)++;
+        cluster = FAT12_getEntry(table, cluster);
     }
 
-    int entryIndex;
-    int result = FAT_createFile(&entryIndex, name, ext, FAT_ATTRIB_ARCHIVE, g_bufferFileData, size);
-
-    return result * 16;
-}
-
-
-/**
- * Get the name of the file from a file entry.
- * @param entry The entry to get the name of.
- * @param name The name of the file.
- * @param ext The extension of the file.
- * @return Zero if successful; otherwise, a non-zero value.
- */
-int OP_getEntryFileName(char *entry, char name[8], char ext[3])
-{
-    memcpy(name, entry, 8);
-    memcpy(ext, entry + 8, 3);
     return 0;
 }
 
 
 /**
- * Searches for a file with the matching name in the given directory.
- * @param dir The directory to search in.
- * @param name The name of the file.
- * @param match The destination to the store a pointer to the file's entry.
+ * Moves the files of a directory, and those of its sub-directories, to the
+ * next free clusters of the defragmented volume.
+ * @param dir The directory within the defragmented volume.
+ * @param count The number of entries in the directory.
+ * @param self The first cluster of the directory; zero for the root.
+ * @param parent The first cluster of the parent directory; zero for the root.
+ * @param depth The depth of the directory.
+ * @param next The next free cluster.
  * @return Zero if successful; otherwise, a non-zero value.
  */
-int OP_searchFileInDir(char *dir, const char *name, char **match)
+int OP_defragmentDir(char *dir, int count, int self, int parent, int depth, int *next)
 {
-    char lName[8], lExt[3];
-    char eName[8], eExt[3];
+    int result;
 
-    // Convert the inputted name into FAT format.
-    OP_convertToFileName(name, lName, lExt);
+    if (depth > 32)
+    {
+        return -3;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        byte *entry = reinterpret_cast<byte *>(dir + (i * 32));
+        int newFirst;
+
+        // The remainder of the directory is unused
+        if (entry[0] == FAT_FLAG_EMPTY)
+        {
+            break;
+        }
+
+        if (entry[0] == static_cast<byte>(FAT_FLAG_ERASED) ||
+            entry[11] == FAT_ATTRIB_LONGNAME ||
+            (entry[11] & FAT_ATTRIB_VOLUME_LABEL))
+        {
+            continue;
+        }
+
+        // Both special entries refer to directories that have moved as well
+        if (entry[0] == FAT_FLAG_SPECIAL)
+        {
+            setField<DIR::FirstCluster>(entry, static_cast<word>((entry[1] == FAT_FLAG_SPECIAL) ? parent : self));
+            continue;
+        }
+
+        result = OP_defragmentChain(getField<DIR::FirstCluster>(entry), next, &newFirst);
+        if (result)
+        {
+            return result;
+        }
+
+        setField<DIR::FirstCluster>(entry, static_cast<word>(newFirst));
+
+        if (entry[11] & FAT_ATTRIB_SUBDIRECTORY)
+        {
+            for (int cluster = newFirst; cluster >= 2 && cluster < 0xFF0; cluster = FAT_getEntry(cluster))
+            {
+                result = OP_defragmentDir(FAT_getDataPtr(cluster), ENTRIES_PER_DIR, newFirst, self, depth + 1, next);
+                if (result)
+                {
+                    return result;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Defragment the volume. Every file and directory is rewritten as a single
+ * run, in directory order, starting at the first data cluster; the free
+ * space ends up at the back of the volume. Lost clusters are released.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_defragment(void)
+{
+    int next = 2;
+
+    CVERBOSE("OP: defragment...");
+
+    // Every cluster may move, so the whole volume is needed
+    FAT_loadRemaining();
+    memcpy(g_original, g_data, DEVICE_SIZE);
+
+    // Release everything but the bad clusters
+    for (int i = 2; i < DATA_CLUSTERS + 2; i++)
+    {
+        if (FAT_getEntry(i) != 0xFF7)
+        {
+            FAT_setEntry(i, 0x000);
+        }
+    }
+
+    memset(g_data + (METADATA_SECTORS * BYTES_PER_SECTOR), 0, DATA_CLUSTERS * BYTES_PER_CLUSTER);
+
+    return OP_defragmentDir(fat_data, MAX_ROOT_DIRECTORIES, 0, 0, 0, &next);
+}
+
+
+/**
+ * Splits the reservation off a file specification like NOTES.TXT:32K. The
+ * size is either in bytes or, with a K suffix, in kilobytes. A colon that is
+ * not followed by a size, like the one of a drive letter, is left alone.
+ * @param spec The file specification; the reservation is cut off in place.
+ * @param reserve Receives the reserved number of bytes; zero if none.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_parseReservation(char *spec, int *reserve)
+{
+    char *colon = strrchr(spec, ':');
+    char *end;
+
+    *reserve = 0;
+
+    if (!colon || colon[1] < '0' || colon[1] > '9')
+    {
+        return 0;
+    }
+
+    long value = strtol(colon + 1, &end, 10);
+    if (*end == 'K' || *end == 'k')
+    {
+        value *= 1024;
+        end++;
+    }
+
+    if (*end != '\0')
+    {
+        return 0;
+    }
+
+    if (value <= 0 || value > DATA_CLUSTERS * BYTES_PER_CLUSTER)
+    {
+        return -1;
+    }
+
+    *reserve = static_cast<int>(value);
+    *colon = '\0';
+    return 0;
+}
+
+
+/**
+ * Adds a file to the image.
+ * @param file The file to add; NULL to create an empty file.
+ * @param path The path to the file.
+ * @param reserve The number of bytes to reserve for the file to grow into.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_addFile(FILE *file, const char *path, int reserve)
+{
+    char name[8], ext[3];
+
+    CVERBOSE("OP: adding '%s'...", path);
+
+    // Only the file name is stored on the volume
+    OP_convertToFileName(OP_baseName(path), name, ext);
+
+    CINFO("Writing '%s' to '%.8s'.'%.3s'", path, name, ext);
+
+    if (!file)
+    {
+        int entryIndex;
+        return FAT_createFile(&entryIndex, name, ext, FAT_ATTRIB_ARCHIVE, g_bufferFileData, 0, reserve) * 16;
+    }
+
+    // Get the file size
+    fseek(file, 0, SEEK_END);
+    long int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    // Ensure we're still error free
+    CASSERT(ferror(file) == 0, "Could not determine the file size of '%s'", path);
+    CASSERT(size <= FILE_BUFFER_SIZE, "Increase FILE_BUFFER_SIZE constant");
+
+    size_t read = fread(g_bufferFileData, 1, size, file);
+    CASSERT(ferror(file) == 0, "Could not read from '%s'", path);
+    if (read != size)
+    {
+        return -2;
+    }
+
+    int entryIndex;
+    int result = FAT_createFile(&entryIndex, name, ext, FAT_ATTRIB_ARCHIVE, g_bufferFileData, size, reserve);
+
+    return result * 16;
+}
+
+
+/**
+ * Get the name of the file from a file entry.
+ * @param entry The entry to get the name of.
+ * @param name The name of the file.
+ * @param ext The extension of the file.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_getEntryFileName(char *entry, char name[8], char ext[3])
+{
+    memcpy(name, entry, 8);
+    memcpy(ext, entry + 8, 3);
+    return 0;
+}
+
+
+/**
+ * Searches for a file with the matching name in the given directory.
+ * @param dir The directory to search in.
+ * @param name The name of the file.
+ * @param match The destination to the store a pointer to the file's entry.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_searchFileInDir(char *dir, const char *name, char **match)
+{
+    char lName[8], lExt[3];
+    char eName[8], eExt[3];
+
+    // Convert the inputted name into FAT format.
+    OP_convertToFileName(name, lName, lExt);
 
     // Loop over all the entries in the directory
     for (int i = 0; i < ENTRIES_PER_DIR; i++)
@@ -1192,3 +1938,1313 @@ int OP_toUniqueName(char *dir, char *in, char name[8], char ext[3])
 {
     return OP_convertToFileName(in, name, ext);
 }
+
+
+/**
+ * Gets the file name part of a path.
+ * @param path The path to the file.
+ * @return A pointer to the first character after the last seperator.
+ */
+const char * OP_baseName(const char *path)
+{
+    const char *sep0 = strrchr(path, '/');
+    const char *sep1 = strrchr(path, '\\');
+
+    // Choose the last seperator
+    if (sep1 && (!sep0 || sep0 < sep1))
+    {
+        sep0 = sep1;
+    }
+
+    return sep0 ? (sep0 + 1) : path;
+}
+
+
+/**
+ * WATCH
+ *   Once the image has been written, the volume stays resident and every
+ *   change to one of the inputs is patched into it. Only the sectors that
+ *   actually differ are written back to the output file.
+ */
+#define WATCH_RETRY_MS      5       /* Delay before reopening an input that is still being written */
+#define WATCH_RETRIES       100     /* Give up on an input after this many attempts */
+
+char g_metadata[METADATA_SECTORS * BYTES_PER_SECTOR];  /* Boot sector, FATs and root as last written */
+bool g_dirty[TOTAL_SECTORS_FAT16];                      /* Sectors that still have to be written */
+
+
+/**
+ * Writes all the dirty sectors to the output; adjacent sectors are combined.
+ * @param file The opened output file.
+ * @return The number of sectors written, or a negative value on failure.
+ */
+int OP_flushDirty(FILE *file)
+{
+    int written = 0;
+
+    for (int i = 0; i < TOTAL_SECTORS_FAT16; )
+    {
+        if (!g_dirty[i])
+        {
+            i++;
+            continue;
+        }
+
+        int run = 1;
+        while ((i + run) < TOTAL_SECTORS_FAT16 && g_dirty[i + run])
+        {
+            run++;
+        }
+
+        if (fseek(file, i * BYTES_PER_SECTOR, SEEK_SET) ||
+            fwrite(g_data + (i * BYTES_PER_SECTOR), BYTES_PER_SECTOR, run, file) != static_cast<size_t>(run))
+        {
+            return -1;
+        }
+
+        memset(g_dirty + i, 0, run);
+        written += run;
+        i += run;
+    }
+
+    return (fflush(file) == 0) ? written : -2;
+}
+
+
+/**
+ * Replaces the data of a file in the resident volume. The existing cluster
+ * chain is reused as far as possible; it is extended or cut to fit the new
+ * size, but never below the reservation. Data sectors that are unchanged are
+ * not marked dirty. On failure the resident volume is left as it was.
+ * @param path The path of the input file.
+ * @param file The opened input file.
+ * @param reserve The number of bytes reserved for the file.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_patchFile(const char *path, FILE *file, int reserve)
+{
+    char name[8], ext[3];
+    byte *entry = nullptr;
+
+    OP_convertToFileName(OP_baseName(path), name, ext);
+
+    // Inputs are always written to the root directory
+    for (int i = 0; i < MAX_ROOT_DIRECTORIES; i++)
+    {
+        byte *candidate = reinterpret_cast<byte *>(fat_data + (i * 32));
+        if (!memcmp(candidate, name, 8) && !memcmp(candidate + 8, ext, 3))
+        {
+            entry = candidate;
+            break;
+        }
+    }
+
+    if (!entry)
+    {
+        return -1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    if (size < 0 || size > FILE_BUFFER_SIZE)
+    {
+        return -2;
+    }
+
+    if (fread(g_bufferFileData, 1, size, file) != static_cast<size_t>(size))
+    {
+        return -3;
+    }
+
+    int allocate = (reserve > size) ? reserve : static_cast<int>(size);
+    int reqClusters = (allocate + BYTES_PER_CLUSTER - 1) / BYTES_PER_CLUSTER;
+    int cluster = getField<DIR::FirstCluster>(entry);
+    int previous = -1;
+    std::vector<int> chain;
+
+    // The tables are restored if the chain cannot be built, so a failed
+    // patch never reaches the image
+    std::vector<char> savedFat(fat_table, fat_table + (NUMBER_OF_FAT * FAT_SIZE));
+    byte savedEntry[DIR::SIZE];
+    memcpy(savedEntry, entry, DIR::SIZE);
+
+    if (cluster < 2 || cluster >= 0xFF0)
+    {
+        cluster = -1;
+    }
+
+    for (int i = 0; i < reqClusters; i++)
+    {
+        // Extend the chain when the file has grown
+        if (cluster == -1)
+        {
+            short empty;
+            if (FAT_findEmptyCluster(&empty))
+            {
+                memcpy(fat_table, savedFat.data(), savedFat.size());
+                memcpy(entry, savedEntry, DIR::SIZE);
+                return -4;
+            }
+
+            cluster = empty;
+            if (previous == -1)
+            {
+                setField<DIR::FirstCluster>(entry, static_cast<word>(cluster));
+            }
+            else
+            {
+                FAT_setEntry(previous, cluster);
+            }
+            FAT_setEntry(cluster, 0xFFF);
+        }
+
+        chain.push_back(cluster);
+        previous = cluster;
+
+        int next = FAT_getEntry(cluster);
+        cluster = (next >= 2 && next < 0xFF0) ? next : -1;
+    }
+
+    // Cut off the clusters the file no longer needs
+    if (previous == -1)
+    {
+        setField<DIR::FirstCluster>(entry, 0);
+    }
+    else
+    {
+        FAT_setEntry(previous, 0xFFF);
+    }
+
+    while (cluster != -1)
+    {
+        int next = FAT_getEntry(cluster);
+        FAT_setEntry(cluster, 0x000);
+        cluster = (next >= 2 && next < 0xFF0) ? next : -1;
+    }
+
+    // Only now that the chain is complete is the data replaced
+    const char *data = g_bufferFileData;
+    int rem = size;
+
+    for (size_t i = 0; i < chain.size(); i++)
+    {
+        char *dataCluster = FAT_getDataPtr(chain[i]);
+        int write = (rem >= BYTES_PER_CLUSTER) ? BYTES_PER_CLUSTER : rem;
+        char padded[BYTES_PER_CLUSTER];
+
+        memset(padded, 0, BYTES_PER_CLUSTER);
+        memcpy(padded, data, write);
+
+        if (memcmp(dataCluster, padded, BYTES_PER_CLUSTER))
+        {
+            memcpy(dataCluster, padded, BYTES_PER_CLUSTER);
+            for (int j = 0; j < SECTORS_PER_CLUSTER; j++)
+            {
+                g_dirty[(dataCluster - g_data) / BYTES_PER_SECTOR + j] = true;
+            }
+        }
+
+        data += write;
+        rem -= write;
+    }
+
+    setField<DIR::FileSize>(entry, static_cast<dword>(size));
+    return 0;
+}
+
+
+/**
+ * Marks the metadata sectors that differ from what was last written.
+ */
+void OP_markMetadata(void)
+{
+    for (int i = 0; i < METADATA_SECTORS; i++)
+    {
+        char *sector = g_data + (i * BYTES_PER_SECTOR);
+        char *last = g_metadata + (i * BYTES_PER_SECTOR);
+
+        if (memcmp(sector, last, BYTES_PER_SECTOR))
+        {
+            memcpy(last, sector, BYTES_PER_SECTOR);
+            g_dirty[i] = true;
+        }
+    }
+}
+
+
+/**
+ * Gets the last write time of a file.
+ */
+bool OP_lastWrite(const char *path, FILETIME *time)
+{
+    WIN32_FILE_ATTRIBUTE_DATA info;
+
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &info))
+    {
+        return false;
+    }
+
+    *time = info.ftLastWriteTime;
+    return true;
+}
+
+
+/**
+ * Watches the working directory and patches the image whenever one of the
+ * input files changes. Only returns on failure.
+ * @return A non-zero value indicating the failure.
+ */
+int OP_watch(void)
+{
+    std::vector<FILETIME> stamps(g_watched.size());
+    HANDLE change;
+    FILE *output;
+    errno_t err;
+
+    for (size_t i = 0; i < g_watched.size(); i++)
+    {
+        OP_lastWrite(g_watched[i], &stamps[i]);
+    }
+
+    err = fopen_s(&output, g_pathOut, "r+b");
+    if (err)
+    {
+        CERROR("Could not open output file '%s' for patching. (%d)", g_pathOut, err);
+        return -1;
+    }
+
+    memcpy(g_metadata, g_data, sizeof(g_metadata));
+    memset(g_dirty, 0, sizeof(g_dirty));
+
+    // The working directory has already been changed to the -w path
+    change = FindFirstChangeNotificationA(".", FALSE,
+        FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE);
+    if (change == INVALID_HANDLE_VALUE)
+    {
+        fclose(output);
+        return -2;
+    }
+
+    CINFO("Watching %zu files for changes...", g_watched.size());
+
+    while (WaitForSingleObject(change, INFINITE) == WAIT_OBJECT_0)
+    {
+        for (size_t i = 0; i < g_watched.size(); i++)
+        {
+            FILETIME stamp;
+            FILE *input = NULL;
+
+            if (!OP_lastWrite(g_watched[i], &stamp) || !CompareFileTime(&stamp, &stamps[i]))
+            {
+                continue;
+            }
+
+            // The assembler may still hold the file open
+            for (int retry = 0; retry < WATCH_RETRIES; retry++)
+            {
+                if (!fopen_s(&input, g_watched[i], "rb"))
+                {
+                    break;
+                }
+
+                input = NULL;
+                Sleep(WATCH_RETRY_MS);
+            }
+
+            if (!input)
+            {
+                CWARN("Could not open '%s'; it will be retried on the next change.", g_watched[i]);
+                continue;
+            }
+
+            int result = OP_patchFile(g_watched[i], input, g_reserved[i]);
+            fclose(input);
+            stamps[i] = stamp;
+
+            if (result)
+            {
+                CWARN("Could not patch '%s'. (%i)", g_watched[i], result);
+                continue;
+            }
+
+            OP_markMetadata();
+
+            int written = OP_flushDirty(output);
+            if (written < 0)
+            {
+                FindCloseChangeNotification(change);
+                fclose(output);
+                return -3;
+            }
+
+            CINFO("Patched '%s'; %i sectors written.", g_watched[i], written);
+        }
+
+        if (!FindNextChangeNotification(change))
+        {
+            break;
+        }
+    }
+
+    FindCloseChangeNotification(change);
+    fclose(output);
+    return -4;
+}
+
+
+/**
+ * IMPORT
+ *   A host directory tree is imported in two passes. The tree is scanned
+ *   first, with the subdirectories near the top enumerated concurrently, so
+ *   the number of entries of every directory is known before anything is
+ *   allocated. Each directory then receives exactly the clusters it needs as
+ *   a single run, directly followed by the data of its files.
+ */
+#define IMPORT_MAX_DEPTH        32      /* Deepest directory that is imported */
+#define IMPORT_PARALLEL_DEPTH   2       /* Directories above this depth are scanned concurrently */
+
+struct ImportNode_t
+{
+    std::string path;                   /* The path on the host */
+    char name[8];                       /* The name on the volume */
+    char ext[3];                        /* The extension on the volume */
+    byte attributes;                    /* The attributes on the volume */
+    size_t size;                        /* The size of a file in bytes */
+    std::vector<ImportNode_t> children; /* The contents of a directory */
+};
+
+
+/**
+ * Enumerates a host directory and, recursively, its subdirectories.
+ * @param node The directory to scan; its path must be set.
+ * @param depth The depth of the directory.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_scanDir(ImportNode_t *node, int depth)
+{
+    WIN32_FIND_DATAA find;
+    HANDLE handle;
+    int result = 0;
+
+    if (depth > IMPORT_MAX_DEPTH)
+    {
+        return -1;
+    }
+
+    handle = FindFirstFileA((node->path + "\\*").c_str(), &find);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        return -2;
+    }
+
+    // The find data already holds the size; no separate stat is needed
+    do
+    {
+        if (!strcmp(find.cFileName, ".") || !strcmp(find.cFileName, ".."))
+        {
+            continue;
+        }
+
+        ImportNode_t child;
+        bool directory = (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        ULARGE_INTEGER size;
+
+        child.path = node->path + "\\" + find.cFileName;
+        size.LowPart = find.nFileSizeLow;
+        size.HighPart = find.nFileSizeHigh;
+
+        if (!directory && size.QuadPart > static_cast<ULONGLONG>(DATA_CLUSTERS) * BYTES_PER_CLUSTER)
+        {
+            CWARN("Skipped '%s'; it does not fit on the volume.", child.path.c_str());
+            continue;
+        }
+
+        child.size = directory ? 0 : static_cast<size_t>(size.QuadPart);
+
+        // Read-only, hidden and system share their bit values with FAT
+        child.attributes = static_cast<byte>((find.dwFileAttributes & 0x07) |
+            (directory ? FAT_ATTRIB_SUBDIRECTORY : FAT_ATTRIB_ARCHIVE));
+
+        // Names like .gitignore have nothing left for the base name
+        OP_convertToFileName(find.cFileName, child.name, child.ext);
+        if (child.name[0] == ' ')
+        {
+            CWARN("Skipped '%s'; it has no short name.", child.path.c_str());
+            continue;
+        }
+
+        node->children.push_back(child);
+    }
+    while (FindNextFileA(handle, &find));
+
+    FindClose(handle);
+
+    std::vector<std::future<int>> pending;
+    for (size_t i = 0; i < node->children.size() && !result; i++)
+    {
+        ImportNode_t *child = &node->children[i];
+
+        if (!(child->attributes & FAT_ATTRIB_SUBDIRECTORY))
+        {
+            continue;
+        }
+
+        if (depth < IMPORT_PARALLEL_DEPTH)
+        {
+            pending.push_back(std::async(std::launch::async, OP_scanDir, child, depth + 1));
+        }
+        else
+        {
+            result = OP_scanDir(child, depth + 1);
+        }
+    }
+
+    // All scans have to finish before the children may be touched again
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        int scan = pending[i].get();
+        if (scan && !result)
+        {
+            result = scan;
+        }
+    }
+
+    return result;
+}
+
+
+/**
+ * Checks whether the name is already taken by one of the given entries.
+ */
+bool OP_nameTaken(const byte *entries, int count, const char name[8], const char ext[3])
+{
+    for (int i = 0; i < count; i++)
+    {
+        const byte *entry = entries + (i * 32);
+
+        if (entry[0] != FAT_FLAG_EMPTY && entry[0] != static_cast<byte>(FAT_FLAG_ERASED) &&
+            !memcmp(entry, name, 8) && !memcmp(entry + 8, ext, 3))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Makes the short names of the children unique, both among themselves and
+ * against the entries already present, by appending ~1, ~2, and so on.
+ * @param node The directory whose children are renamed.
+ * @param entries The entries already present in the directory, if any.
+ * @param count The number of entries already present.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_uniqueNames(ImportNode_t *node, const byte *entries, int count)
+{
+    for (size_t i = 0; i < node->children.size(); i++)
+    {
+        ImportNode_t *child = &node->children[i];
+        char base[8];
+        int length = 8;
+
+        memcpy(base, child->name, 8);
+        while (length > 0 && base[length - 1] == ' ')
+        {
+            length--;
+        }
+
+        for (int n = 1; ; n++)
+        {
+            bool taken = OP_nameTaken(entries, count, child->name, child->ext);
+
+            for (size_t j = 0; j < i && !taken; j++)
+            {
+                taken = !memcmp(node->children[j].name, child->name, 8) &&
+                        !memcmp(node->children[j].ext, child->ext, 3);
+            }
+
+            if (!taken)
+            {
+                break;
+            }
+
+            char suffix[8];
+            int digits = sprintf_s(suffix, sizeof(suffix), "~%i", n);
+            int keep = (length < 8 - digits) ? length : (8 - digits);
+
+            if (digits >= 8)
+            {
+                return -1;
+            }
+
+            memset(child->name, ' ', 8);
+            memcpy(child->name, base, keep);
+            memcpy(child->name + keep, suffix, digits);
+        }
+
+        if (memcmp(child->name, base, length))
+        {
+            CVERBOSE("Renamed '%s' to '%.8s'.'%.3s'", child->path.c_str(), child->name, child->ext);
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Allocates a run of consecutive clusters, links it and clears its data.
+ * @param count The number of clusters to allocate.
+ * @param first Receives the first cluster of the run.
+ * @return A pointer to the data of the run; nullptr if there is no room.
+ */
+char * OP_allocRun(int count, short *first)
+{
+    if (FAT_findEmptyRun(count, first))
+    {
+        return nullptr;
+    }
+
+    // The data area is linear, so a run of clusters is one block of memory
+    for (int i = 0; i < count; i++)
+    {
+        FAT_setEntry(*first + i, (i == count - 1) ? 0xFFF : (*first + i + 1));
+        memset(FAT_getNewDataPtr(*first + i), 0, BYTES_PER_CLUSTER);
+    }
+
+    return FAT_getDataPtr(*first);
+}
+
+
+/**
+ * Fills in a directory entry.
+ */
+void OP_setEntry(byte *entry, const char name[8], const char ext[3], byte attributes, word first, dword size)
+{
+    memset(entry, 0, 32);
+    setBytes<DIR::Name>(entry, name);
+    setBytes<DIR::Extension>(entry, ext);
+    setField<DIR::Attributes>(entry, attributes);
+    setField<DIR::FirstCluster>(entry, first);
+    setField<DIR::FileSize>(entry, size);
+}
+
+
+/**
+ * Gets the number of clusters a subdirectory needs, including '.' and '..'.
+ */
+int OP_dirClusters(const ImportNode_t *node)
+{
+    return static_cast<int>(((node->children.size() + 2) + ENTRIES_PER_DIR - 1) / ENTRIES_PER_DIR);
+}
+
+
+/**
+ * Writes the children of a scanned directory into the volume; the files of
+ * a directory are allocated before its subdirectories, right behind it.
+ * @param node The scanned directory.
+ * @param entries The entries of the directory on the volume.
+ * @param count The number of entries the directory can hold.
+ * @param self The first cluster of the directory; zero for the root.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_importDir(ImportNode_t *node, byte *entries, int count, int self)
+{
+    int slot = 0;
+    int result;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (size_t i = 0; i < node->children.size(); i++)
+        {
+            ImportNode_t *child = &node->children[i];
+            bool directory = (child->attributes & FAT_ATTRIB_SUBDIRECTORY) != 0;
+            short first = 0;
+            char *data;
+            FILE *file;
+
+            if (directory != (pass == 1))
+            {
+                continue;
+            }
+
+            // Take the next free entry; the root may already hold files
+            while (slot < count && entries[slot * 32] != FAT_FLAG_EMPTY &&
+                entries[slot * 32] != static_cast<byte>(FAT_FLAG_ERASED))
+            {
+                slot++;
+            }
+
+            if (slot == count)
+            {
+                return -1;
+            }
+
+            if (directory)
+            {
+                int clusters = OP_dirClusters(child);
+
+                data = OP_allocRun(clusters, &first);
+                if (!data)
+                {
+                    return -2;
+                }
+
+                byte *table = reinterpret_cast<byte *>(data);
+                OP_setEntry(table, ".       ", "   ", FAT_ATTRIB_SUBDIRECTORY, first, 0);
+                OP_setEntry(table + 32, "..      ", "   ", FAT_ATTRIB_SUBDIRECTORY, static_cast<word>(self), 0);
+
+                result = OP_uniqueNames(child, table, 2);
+                if (!result)
+                {
+                    result = OP_importDir(child, table, clusters * ENTRIES_PER_DIR, first);
+                }
+
+                if (result)
+                {
+                    return result;
+                }
+            }
+            else if (child->size > 0)
+            {
+                int clusters = static_cast<int>((child->size + BYTES_PER_CLUSTER - 1) / BYTES_PER_CLUSTER);
+
+                data = OP_allocRun(clusters, &first);
+                if (!data)
+                {
+                    return -2;
+                }
+
+                if (fopen_s(&file, child->path.c_str(), "rb"))
+                {
+                    CERROR("Could not open file '%s' for reading.", child->path.c_str());
+                    return -3;
+                }
+
+                // The file must not have changed since it was scanned
+                size_t read = fread(data, 1, child->size, file);
+                bool longer = (fgetc(file) != EOF);
+                fclose(file);
+
+                if (read != child->size || longer)
+                {
+                    CERROR("File '%s' changed during the import.", child->path.c_str());
+                    return -4;
+                }
+            }
+
+            OP_setEntry(entries + (slot * 32), child->name, child->ext, child->attributes,
+                static_cast<word>(first), static_cast<dword>(child->size));
+            slot++;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Imports a host directory tree into the root directory of the volume.
+ * @param path The path of the host directory.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int OP_importTree(const char *path)
+{
+    ImportNode_t root;
+    int result;
+
+    CVERBOSE("OP: importing '%s'...", path);
+
+    root.path = path;
+    while (!root.path.empty() && (root.path.back() == '\\' || root.path.back() == '/'))
+    {
+        root.path.pop_back();
+    }
+
+    result = OP_scanDir(&root, 0);
+    if (result)
+    {
+        return result;
+    }
+
+    result = OP_uniqueNames(&root, reinterpret_cast<byte *>(fat_data), MAX_ROOT_DIRECTORIES);
+    if (result)
+    {
+        return result * 16;
+    }
+
+    result = OP_importDir(&root, reinterpret_cast<byte *>(fat_data), MAX_ROOT_DIRECTORIES, 0);
+    if (result)
+    {
+        return result * 256;
+    }
+
+    CINFO("Imported '%s'.", path);
+    return 0;
+}
+
+
+/**
+ * COMMANDS
+ *   Several steps of the image pipeline can run in a single invocation,
+ *   separated by the word 'then'. The build step loads and assembles the
+ *   volume once; the steps after it work on the volume in memory, and it is
+ *   saved once at the very end. For example:
+ *     writefloppy2 build -b boot.bin -o out.flp kernel.bin then verify then stats
+ */
+#define CMD_SEPARATOR   "then"      /* Separates the commands of a chain */
+
+const char *g_commands[] = { "build", "raw", "inspect", "stats", "verify", "diff", "extract" };
+
+
+/**
+ * Checks whether the word names a command.
+ */
+bool CMD_isCommand(const char *name)
+{
+    for (size_t i = 0; i < sizeof(g_commands) / sizeof(g_commands[0]); i++)
+    {
+        if (!strcmp(name, g_commands[i]))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Gets the attributes of an entry as text, e.g. "RHS-DA".
+ */
+std::string CMD_attributes(byte attributes)
+{
+    const char *flags = "RHSVDA";
+    std::string text;
+
+    for (int i = 0; i < 6; i++)
+    {
+        text += (attributes & (1 << i)) ? flags[i] : '-';
+    }
+
+    return text;
+}
+
+
+/**
+ * Gets the number of separate runs a chain consists of.
+ */
+int CMD_runs(const std::vector<uint16_t> &chain)
+{
+    int runs = chain.empty() ? 0 : 1;
+
+    for (size_t i = 1; i < chain.size(); i++)
+    {
+        if (chain[i] != chain[i - 1] + 1)
+        {
+            runs++;
+        }
+    }
+
+    return runs;
+}
+
+
+/**
+ * Writes an unformatted image, like writeraw does.
+ * @param argc The number of arguments.
+ * @param argv The arguments: -o <path>, -w <path>, --trim and the input files.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int CMD_raw(int argc, char **argv)
+{
+    RawImage_t image;
+    const char *path = nullptr;
+    std::vector<const char *> inputs;
+    bool trim = false;
+    int result;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+        {
+            path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-w") && i + 1 < argc)
+        {
+            if (!SetCurrentDirectoryA(argv[++i]))
+            {
+                CERROR("Could not change the working directory to '%s'. (%i)", argv[i], GetLastError());
+                return -1;
+            }
+        }
+        else if (!strcmp(argv[i], "--trim"))
+        {
+            trim = true;
+        }
+        else
+        {
+            inputs.push_back(argv[i]);
+        }
+    }
+
+    if (!path || OUTPUT_isStdout(path))
+    {
+        CERROR("The raw command needs an output file.");
+        return -2;
+    }
+
+    result = RAW_create(&image, path, DEVICE_SIZE);
+    if (result)
+    {
+        CERROR("Could not open output file '%s'. (%i, %i)", path, result, GetLastError());
+        return -3;
+    }
+
+    image.trim = trim;
+
+    for (size_t i = 0; i < inputs.size() && !result; i++)
+    {
+        FILE *lpFileIn;
+
+        if (fopen_s(&lpFileIn, inputs[i], "rb"))
+        {
+            CERROR("Could not open input file '%s'.", inputs[i]);
+            result = -4;
+            break;
+        }
+
+        result = RAW_append(&image, lpFileIn, inputs[i]);
+        fclose(lpFileIn);
+
+        if (result)
+        {
+            CERROR("Could not write file '%s'. (%i)", inputs[i], result);
+            break;
+        }
+
+        CINFO("Writing '%s' to 0x%08zX", inputs[i], image.placements.back().lba * BYTES_PER_SECTOR);
+    }
+
+    if (RAW_close(&image) && !result)
+    {
+        CERROR("Could not flush output file '%s'.", path);
+        result = -5;
+    }
+
+    if (!result && RAW_writeMap(&image, path))
+    {
+        CERROR("Could not write the sector map of '%s'.", path);
+        result = -6;
+    }
+
+    return result;
+}
+
+
+/**
+ * Lists every file and directory of the volume.
+ */
+int CMD_inspect(const Volume_t *volume, const std::vector<VolumeEntry_t> &entries)
+{
+    CINFO("Volume '%.11s', %i clusters of %zu bytes.",
+        volume->bpb.volumeLabel, volume->clusters, volume->clusterSize);
+    CINFO("  %-6s %-8s %-4s %-10s %-6s %s", "FIRST", "CLUSTERS", "RUNS", "SIZE", "ATTR", "PATH");
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const VolumeEntry_t &found = entries[i];
+
+        CINFO("  %-6u %-8zu %-4i %-10u %-6s %s", found.entry.firstCluster, found.chain.size(),
+            CMD_runs(found.chain), found.entry.fileSize, CMD_attributes(found.entry.attributes).c_str(),
+            found.path.c_str());
+    }
+
+    return 0;
+}
+
+
+/**
+ * Summarizes the use and fragmentation of the volume.
+ */
+int CMD_stats(const Volume_t *volume, const std::vector<VolumeEntry_t> &entries)
+{
+    std::vector<bool> owned(volume->clusters + 2, false);
+    int files = 0, dirs = 0, fragmented = 0;
+    int used = 0, unused = 0, bad = 0, lost = 0, run = 0, largest = 0;
+    size_t bytes = 0;
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const VolumeEntry_t &found = entries[i];
+
+        if (found.entry.attributes & FAT_ATTRIB_SUBDIRECTORY)   dirs++;
+        else                                                    { files++; bytes += found.entry.fileSize; }
+
+        if (CMD_runs(found.chain) > 1)
+        {
+            fragmented++;
+        }
+
+        for (size_t j = 0; j < found.chain.size(); j++)
+        {
+            owned[found.chain[j]] = true;
+        }
+    }
+
+    for (int i = 2; i < volume->clusters + 2; i++)
+    {
+        int value = VOLUME_getEntry(volume, i);
+
+        if (value == 0x000)         unused++;
+        else if (value == 0xFF7)    bad++;
+        else                        { used++; lost += owned[i] ? 0 : 1; }
+
+        run = (value == 0x000) ? (run + 1) : 0;
+        largest = (run > largest) ? run : largest;
+    }
+
+    CINFO("Files: %i (%zu bytes), directories: %i", files, bytes, dirs);
+    CINFO("Clusters: %i used, %i free, %i bad, %i lost", used, unused, bad, lost);
+    CINFO("Fragmented: %i of %zu chains; largest free run %i clusters", fragmented, entries.size(), largest);
+
+    return 0;
+}
+
+
+/**
+ * Checks the FATs, cluster chains and directories of the volume. Clusters
+ * beyond a file's size are allowed, since reservations leave them behind.
+ * @return Zero if the volume is consistent; otherwise, a non-zero value.
+ */
+int CMD_verify(const Volume_t *volume, const std::vector<VolumeEntry_t> &entries)
+{
+    std::vector<int> owner(volume->clusters + 2, -1);
+    int errors = 0, warnings = 0;
+
+    for (int i = 1; i < volume->bpb.numberOfFats; i++)
+    {
+        if (memcmp(volume->image + volume->fatOffset, volume->image + volume->fatOffset + (i * volume->fatSize), volume->fatSize))
+        {
+            CWARN("FAT %i does not match the first FAT.", i + 1);
+            errors++;
+        }
+    }
+
+    if ((VOLUME_getEntry(volume, 0) & 0xFF) != volume->bpb.mediaDescriptor)
+    {
+        CWARN("The first FAT entry does not hold the media descriptor.");
+        warnings++;
+    }
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const VolumeEntry_t &found = entries[i];
+        const char *path = found.path.c_str();
+        bool directory = (found.entry.attributes & FAT_ATTRIB_SUBDIRECTORY) != 0;
+
+        static const char *reasons[] = { "", "leaves the volume", "runs into a free cluster",
+            "runs into a bad cluster", "loops" };
+        if (found.status != VOLUME_CHAIN_OK)
+        {
+            CWARN("The chain of '%s' %s.", path, reasons[found.status]);
+            errors++;
+        }
+
+        for (size_t j = 0; j < found.chain.size(); j++)
+        {
+            int cluster = found.chain[j];
+            if (owner[cluster] != -1)
+            {
+                CWARN("'%s' and '%s' share cluster %i.", entries[owner[cluster]].path.c_str(), path, cluster);
+                errors++;
+                break;
+            }
+            owner[cluster] = static_cast<int>(i);
+        }
+
+        size_t needed = (found.entry.fileSize + volume->clusterSize - 1) / volume->clusterSize;
+        if (!directory && found.chain.size() < needed)
+        {
+            CWARN("'%s' holds %u bytes in %zu clusters.", path, found.entry.fileSize, found.chain.size());
+            errors++;
+        }
+
+        if (directory)
+        {
+            size_t slash = found.path.rfind('\\');
+            const VolumeEntry_t *parent = (slash == std::string::npos) ? nullptr :
+                VOLUME_find(entries, found.path.substr(0, slash).c_str());
+            int expected = parent ? parent->entry.firstCluster : 0;
+            const byte *dir = found.chain.empty() ? nullptr : VOLUME_cluster(volume, found.chain[0]);
+
+            if (!dir || memcmp(dir, ".          ", 11) || LE_load16(dir + DIR::FirstCluster::offset) != found.entry.firstCluster ||
+                memcmp(dir + 32, "..         ", 11) || LE_load16(dir + 32 + DIR::FirstCluster::offset) != expected)
+            {
+                CWARN("The '.' and '..' entries of '%s' are wrong.", path);
+                errors++;
+            }
+        }
+    }
+
+    int lost = 0;
+    for (int i = 2; i < volume->clusters + 2; i++)
+    {
+        int value = VOLUME_getEntry(volume, i);
+        if (value != 0x000 && value != 0xFF7 && owner[i] == -1)
+        {
+            lost++;
+        }
+    }
+
+    if (lost)
+    {
+        CWARN("%i clusters are allocated but belong to no file.", lost);
+        warnings++;
+    }
+
+    if (errors)
+    {
+        CERROR("The volume has %i errors and %i warnings.", errors, warnings);
+        return -1;
+    }
+
+    CINFO("The volume is consistent; %i warnings.", warnings);
+    return 0;
+}
+
+
+/**
+ * Compares the volume with another image, by sector and by file.
+ * @param argc The number of arguments.
+ * @param argv The path of the other image; plain, compressed or a recipe.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int CMD_diff(const Volume_t *volume, const std::vector<VolumeEntry_t> &entries, int argc, char **argv)
+{
+    std::vector<byte> other(DEVICE_SIZE, 0);
+    std::vector<VolumeEntry_t> otherEntries;
+    Volume_t otherVolume;
+    byte magic[4];
+    FILE *file;
+    int result = 0;
+
+    if (argc != 1)
+    {
+        CERROR("The diff command takes the path of an image.");
+        return -1;
+    }
+
+    if (fopen_s(&file, argv[0], "rb"))
+    {
+        CERROR("Could not open image '%s'.", argv[0]);
+        return -2;
+    }
+
+    size_t read = fread(magic, 1, sizeof(magic), file);
+    rewind(file);
+
+    if (STORE_detect(magic, read))      result = STORE_readRecipe(file, argv[0], other.data(), DEVICE_SIZE);
+    else if (CIMG_detect(magic, read))  result = CIMG_read(file, other.data(), DEVICE_SIZE);
+    else                                fread(other.data(), 1, DEVICE_SIZE, file);
+
+    fclose(file);
+
+    if (result || VOLUME_open(&otherVolume, other.data(), other.size()))
+    {
+        CERROR("Could not read image '%s'. (%i)", argv[0], result);
+        return -3;
+    }
+
+    int metadata = 0, data = 0;
+    for (int i = 0; i < TOTAL_SECTORS_FAT16; i++)
+    {
+        if (memcmp(volume->image + (i * BYTES_PER_SECTOR), other.data() + (i * BYTES_PER_SECTOR), BYTES_PER_SECTOR))
+        {
+            (i < METADATA_SECTORS) ? metadata++ : data++;
+        }
+    }
+
+    CINFO("%i sectors differ; %i metadata and %i data.", metadata + data, metadata, data);
+
+    VOLUME_walk(&otherVolume, otherEntries);
+
+    // Files present in this volume: added or modified
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const VolumeEntry_t *match = VOLUME_find(otherEntries, entries[i].path.c_str());
+        std::vector<byte> mine, theirs;
+
+        if (!match)
+        {
+            CINFO("  + %s", entries[i].path.c_str());
+            continue;
+        }
+
+        VOLUME_read(volume, &entries[i], mine);
+        VOLUME_read(&otherVolume, match, theirs);
+
+        if (mine != theirs || entries[i].entry.attributes != match->entry.attributes)
+        {
+            CINFO("  M %s", entries[i].path.c_str());
+        }
+    }
+
+    // Files only present in the other image: removed
+    for (size_t i = 0; i < otherEntries.size(); i++)
+    {
+        if (!VOLUME_find(entries, otherEntries[i].path.c_str()))
+        {
+            CINFO("  - %s", otherEntries[i].path.c_str());
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Copies a file of the volume to the host.
+ * @param argc The number of arguments.
+ * @param argv The path on the volume and the path on the host.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int CMD_extract(const Volume_t *volume, const std::vector<VolumeEntry_t> &entries, int argc, char **argv)
+{
+    std::vector<byte> data;
+    FILE *file;
+
+    if (argc != 2)
+    {
+        CERROR("The extract command takes a path on the volume and a path on the host.");
+        return -1;
+    }
+
+    const VolumeEntry_t *found = VOLUME_find(entries, argv[0]);
+    if (!found || (found->entry.attributes & FAT_ATTRIB_SUBDIRECTORY))
+    {
+        CERROR("There is no file '%s' on the volume.", argv[0]);
+        return -2;
+    }
+
+    VOLUME_read(volume, found, data);
+    if (data.size() != found->entry.fileSize)
+    {
+        CERROR("The chain of '%s' is shorter than the file.", argv[0]);
+        return -3;
+    }
+
+    if (fopen_s(&file, argv[1], "wb"))
+    {
+        CERROR("Could not open file '%s' for writing.", argv[1]);
+        return -4;
+    }
+
+    size_t written = data.empty() ? 0 : fwrite(data.data(), 1, data.size(), file);
+    if ((fclose(file) != 0) | (written != data.size()))
+    {
+        CERROR("Could not write file '%s'.", argv[1]);
+        return -5;
+    }
+
+    CINFO("Extracted '%s' to '%s'; %zu bytes.", found->path.c_str(), argv[1], data.size());
+    return 0;
+}
+
+
+/**
+ * Runs a single command of a chain.
+ * @param argc The number of arguments, including the command name.
+ * @param argv The command name followed by its arguments.
+ * @param built Set once the volume has been built.
+ * @return Zero if successful; otherwise, a non-zero value.
+ */
+int CMD_dispatch(int argc, char **argv, bool *built)
+{
+    std::vector<VolumeEntry_t> entries;
+    Volume_t volume;
+
+    if (argc == 0 || !CMD_isCommand(argv[0]))
+    {
+        CERROR("Expected a command instead of '%s'.", argc ? argv[0] : CMD_SEPARATOR);
+        return -1;
+    }
+
+    if (!strcmp(argv[0], "build"))
+    {
+        if (*built)
+        {
+            CERROR("A chain can only build a single volume.");
+            return -2;
+        }
+
+        *built = true;
+        return (configure(argc - 1, argv + 1) || buildVolume()) ? -3 : 0;
+    }
+
+    if (!strcmp(argv[0], "raw"))
+    {
+        return CMD_raw(argc - 1, argv + 1);
+    }
+
+    if (!*built)
+    {
+        CERROR("The '%s' command needs a volume; start the chain with build.", argv[0]);
+        return -4;
+    }
+
+    // The volume commands look at the whole image
+    FAT_loadRemaining();
+    if (VOLUME_open(&volume, reinterpret_cast<byte *>(g_data), DEVICE_SIZE))
+    {
+        CERROR("The volume does not describe a FAT12 file system.");
+        return -5;
+    }
+
+    VOLUME_walk(&volume, entries);
+
+    if (!strcmp(argv[0], "inspect"))    return CMD_inspect(&volume, entries);
+    if (!strcmp(argv[0], "stats"))      return CMD_stats(&volume, entries);
+    if (!strcmp(argv[0], "verify"))     return CMD_verify(&volume, entries);
+    if (!strcmp(argv[0], "diff"))       return CMD_diff(&volume, entries, argc - 1, argv + 1);
+
+    return CMD_extract(&volume, entries, argc - 1, argv + 1);
+}
+
+
+/**
+ * Runs a chain of commands; the volume is saved once, after the last one,
+ * when the build step named an output.
+ * @param argc The number of arguments.
+ * @param argv The commands and their arguments.
+ * @return EXIT_SUCCESS if every command succeeded; otherwise, EXIT_FAILURE.
+ */
+int CMD_run(int argc, char **argv)
+{
+    bool built = false;
+    int result = 0;
+    int start = 0;
+
+    for (int i = 0; i <= argc && !result; i++)
+    {
+        if (i < argc && strcmp(argv[i], CMD_SEPARATOR))
+        {
+            continue;
+        }
+
+        result = CMD_dispatch(i - start, argv + start, &built);
+        start = i + 1;
+    }
+
+    if (!result && built && g_outputGiven)
+    {
+        result = saveVolume();
+    }
+
+    FAT_release();
+    return result ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -6,10 +6,10 @@
 
 const bool VERBOSE = false;
 
-#define CINFO(fmt, ...)     fprintf(stdout, fmt"\n", ##__VA_ARGS__)
-#define CWARN(fmt, ...)     fprintf(stdout, "WARNING: "fmt"\n", ##__VA_ARGS__)
+#define CINFO(fmt, ...)     fprintf(g_console, fmt"\n", ##__VA_ARGS__)
+#define CWARN(fmt, ...)     fprintf(g_console, "WARNING: "fmt"\n", ##__VA_ARGS__)
 #define CERROR(fmt, ...)    fprintf(stderr, "ERROR: "fmt"\n", ##__VA_ARGS__)
-#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(stdout, "[VERBOSE] "fmt"\n", ##__VA_ARGS__); }
+#define CVERBOSE(fmt, ...)  if (VERBOSE) { fprintf(g_console, "[VERBOSE] "fmt"\n", ##__VA_ARGS__); }
 #define CASSERT(ex, fmt, ...) \
     if (!(ex)) { \
         fprintf(stderr, "ASSERTION FAILURE\n\t%s @ %i\n\t"#ex"\n\t"fmt"\n", __FILE__, __LINE__, ##__VA_ARGS__); \
@@ -17,12 +17,14 @@ const bool VERBOSE = false;
     }
 
 #include "settings.inc"
+#include "../common/rawimage.hpp"
+#include "../common/output.hpp"
 
-char g_data[DEVICE_SIZE];           /* Contains all the date of the image. */
 char g_workingDirectory[MAX_PATH];  /* The path to the working directory */
 char g_pathOut[MAX_PATH];           /* The filename of the output file */
 std::queue<char*> g_queue;          /* All the input file names */
-size_t g_totalWritten;              /* Number of bytes written in total */
+bool g_trim;                        /* Ends the output after the last input */
+FILE *g_console = stdout;           /* Receives the progress messages */
 
 
 /**
@@ -30,10 +32,9 @@ size_t g_totalWritten;              /* Number of bytes written in total */
  */
 void setDefaults(void)
 {
-    memset(g_data, 0, DEVICE_SIZE);
     memset(g_workingDirectory, 0, MAX_PATH);
     memset(g_pathOut, 0, MAX_PATH);
-    g_totalWritten = 0;
+    g_trim = false;
 }
 
 
@@ -57,7 +58,12 @@ bool procArguments(int argc, char **argv)
             arg = (argv[i] + 1);
 
 
-            if (arg[0] == 'w')
+            if (!strcmp(arg, "-trim"))
+            {
+                g_trim = true;
+                CVERBOSE("Trimmed output is enabled.");
+            }
+            else if (arg[0] == 'w')
             {
                 VALUE_CHECK("-w");
                 strncpy_s(g_workingDirectory, MAX_PATH, argv[i], _TRUNCATE);
@@ -68,6 +74,12 @@ bool procArguments(int argc, char **argv)
                 VALUE_CHECK("-o");
                 strncpy_s(g_pathOut, MAX_PATH, argv[i], _TRUNCATE);
                 CVERBOSE("Set output file to '%s'", g_pathOut);
+
+                // The image takes the standard output; keep it clean
+                if (OUTPUT_isStdout(g_pathOut))
+                {
+                    g_console = stderr;
+                }
             }
             else
             {
@@ -94,6 +106,7 @@ void printUsage(char *lpExeName)
  * OPTIONS
  *   -w <path>  Changes the working directory.
  *   -o <path>  Set the output file.
+ *   --trim     End the output after the last input.
  */
 
     printf("\nUSAGE: %s <options> file <additional files>\n", lpExeName);
@@ -105,7 +118,8 @@ void printUsage(char *lpExeName)
     // Options
     printf("\nOPTIONS\n");
     OPTION_EXT("-w", "<path>", "Changes the working directory.");
-    OPTION_EXT("-o", "<path>", "Changes the output file.");
+    OPTION_EXT("-o", "<path>", "Changes the output file; use - for the standard output.");
+    OPTION_EXT("--trim", "", "Ends the output after the last input file.");
 }
 
 
@@ -117,8 +131,6 @@ void printUsage(char *lpExeName)
  */
 int initialize(int argc, char **argv)
 {
-    CINFO("Initializing...");
-
     if (argc < 3)
     {
         printUsage(argv[0]);
@@ -135,6 +147,8 @@ int initialize(int argc, char **argv)
         return -2;
     }
 
+    CINFO("Initializing...");
+
     // Change the working directory if specified
     if (g_workingDirectory[0] != '\0')
     {
@@ -152,77 +166,9 @@ int initialize(int argc, char **argv)
 }
 
 
-int copyFileData(FILE *lpFileOut, FILE *lpFileIn, const char *filename)
-{
-    char buffer[BYTES_PER_SECTOR];
-    size_t read, written;
-    bool notified = false;
-
-    do
-    {
-        memset(buffer, 0, BYTES_PER_SECTOR);
-        read = fread(buffer, 1, BYTES_PER_SECTOR, lpFileIn);
-        CASSERT(ferror(lpFileIn) == 0, "An error occured while reading from '%s'", filename);
-
-        if (read > 0)
-        {
-            if ((g_totalWritten + BYTES_PER_SECTOR) > DEVICE_SIZE)
-            {
-                CERROR("Tried to write too many bytes to the output.");
-                return -1;
-            }
-
-            if (!notified)
-            {
-                notified = true;
-                CINFO("Writing '%s' to 0x%08zX", filename, g_totalWritten);
-            }
-
-            written = fwrite(buffer, 1, BYTES_PER_SECTOR, lpFileOut);
-            CASSERT(ferror(lpFileOut) == 0, "An error occured while writing.");
-
-            if (written != BYTES_PER_SECTOR)
-            {
-                CERROR("Could not write buffer to '%s'.", filename);
-                return -2;
-            }
-
-            g_totalWritten += BYTES_PER_SECTOR;
-        }
-    }
-    while (read == BYTES_PER_SECTOR);
-
-    return 0;
-}
-
-
-int appendOutput(FILE *lpFileOut, char *filename)
-{
-    char buffer[BYTES_PER_SECTOR];
-    size_t written;
-
-    memset(buffer, 0, BYTES_PER_SECTOR);
-
-    while (g_totalWritten < DEVICE_SIZE)
-    {
-        written = fwrite(buffer, 1, BYTES_PER_SECTOR, lpFileOut);
-        CASSERT(ferror(lpFileOut) == 0, "An error occured while writing.");
-
-        if (written != BYTES_PER_SECTOR)
-        {
-            CERROR("Could not write buffer to '%s'.", filename);
-            return -1;
-        }
-
-        g_totalWritten += BYTES_PER_SECTOR;
-    }
-
-    return 0;
-}
-
-
 int main(int argc, char **argv)
 {
+    RawImage_t image;
     FILE *lpFileOut, *lpFileIn;
     errno_t err;
     int result;
@@ -236,47 +182,68 @@ int main(int argc, char **argv)
 
     CASSERT(g_pathOut[0] != '\0', "Output file not set.");
 
-    err = fopen_s(&lpFileOut, g_pathOut, "wb");
-    if (!err)
+    // The image is created at the size of the device; anything not written
+    // to below stays zero. A pipe is filled front to back instead.
+    if (OUTPUT_isStdout(g_pathOut))
     {
-        while (!g_queue.empty())
-        {
-            char *filename = g_queue.front();
+        err = OUTPUT_open(&lpFileOut, g_pathOut);
+        result = err ? -1 : RAW_createStream(&image, lpFileOut, DEVICE_SIZE);
+    }
+    else
+    {
+        result = RAW_create(&image, g_pathOut, DEVICE_SIZE);
+    }
 
-            err = fopen_s(&lpFileIn, filename, "rb");
-            if (err)
-            {
-                CERROR("Could not open input file '%s'.", filename);
-                break;
-            }
+    if (result)
+    {
+        CERROR("Could not open output file '%s'. (%i, %i)", g_pathOut, result, GetLastError());
+        return 0;
+    }
 
-            result = copyFileData(lpFileOut, lpFileIn, filename);
-            if (result)
-            {
-                fclose(lpFileIn);
-                CERROR("Could not write file '%s'. (%i)", filename, result);
-                break;
-            }
+    image.trim = g_trim;
 
-            result = appendOutput(lpFileOut, filename);
-            fclose(lpFileOut);
+    while (!g_queue.empty())
+    {
+        char *filename = g_queue.front();
 
-            if (result)
-            {
-                CERROR("Could not append file '%s'. (%i)", filename, result);
-                break;
-            }
+        err = fopen_s(&lpFileIn, filename, "rb");
+        if (err)
+        {
+            CERROR("Could not open input file '%s'.", filename);
+            break;
+        }
 
-            g_queue.pop();
+        result = RAW_append(&image, lpFileIn, filename);
+        fclose(lpFileIn);
+
+        if (result)
+        {
+            CERROR("Could not write file '%s'. (%i)", filename, result);
+            break;
         }
 
-        fclose(lpFileOut);
+        CINFO("Writing '%s' to 0x%08zX", filename, image.placements.back().lba * BYTES_PER_SECTOR);
+        g_queue.pop();
     }
-    else
+
+    result = RAW_close(&image);
+    if (result)
     {
-        CERROR("Could not open output file '%s'.", g_pathOut);
+        CERROR("Could not flush output file '%s'. (%i, %i)", g_pathOut, result, GetLastError());
+        return 0;
+    }
+
+    // There is no file to place the sector map next to
+    if (OUTPUT_isStdout(g_pathOut))
+    {
+        return 0;
+    }
+
+    result = RAW_writeMap(&image, g_pathOut);
+    if (result)
+    {
+        CERROR("Could not write the sector map of '%s'. (%i)", g_pathOut, result);
     }
 
     return 0;
 }
-